@@ -0,0 +1,174 @@
+/* Adaptive frequencies for the arithmetic coder. The counts from the
+   bins file are only a starting point: every symbol coded adds to the
+   count of its bin, so that the coder follows the floats actually being
+   coded, even when they are not the ones the bins were built from. When
+   the counts add up to more than ADAPT_MAX_TOTAL they are all halved,
+   which both keeps the total small enough for the coder and lets older
+   symbols count for less than recent ones. (With very many bins the
+   limit is raised, so that halving is still not needed often.)
+
+   The counts are held in a Fenwick tree, so that the cumulative count
+   before any bin, and the bin that a target cumulative count falls in,
+   can both be found in log2(num_bins) steps, and so can each update.
+
+   Each block starts again from the counts in the bins file, scaled down
+   to ADAPT_PRIOR_TOTAL, so blocks can still be coded and decoded on their
+   own. With a table for each column, each table adapts separately.
+
+   Needs helpers.c to have been included first.
+*/
+
+#define ADAPT_PRIOR_TOTAL (1<<12)	// counts of each table to start with
+#define ADAPT_INC 32			// added for each symbol coded
+#define ADAPT_MAX_TOTAL (1<<20)		// halve the counts above this
+
+typedef struct {
+	size_t num_bins;
+	uint32_t *cnt;		// the count of each bin
+	uint32_t *tree;		// Fenwick tree over cnt[], tree[1..num_bins]
+	uint32_t total;		// sum of cnt[]
+	uint32_t limit;		// halve the counts when total gets above it
+	size_t top;		// biggest power of two <= num_bins
+} adaptive_model;
+
+/* fill tree[] in from cnt[] */
+static void
+adaptive_build(adaptive_model *am) {
+	size_t i, j;
+
+	am->total = 0;
+	for (i=1; i<=am->num_bins; i++) {
+		am->tree[i] = am->cnt[i-1];
+		am->total += am->cnt[i-1];
+	}
+	for (i=1; i<=am->num_bins; i++) {
+		j = i + (i & -i);
+		if (j <= am->num_bins) {
+			am->tree[j] += am->tree[i];
+		}
+	}
+}
+
+/* one adaptive model for each table of ms, starting from its counts */
+adaptive_model *
+adaptive_start(const model_set *ms) {
+	adaptive_model *am = malloc(ms->num_models*sizeof(*am));
+	const bin_model *m;
+	uint64_t prev;
+	size_t k, i;
+
+	assert(am);
+	for (k=0; k<ms->num_models; k++) {
+		m = ms->models+k;
+		am[k].num_bins = m->num_bins;
+		am[k].cnt = malloc(m->num_bins*sizeof(*am[k].cnt));
+		am[k].tree = malloc((m->num_bins+1)*sizeof(*am[k].tree));
+		assert(am[k].cnt && am[k].tree);
+		for (prev=0, i=0; i<m->num_bins; i++) {
+			/* every bin gets at least one */
+			am[k].cnt[i] = 1 + (m->c[i]-prev)*ADAPT_PRIOR_TOTAL /
+				m->total;
+			prev = m->c[i];
+		}
+		for (am[k].top=1; 2*am[k].top<=m->num_bins; am[k].top*=2) {
+		}
+		am[k].limit = ADAPT_MAX_TOTAL;
+		if (am[k].limit < 32*m->num_bins) {
+			am[k].limit = 32*m->num_bins;
+		}
+		adaptive_build(am+k);
+	}
+	return am;
+}
+
+void
+adaptive_free(adaptive_model *am, size_t num_models) {
+	size_t k;
+	for (k=0; k<num_models; k++) {
+		free(am[k].cnt);
+		free(am[k].tree);
+	}
+	free(am);
+}
+
+/* sum of the counts of bins 0..s-1 */
+static inline uint32_t
+adaptive_low(const adaptive_model *am, size_t s) {
+	uint32_t low=0;
+	for (; s>0; s -= s & -s) {
+		low += am->tree[s];
+	}
+	return low;
+}
+
+/* the bin whose range holds target, with *low set to where it starts */
+static inline size_t
+adaptive_find(const adaptive_model *am, uint32_t target, uint32_t *low) {
+	size_t pos=0, step;
+
+	*low = 0;
+	for (step=am->top; step>0; step>>=1) {
+		if (pos+step <= am->num_bins &&
+				*low + am->tree[pos+step] <= target) {
+			pos += step;
+			*low += am->tree[pos];
+		}
+	}
+	return pos;
+}
+
+/* count one more symbol s, halving all counts if they get too big */
+static inline void
+adaptive_update(adaptive_model *am, size_t s) {
+	size_t i;
+
+	am->cnt[s] += ADAPT_INC;
+	am->total += ADAPT_INC;
+	if (am->total > am->limit) {
+		for (i=0; i<am->num_bins; i++) {
+			am->cnt[i] = (am->cnt[i]+1)/2;
+		}
+		adaptive_build(am);
+		return;
+	}
+	for (i=s+1; i<=am->num_bins; i += i & -i) {
+		am->tree[i] += ADAPT_INC;
+	}
+}
+
+/* code the nS bin numbers in syms[], starting at column zero */
+void
+adaptive_encode(const model_set *ms, const uint32_t *syms, size_t nS,
+		arith_encoder *ae) {
+	adaptive_model *am = adaptive_start(ms), *a;
+	uint32_t low;
+	size_t i, col;
+
+	for (i=0, col=0; i<nS; i++, col=next_column(ms, col)) {
+		a = am + (ms->dim ? ms->col_model[col] : 0);
+		low = adaptive_low(a, syms[i]);
+		arith_encode_range(ae, low, low + a->cnt[syms[i]], a->total);
+		adaptive_update(a, syms[i]);
+	}
+	adaptive_free(am, ms->num_models);
+}
+
+/* and decode nF floats into F */
+void
+adaptive_decode(const model_set *ms, arith_decoder *ad, float *F,
+		size_t nF) {
+	adaptive_model *am = adaptive_start(ms), *a;
+	uint64_t target, scale;
+	uint32_t low;
+	size_t i, s, col;
+
+	for (i=0, col=0; i<nF; i++, col=next_column(ms, col)) {
+		a = am + (ms->dim ? ms->col_model[col] : 0);
+		target = arith_decode_target(ad, a->total, &scale);
+		s = adaptive_find(a, target, &low);
+		arith_decode_range(ad, low, low + a->cnt[s], a->total, scale);
+		F[i] = column_model(ms, col)->S[s];
+		adaptive_update(a, s);
+	}
+	adaptive_free(am, ms->num_models);
+}
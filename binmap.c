@@ -0,0 +1,182 @@
+/* Maps whole vectors of floats to bin numbers at once, for the encoder
+   and anything else that needs to quantize a lot of floats. The AVX-512
+   and AVX2 kernels do what float_to_bin() in helpers.c does, sixteen or
+   eight floats at a time and without branches: the key of each float
+   picks its lookup cell, two gathers fetch the first and last bins the
+   cell can hold, and then each lane steps past the boundaries that are
+   below its float, with a compare against a gather of U[], until no lane
+   moves. Floats outside [U[0], U[num_bins-1]] are fixed up with masks.
+
+   The instruction set is chosen at run time, and the scalar loop gives
+   the same answers on any machine.
+
+   Needs helpers.c to have been included first.
+*/
+
+#include <immintrin.h>
+
+#define ISA_SCALAR 0
+#define ISA_AVX2 1
+#define ISA_AVX512 2
+
+const char *isa_names[] = {"scalar", "avx2", "avx512"};
+
+int binmap_isa=-1;		// which kernel to use, best available if -1
+
+/* what this machine can do */
+int
+best_isa() {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") &&
+			__builtin_cpu_supports("avx512bw") &&
+			__builtin_cpu_supports("avx512vl")) {
+		return ISA_AVX512;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return ISA_AVX2;
+	}
+	return ISA_SCALAR;
+}
+
+static void
+floats_to_bins_scalar(const bin_model *m, const float *F, size_t nF,
+		uint32_t *bins) {
+	size_t i;
+	for (i=0; i<nF; i++) {
+		bins[i] = float_to_bin(m, F[i]);
+	}
+}
+
+/* eight at a time; AVX2 has no unsigned compares, so keys are compared
+   with their top bits flipped */
+__attribute__((target("avx2")))
+static size_t
+floats_to_bins_avx2(const bin_model *m, const float *F, size_t nF,
+		uint32_t *bins) {
+	const __m256i top = _mm256_set1_epi32(0x80000000);
+	const __m256i key0 = _mm256_set1_epi32(m->lut_key0 ^ 0x80000000);
+	const __m256i base = _mm256_set1_epi32(m->lut_key0);
+	const __m256i cells = _mm256_set1_epi32(m->lut_cells);
+	const __m256i last = _mm256_set1_epi32(m->num_bins-1);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m128i shift = _mm_cvtsi32_si128(m->lut_shift);
+	__m256 f;
+	__m256i k, below, above, cell, lo, hi, step;
+	size_t i;
+
+	for (i=0; i+8<=nF; i+=8) {
+		f = _mm256_add_ps(_mm256_loadu_ps(F+i), _mm256_setzero_ps());
+		k = _mm256_castps_si256(f);
+		k = _mm256_xor_si256(k,
+			_mm256_or_si256(_mm256_srai_epi32(k, 31), top));
+
+		below = _mm256_cmpgt_epi32(key0, _mm256_xor_si256(k, top));
+		below = _mm256_or_si256(below, _mm256_cmpeq_epi32(k, base));
+		cell = _mm256_srl_epi32(_mm256_sub_epi32(k, base), shift);
+		above = _mm256_cmpeq_epi32(_mm256_max_epu32(cell, cells), cell);
+		cell = _mm256_andnot_si256(_mm256_or_si256(below, above), cell);
+
+		lo = _mm256_i32gather_epi32((const int *)m->lut, cell, 4);
+		hi = _mm256_i32gather_epi32((const int *)m->lut+1, cell, 4);
+		do {
+			/* lo<hi, and the float is above U[lo] */
+			step = _mm256_and_si256(_mm256_cmpgt_epi32(hi, lo),
+				_mm256_castps_si256(_mm256_cmp_ps(f,
+				_mm256_i32gather_ps(m->U, lo, 4), _CMP_GT_OQ)));
+			lo = _mm256_sub_epi32(lo, step);
+		} while (!_mm256_testz_si256(step, step));
+
+		lo = _mm256_blendv_epi8(lo, zero, below);
+		lo = _mm256_blendv_epi8(lo, last, _mm256_andnot_si256(below,
+			above));
+		_mm256_storeu_si256((__m256i *)(bins+i), lo);
+	}
+	return i;
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vl")))
+static size_t
+floats_to_bins_avx512(const bin_model *m, const float *F, size_t nF,
+		uint32_t *bins) {
+	const __m512i top = _mm512_set1_epi32(0x80000000);
+	const __m512i base = _mm512_set1_epi32(m->lut_key0);
+	const __m512i cells = _mm512_set1_epi32(m->lut_cells);
+	const __m512i last = _mm512_set1_epi32(m->num_bins-1);
+	const __m512i one = _mm512_set1_epi32(1);
+	const __m128i shift = _mm_cvtsi32_si128(m->lut_shift);
+	__m512 f;
+	__m512i k, cell, lo, hi;
+	__mmask16 below, above, step;
+	size_t i;
+
+	for (i=0; i+16<=nF; i+=16) {
+		f = _mm512_add_ps(_mm512_loadu_ps(F+i), _mm512_setzero_ps());
+		k = _mm512_castps_si512(f);
+		k = _mm512_xor_si512(k,
+			_mm512_or_si512(_mm512_srai_epi32(k, 31), top));
+
+		below = _mm512_cmple_epu32_mask(k, base);
+		cell = _mm512_srl_epi32(_mm512_sub_epi32(k, base), shift);
+		above = _mm512_cmpge_epu32_mask(cell, cells) & ~below;
+		cell = _mm512_maskz_mov_epi32(~(below|above), cell);
+
+		lo = _mm512_i32gather_epi32(cell, m->lut, 4);
+		hi = _mm512_i32gather_epi32(cell, m->lut+1, 4);
+		do {
+			step = _mm512_cmplt_epu32_mask(lo, hi);
+			step = _mm512_mask_cmp_ps_mask(step, f,
+				_mm512_i32gather_ps(lo, m->U, 4), _CMP_GT_OQ);
+			lo = _mm512_mask_add_epi32(lo, step, lo, one);
+		} while (step);
+
+		lo = _mm512_mask_mov_epi32(lo, below, _mm512_setzero_si512());
+		lo = _mm512_mask_mov_epi32(lo, above, last);
+		_mm512_storeu_si512(bins+i, lo);
+	}
+	return i;
+}
+
+/* set bins[i] to the bin of F[i], for each of the nF floats */
+void
+floats_to_bins(const bin_model *m, const float *F, size_t nF,
+		uint32_t *bins) {
+	size_t i=0;
+
+	if (binmap_isa<0) {
+		binmap_isa = best_isa();
+	}
+	if (binmap_isa == ISA_AVX512) {
+		i = floats_to_bins_avx512(m, F, nF, bins);
+	} else if (binmap_isa == ISA_AVX2) {
+		i = floats_to_bins_avx2(m, F, nF, bins);
+	}
+	floats_to_bins_scalar(m, F+i, nF-i, bins+i);
+}
+
+/* and the same for floats coded with a set of tables, F[0] being in
+   column col; each run of columns that share a table goes through the
+   kernel in one go, so only tables of single columns are done a float
+   at a time
+*/
+void
+set_floats_to_bins(const model_set *ms, size_t col, const float *F,
+		size_t nF, uint32_t *bins) {
+	size_t i, n;
+
+	if (ms->dim == 0) {
+		floats_to_bins(ms->models, F, nF, bins);
+		return;
+	}
+	for (i=0; i<nF; i+=n) {
+		for (n=1; col+n<ms->dim && i+n<nF &&
+				ms->col_model[col+n] == ms->col_model[col];
+				n++) {
+		}
+		if (n == 1) {
+			bins[i] = float_to_bin(column_model(ms, col), F[i]);
+		} else {
+			floats_to_bins(column_model(ms, col), F+i, n, bins+i);
+		}
+		col = col+n == ms->dim ? 0 : col+n;
+	}
+}
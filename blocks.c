@@ -0,0 +1,731 @@
+/* Block-partitioned coding. The stream of floats is cut into blocks of a
+   fixed number of vectors, and each block is coded from scratch with its
+   own coder state, so that blocks can be encoded (and decoded) on their
+   own, and in parallel. The compressed file is laid out as
+
+	FAISS header:	HEADER bytes, put straight through
+	magic:		"LSBK"
+	coder:		uint16_t [0 = arithmetic coder, 1 = rANS,
+			2 = rANS with 16 interleaved states,
+			3 = arithmetic coder, static or adaptive,
+			4 = arithmetic coder with order-1 contexts]
+	coder_param:	uint16_t [rANS: log2 of the frequency total,
+			contexts: the number of context buckets]
+	dim:		uint64_t, floats per vector
+	num_vecs:	uint64_t
+	vecs_per_block:	uint64_t, the last block might have fewer
+	num_blocks:	uint64_t
+	index_pos:	uint64_t, file position of the block offsets
+	blocks:		the coded bytes of each block, one after the other
+	offsets:	num_blocks+1 values, where each block starts relative
+			to the first block, Elias-Fano coded, see eliasfano.c
+
+   With coder 3, each block is coded both with the counts of the bins file
+   and with counts that adapt as it goes, see adaptive.c, and whichever is
+   smaller is kept, with a first byte of BLOCK_STATIC or BLOCK_ADAPTIVE to
+   say which it was. Coder 4 needs a bins file with contexts, see
+   order1.c, and they reset at the start of every vector.
+
+   Every block is coded the same way no matter which thread gets to it,
+   so the output does not depend on the number of threads used. And
+   because the offsets say where every block starts, and the block size
+   says where its floats go, decoding can be spread across threads too.
+   Or, given a few vector ids, only the blocks holding them need to be
+   decoded, see fetch_vectors(); with one vector per block, the offsets
+   cost a couple of bits more than log2 of the average block length.
+
+   The block header also carries the bin models and any tables the coder
+   needs, so that different files (and models) can be in use at once.
+   Blocks start at the start of a vector, so with a table for each column
+   every block starts with the table of column zero.
+   Errors in the files are reported back to the caller rather than acted
+   on here, since all of this is part of the library, see lssy.c.
+
+   Needs helpers.c, binmap.c, eliasfano.c, rans.c, ransx16.c, adaptive.c
+   and order1.c to have been included first.
+*/
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define BLOCK_MAGIC "LSBK"
+#define BLOCK_MAGIC_LEN 4
+
+#define CODER_ARITH 0
+#define CODER_RANS 1
+#define CODER_RANSX16 2
+#define CODER_ADAPTIVE 3
+#define CODER_CONTEXT 4
+#define CODER_PACKED 5		// not in blocks, see packed.c
+#define NUM_CODERS 6
+
+const char *coder_names[] = {"arith", "rans", "ransx16", "adaptive",
+	"context", "packed"};
+
+#define BLOCK_STATIC 0		// first byte of a CODER_ADAPTIVE block
+#define BLOCK_ADAPTIVE 1
+
+#define BATCH_PER_THREAD 4	// blocks held in memory per thread
+
+typedef struct {
+	uint16_t coder;
+	uint16_t coder_param;
+	uint64_t dim;
+	uint64_t num_vecs;
+	uint64_t vecs_per_block;
+	uint64_t num_blocks;
+	uint64_t index_pos;
+	uint64_t *offsets;	// when writing, num_blocks+1 of them
+	elias_fano ef;		// when reading, the same values
+	const model_set *ms;	// the floats' bins
+	rans_tables rt;		// for the rANS coders
+} block_header;
+
+#define BLOCK_HEADER_BYTES (BLOCK_MAGIC_LEN + 2*sizeof(uint16_t) + \
+	5*sizeof(uint64_t))
+
+/* the bytes of one coded block */
+typedef struct {
+	uint8_t *buf;
+	size_t len;
+} coded_block;
+
+/* map all of the file open as fp into memory, read-only, setting *len
+   to its length; NULL if that cannot be done */
+uint8_t *
+map_input(FILE *fp, size_t *len) {
+	struct stat st;
+	uint8_t *map;
+
+	if (fstat(fileno(fp), &st) != 0) {
+		return NULL;
+	}
+	*len = st.st_size;
+	map = mmap(NULL, *len ? *len : 1, PROT_READ, MAP_PRIVATE,
+		fileno(fp), 0);
+	return map == MAP_FAILED ? NULL : map;
+}
+
+/* extend the file open as fp, which must be readable too ("w+"), to
+   len bytes and map it for writing; what has been written to fp so far
+   is flushed first, and stays in place; NULL if that cannot be done */
+uint8_t *
+map_output(FILE *fp, size_t len) {
+	uint8_t *map;
+
+	if (fflush(fp) != 0 || ftruncate(fileno(fp), len) != 0) {
+		return NULL;
+	}
+	map = mmap(NULL, len ? len : 1, PROT_READ|PROT_WRITE, MAP_SHARED,
+		fileno(fp), 0);
+	return map == MAP_FAILED ? NULL : map;
+}
+
+int
+default_threads() {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n>0 ? n : 1;
+}
+
+/* run fn(arg) on nthreads threads, including this one, and wait for
+   them all to finish
+*/
+void
+run_threads(void *(*fn)(void *), void *arg, int nthreads) {
+	pthread_t *tids = malloc(nthreads*sizeof(*tids));
+	int i;
+	assert(tids);
+	for (i=1; i<nthreads; i++) {
+		if (pthread_create(tids+i, NULL, fn, arg) != 0) {
+			fprintf(stderr, "unable to create thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	fn(arg);
+	for (i=1; i<nthreads; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	free(tids);
+}
+
+/* block b covers vectors [b*vecs_per_block, ...) */
+size_t
+block_vecs(const block_header *bh, size_t b) {
+	size_t first = b*bh->vecs_per_block;
+	size_t left = bh->num_vecs - first;
+	return left < bh->vecs_per_block ? left : bh->vecs_per_block;
+}
+
+void
+block_header_init(block_header *bh, const model_set *ms, uint16_t coder,
+		uint16_t coder_param, size_t dim, size_t num_vecs,
+		size_t vecs_per_block) {
+	memset(bh, 0, sizeof(*bh));
+	bh->ms = ms;
+	bh->coder = coder;
+	bh->coder_param = coder_param;
+	bh->dim = dim;
+	bh->num_vecs = num_vecs;
+	bh->vecs_per_block = vecs_per_block;
+	bh->num_blocks = (num_vecs + vecs_per_block - 1) / vecs_per_block;
+	bh->index_pos = 0;
+	bh->offsets = calloc(bh->num_blocks+1, sizeof(*bh->offsets));
+	assert(bh->offsets);
+}
+
+void
+block_header_free(block_header *bh) {
+	free(bh->offsets);
+	ef_free(&bh->ef);
+	rans_free_tables(&bh->rt);
+}
+
+void
+write_block_header(const block_header *bh, FILE *fp) {
+	fwrite(BLOCK_MAGIC, 1, BLOCK_MAGIC_LEN, fp);
+	fwrite(&bh->coder, sizeof(bh->coder), 1, fp);
+	fwrite(&bh->coder_param, sizeof(bh->coder_param), 1, fp);
+	fwrite(&bh->dim, sizeof(bh->dim), 1, fp);
+	fwrite(&bh->num_vecs, sizeof(bh->num_vecs), 1, fp);
+	fwrite(&bh->vecs_per_block, sizeof(bh->vecs_per_block), 1, fp);
+	fwrite(&bh->num_blocks, sizeof(bh->num_blocks), 1, fp);
+	fwrite(&bh->index_pos, sizeof(bh->index_pos), 1, fp);
+}
+
+/* where block b starts, relative to the first block; b<=num_blocks */
+static inline uint64_t
+block_start(const block_header *bh, size_t b) {
+	return ef_get(&bh->ef, b);
+}
+
+/* coder number given its name, or -1 */
+int
+coder_by_name(const char *name) {
+	int k;
+	for (k=0; k<NUM_CODERS; k++) {
+		if (strcmp(name, coder_names[k]) == 0) {
+			return k;
+		}
+	}
+	return -1;
+}
+
+/* the coder_param to go in the header for coder */
+uint16_t
+block_coder_param(const model_set *ms, int coder, int scale_bits) {
+	switch (coder) {
+	case CODER_RANS:
+	case CODER_RANSX16:
+		return scale_bits;
+	case CODER_CONTEXT:
+		return ms->num_buckets;
+	}
+	return 0;
+}
+
+/* get the coder named in the header ready to go, zero if it cannot be,
+   or if the models are for vectors of some other size */
+int
+block_coder_setup(block_header *bh) {
+	if (bh->ms->dim && bh->ms->dim != bh->dim) {
+		return 0;
+	}
+	switch (bh->coder) {
+	case CODER_ARITH:
+	case CODER_ADAPTIVE:
+		return 1;
+	case CODER_CONTEXT:
+		return bh->ms->num_buckets &&
+			bh->ms->num_buckets == bh->coder_param;
+	case CODER_RANS:
+		return bh->rt.freq || rans_make_tables(&bh->rt, bh->ms,
+			bh->coder_param);
+	case CODER_RANSX16:
+		return (bh->rt.freq || rans_make_tables(&bh->rt, bh->ms,
+			bh->coder_param)) && ransx16_make_tables(&bh->rt);
+	}
+	return 0;
+}
+
+/* whether the counts in the header agree with each other, and with the
+   FAISS header head that the file starts with: a corrupt count could
+   otherwise send blocks to the wrong vectors, or past the last one */
+int
+block_counts_ok(const block_header *bh, const char *head) {
+	size_t count = header_count(head);
+
+	if (bh->vecs_per_block == 0 || bh->dim == 0 ||
+			bh->dim != (uint64_t)header_dim(head) ||
+			count%bh->dim != 0 || bh->num_vecs != count/bh->dim) {
+		return 0;
+	}
+	return bh->num_blocks == bh->num_vecs/bh->vecs_per_block +
+		(bh->num_vecs%bh->vecs_per_block != 0);
+}
+
+/* returns zero, with fp wound back again, if the next bytes are not a
+   block header, so that the caller can fall back to a single stream;
+   -1 if they are but cannot be read, do not agree with the FAISS header
+   head, or name a coder that cannot be set up; and otherwise 1, with fp
+   left at the first block
+*/
+int
+read_block_header(block_header *bh, const model_set *ms, const char *head,
+		FILE *fp) {
+	char magic[BLOCK_MAGIC_LEN];
+
+	memset(bh, 0, sizeof(*bh));
+	bh->ms = ms;
+	if (fread(magic, 1, BLOCK_MAGIC_LEN, fp) != BLOCK_MAGIC_LEN ||
+			memcmp(magic, BLOCK_MAGIC, BLOCK_MAGIC_LEN) != 0) {
+		fseeko(fp, HEADER, SEEK_SET);
+		return 0;
+	}
+	if (fread(&bh->coder, sizeof(bh->coder), 1, fp) != 1 ||
+			fread(&bh->coder_param,
+				sizeof(bh->coder_param), 1, fp) != 1 ||
+			fread(&bh->dim, sizeof(bh->dim), 1, fp) != 1 ||
+			fread(&bh->num_vecs, sizeof(bh->num_vecs), 1, fp) != 1 ||
+			fread(&bh->vecs_per_block,
+				sizeof(bh->vecs_per_block), 1, fp) != 1 ||
+			fread(&bh->num_blocks,
+				sizeof(bh->num_blocks), 1, fp) != 1 ||
+			fread(&bh->index_pos,
+				sizeof(bh->index_pos), 1, fp) != 1 ||
+			!block_counts_ok(bh, head) ||
+			fseeko(fp, bh->index_pos, SEEK_SET) != 0 ||
+			!ef_read(&bh->ef, fp) ||
+			bh->ef.n != bh->num_blocks+1 ||
+			fseeko(fp, HEADER+BLOCK_HEADER_BYTES, SEEK_SET) != 0 ||
+			!block_coder_setup(bh)) {
+		block_header_free(bh);
+		return -1;
+	}
+	return 1;
+}
+
+/* the arithmetic coder on its own, with the static counts of the models,
+   adaptive ones, or the order-1 contexts, as for coder, leaving room for
+   skip bytes before the coded ones */
+static void
+encode_block_arith(const block_header *bh, const uint32_t *syms, size_t nS,
+		int coder, size_t skip, coded_block *out) {
+	arith_encoder ae;
+	size_t i, col;
+
+	encoder_start(&ae, NULL);
+	for (i=0; i<skip; i++) {
+		/* not zero, so never trimmed off the end as padding */
+		put_byte(&ae, FULLBYTE);
+	}
+	if (coder == CODER_ADAPTIVE) {
+		adaptive_encode(bh->ms, syms, nS, &ae);
+	} else if (coder == CODER_CONTEXT) {
+		context_encode(bh->ms, bh->dim, syms, nS, &ae);
+	} else {
+		for (i=0, col=0; i<nS; i++, col=next_column(bh->ms, col)) {
+			arith_encode(&ae, column_model(bh->ms, col), syms[i]);
+		}
+	}
+	encoder_close_buffer(&ae);
+	out->buf = ae.buf;
+	out->len = ae.buf_len;
+}
+
+/* code the nF floats in F as a single self-contained block */
+void
+encode_block(const block_header *bh, const float *F, size_t nF,
+		coded_block *out) {
+	coded_block other;
+	uint32_t *syms;
+
+	syms = malloc(nF*sizeof(*syms));
+	assert(syms || nF==0);
+	set_floats_to_bins(bh->ms, 0, F, nF, syms);
+
+	switch (bh->coder) {
+	case CODER_ARITH:
+	case CODER_CONTEXT:
+		encode_block_arith(bh, syms, nF, bh->coder, 0, out);
+		break;
+	case CODER_RANS:
+		rans_encode(&bh->rt, syms, nF, &out->buf, &out->len);
+		break;
+	case CODER_RANSX16:
+		ransx16_encode(&bh->rt, syms, nF, &out->buf, &out->len);
+		break;
+	case CODER_ADAPTIVE:
+		/* both ways, keeping the smaller */
+		encode_block_arith(bh, syms, nF, CODER_ARITH, 1, out);
+		encode_block_arith(bh, syms, nF, CODER_ADAPTIVE, 1, &other);
+		if (other.len < out->len) {
+			free(out->buf);
+			*out = other;
+			out->buf[0] = BLOCK_ADAPTIVE;
+		} else {
+			free(other.buf);
+			out->buf[0] = BLOCK_STATIC;
+		}
+		break;
+	default:
+		assert(0);
+	}
+	free(syms);
+}
+
+/* and the reverse, the first nF floats are reconstructed into F */
+void
+decode_block(const block_header *bh, const uint8_t *in, size_t len,
+		float *F, size_t nF) {
+	const bin_model *m;
+	arith_decoder ad;
+	size_t i, col;
+
+	switch (bh->coder) {
+	case CODER_ADAPTIVE:
+		if (len>0 && in[0]==BLOCK_ADAPTIVE) {
+			decoder_start(&ad, in+1, len-1);
+			adaptive_decode(bh->ms, &ad, F, nF);
+			break;
+		}
+		/* otherwise, just as for the static coder */
+		in++;
+		len = len>0 ? len-1 : 0;
+		/* fall through */
+	case CODER_ARITH:
+		decoder_start(&ad, in, len);
+		for (i=0, col=0; i<nF; i++, col=next_column(bh->ms, col)) {
+			m = column_model(bh->ms, col);
+			F[i] = m->S[arith_decode(&ad, m)];
+		}
+		break;
+	case CODER_CONTEXT:
+		decoder_start(&ad, in, len);
+		context_decode(bh->ms, bh->dim, &ad, F, nF);
+		break;
+	case CODER_RANS:
+		rans_decode(&bh->rt, in, len, F, nF);
+		break;
+	case CODER_RANSX16:
+		ransx16_decode(&bh->rt, in, len, F, nF);
+		break;
+	default:
+		assert(0);
+	}
+}
+
+/* a batch of consecutive blocks that the threads share out between
+   them, claiming one block at a time
+*/
+typedef struct {
+	const block_header *bh;
+	const float *F;		// floats of the whole batch
+	size_t first_block;
+	size_t num_blocks;
+	coded_block *coded;	// one per block in the batch
+	size_t next;		// next block in batch to be claimed
+} block_batch;
+
+void *
+encode_batch_worker(void *arg) {
+	block_batch *bb = arg;
+	size_t b, vecs_per_block=bb->bh->vecs_per_block, dim=bb->bh->dim;
+
+	while ((b=__atomic_fetch_add(&bb->next, 1, __ATOMIC_RELAXED))
+			< bb->num_blocks) {
+		encode_block(bb->bh, bb->F + b*vecs_per_block*dim,
+			block_vecs(bb->bh, bb->first_block+b)*dim,
+			bb->coded+b);
+	}
+	return NULL;
+}
+
+/* read num_vecs vectors of dim floats from fi, and write them to fo as
+   independently coded blocks of vecs_per_block vectors, using the given
+   coder and nthreads threads; returns the number of bytes written, or
+   zero if the coder cannot be set up or fi runs out early
+*/
+size_t
+encode_blocks(const model_set *ms, FILE *fi, FILE *fo, size_t dim,
+		size_t num_vecs, size_t vecs_per_block, uint16_t coder,
+		uint16_t coder_param, int nthreads) {
+
+	block_header bh;
+	block_batch bb;
+	size_t b, i, nF, batch_blocks, bytes_out=0;
+	off_t header_pos;
+	float *F;
+
+	block_header_init(&bh, ms, coder, coder_param, dim, num_vecs,
+		vecs_per_block);
+	if (!block_coder_setup(&bh)) {
+		block_header_free(&bh);
+		return 0;
+	}
+
+	/* the position of the offsets gets filled in at the end */
+	header_pos = ftello(fo);
+	write_block_header(&bh, fo);
+
+	batch_blocks = BATCH_PER_THREAD*nthreads;
+	F = malloc(batch_blocks*vecs_per_block*dim*sizeof(*F));
+	bb.coded = malloc(batch_blocks*sizeof(*bb.coded));
+	assert(F && bb.coded);
+	bb.bh = &bh;
+	bb.F = F;
+
+	for (b=0; b<bh.num_blocks; b+=batch_blocks) {
+		bb.first_block = b;
+		bb.num_blocks = bh.num_blocks-b < batch_blocks ?
+			bh.num_blocks-b : batch_blocks;
+		bb.next = 0;
+		nF = 0;
+		for (i=0; i<bb.num_blocks; i++) {
+			nF += block_vecs(&bh, b+i)*dim;
+		}
+		if (fread(F, sizeof(*F), nF, fi) != nF) {
+			bytes_out = 0;
+			break;
+		}
+
+		run_threads(encode_batch_worker, &bb, nthreads);
+
+		/* and then out they go, in block order */
+		for (i=0; i<bb.num_blocks; i++) {
+			fwrite(bb.coded[i].buf, 1, bb.coded[i].len, fo);
+			bytes_out += bb.coded[i].len;
+			bh.offsets[b+i+1] = bytes_out;
+			free(bb.coded[i].buf);
+		}
+	}
+
+	/* now append the offsets, and go back to say where they are */
+	if (b >= bh.num_blocks) {
+		bh.index_pos = ftello(fo);
+		ef_build(&bh.ef, bh.offsets, bh.num_blocks+1);
+		ef_write(&bh.ef, fo);
+		fseeko(fo, header_pos, SEEK_SET);
+		write_block_header(&bh, fo);
+		fseeko(fo, 0, SEEK_END);
+		bytes_out += BLOCK_HEADER_BYTES + ef_bytes(&bh.ef);
+	}
+
+	free(F);
+	free(bb.coded);
+	block_header_free(&bh);
+	return bytes_out;
+}
+
+/* and the threads decoding blocks share out this job, each writing its
+   blocks' floats straight to their final place in the output file
+*/
+typedef struct {
+	const block_header *bh;
+	const uint8_t *in;	// first byte of the first block
+	int fd;			// output file
+	off_t out_pos;		// where the floats of the first block go
+	size_t next;		// next block to be claimed
+	int failed;		// set if a write fails
+} decode_job;
+
+void *
+decode_worker(void *arg) {
+	decode_job *dj = arg;
+	const block_header *bh = dj->bh;
+	size_t b, nF, done;
+	ssize_t n;
+	off_t pos;
+	float *F = malloc(bh->vecs_per_block*bh->dim*sizeof(*F));
+
+	assert(F);
+	while ((b=__atomic_fetch_add(&dj->next, 1, __ATOMIC_RELAXED))
+			< bh->num_blocks) {
+		nF = block_vecs(bh, b)*bh->dim;
+		decode_block(bh, dj->in + block_start(bh, b),
+			block_start(bh, b+1) - block_start(bh, b), F, nF);
+		pos = dj->out_pos + b*bh->vecs_per_block*bh->dim*sizeof(*F);
+		for (done=0; done<nF*sizeof(*F); done+=n) {
+			n = pwrite(dj->fd, (char *)F + done,
+				nF*sizeof(*F) - done, pos + done);
+			if (n<=0) {
+				__atomic_store_n(&dj->failed, 1,
+					__ATOMIC_RELAXED);
+				break;
+			}
+		}
+	}
+	free(F);
+	return NULL;
+}
+
+/* decode all the blocks described by bh, with fi positioned at the first
+   block and fo just after the FAISS header. The compressed file is mapped
+   into memory, the output file is extended to its final size, and then
+   nthreads threads decode blocks and write them in place; returns the
+   number of floats, or zero if the files cannot be mapped or extended
+*/
+size_t
+decode_blocks(FILE *fi, FILE *fo, const block_header *bh, int nthreads) {
+
+	decode_job dj;
+	off_t in_pos = ftello(fi);
+	size_t map_len;
+	uint8_t *map = map_input(fi, &map_len);
+
+	if (map == NULL) {
+		return 0;
+	}
+	fflush(fo);
+	dj.bh = bh;
+	dj.in = map + in_pos;
+	dj.fd = fileno(fo);
+	dj.out_pos = ftello(fo);
+	dj.next = 0;
+	dj.failed = 0;
+	if (map_len < in_pos + block_start(bh, bh->num_blocks) ||
+			ftruncate(dj.fd, dj.out_pos +
+			bh->num_vecs*bh->dim*sizeof(float)) != 0) {
+		munmap(map, map_len);
+		return 0;
+	}
+
+	run_threads(decode_worker, &dj, nthreads);
+
+	munmap(map, map_len);
+	return dj.failed ? 0 : bh->num_vecs*bh->dim;
+}
+
+/* random access to the vectors of a block-coded file, which is mapped
+   into memory once and can then be shared by any number of threads
+*/
+typedef struct {
+	block_header bh;
+	uint8_t *map;
+	size_t map_len;
+	const uint8_t *blocks;	// first byte of the first block
+} block_file;
+
+/* returns zero if fname cannot be opened or is not block-coded */
+int
+block_file_open(block_file *bf, const model_set *ms, const char *fname) {
+	char h[HEADER];
+	FILE *fp;
+
+	if ((fp=fopen(fname, "r")) == NULL) {
+		return 0;
+	}
+	if (fread(h, 1, HEADER, fp) != HEADER ||
+			read_block_header(&bf->bh, ms, h, fp) != 1) {
+		fclose(fp);
+		return 0;
+	}
+	bf->map = map_input(fp, &bf->map_len);
+	fclose(fp);
+	if (bf->map == NULL || bf->map_len < HEADER + BLOCK_HEADER_BYTES +
+			block_start(&bf->bh, bf->bh.num_blocks)) {
+		if (bf->map) {
+			munmap(bf->map, bf->map_len);
+		}
+		block_header_free(&bf->bh);
+		return 0;
+	}
+	bf->blocks = bf->map + HEADER + BLOCK_HEADER_BYTES;
+	return 1;
+}
+
+void
+block_file_close(block_file *bf) {
+	munmap(bf->map, bf->map_len);
+	block_header_free(&bf->bh);
+}
+
+/* ids to be fetched get sorted by id, remembering where each goes */
+typedef struct {
+	size_t id;
+	size_t pos;
+} fetch_item;
+
+int
+cmp_fetch_item(const void *x1, const void *x2) {
+	const fetch_item *f1=x1, *f2=x2;
+	if (f1->id<f2->id) return -1;
+	if (f1->id>f2->id) return +1;
+	return 0;
+}
+
+/* write the n vectors ids[0..n-1] to out[0..n*dim-1], in that order.
+   Each block holding any of them is decoded only once, and only as far
+   as the last vector wanted from it
+*/
+void
+fetch_vectors(const block_file *bf, const size_t *ids, size_t n,
+		float *out) {
+
+	const block_header *bh = &bf->bh;
+	size_t dim = bh->dim, vpb = bh->vecs_per_block;
+	size_t i, j, k, b, last;
+	fetch_item *items = malloc(n*sizeof(*items));
+	float *F = malloc(vpb*dim*sizeof(*F));
+
+	assert((items || n==0) && F);
+	for (i=0; i<n; i++) {
+		assert(ids[i] < bh->num_vecs);
+		items[i].id = ids[i];
+		items[i].pos = i;
+	}
+	qsort(items, n, sizeof(*items), cmp_fetch_item);
+
+	for (i=0; i<n; i=j) {
+		b = items[i].id/vpb;
+		for (j=i; j<n && items[j].id/vpb == b; j++) {
+		}
+		last = items[j-1].id%vpb;
+		decode_block(bh, bf->blocks + block_start(bh, b),
+			block_start(bh, b+1) - block_start(bh, b),
+			F, (last+1)*dim);
+		for (k=i; k<j; k++) {
+			memcpy(out + items[k].pos*dim,
+				F + (items[k].id%vpb)*dim, dim*sizeof(*F));
+		}
+	}
+
+	free(items);
+	free(F);
+}
+
+/* write vectors first..first+n-1 to out, straight from the decoder,
+   except for the part of a block before first, which goes to scratch
+*/
+void
+fetch_range(const block_file *bf, size_t first, size_t n, float *out) {
+
+	const block_header *bh = &bf->bh;
+	size_t dim = bh->dim, vpb = bh->vecs_per_block;
+	size_t b, skip, take;
+	float *F = NULL;
+
+	assert(first+n <= bh->num_vecs);
+	for (; n>0; first+=take, n-=take, out+=take*dim) {
+		b = first/vpb;
+		skip = first%vpb;
+		take = vpb-skip < n ? vpb-skip : n;
+		if (skip == 0) {
+			decode_block(bh, bf->blocks + block_start(bh, b),
+				block_start(bh, b+1) - block_start(bh, b),
+				out, take*dim);
+			continue;
+		}
+		if (F == NULL) {
+			F = malloc(vpb*dim*sizeof(*F));
+			assert(F);
+		}
+		decode_block(bh, bf->blocks + block_start(bh, b),
+			block_start(bh, b+1) - block_start(bh, b),
+			F, (skip+take)*dim);
+		memcpy(out, F + skip*dim, take*dim*sizeof(*F));
+	}
+	free(F);
+}
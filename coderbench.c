@@ -0,0 +1,301 @@
+/* Codes the floats of an index with each of the available coders in turn,
+   and reports compression and throughput side by side. Everything
+   happens in memory, on one thread, so that the coders themselves are
+   what gets measured; the decoded floats are checked as well.
+
+   Uses the bins file from quantize.c and the block coding in blocks.c,
+   with -b vectors per block, and -s as log2 of the rANS frequency total.
+   Only the first -n vectors of the index are used, if that is given.
+   The interleaved rANS decoder is timed at each SIMD level the machine
+   supports, down to scalar, and the float to bin mapping is timed on
+   its own as well, a float and a whole vector at a time. Packed
+   fixed-width codes are unpacked at each SIMD level too.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "helpers.c"
+#include "binmap.c"
+#include "eliasfano.c"
+#include "rans.c"
+#include "ransx16.c"
+#include "adaptive.c"
+#include "order1.c"
+#include "blocks.c"
+#include "packed.c"
+
+void
+usage(char *prog) {
+	fprintf(stderr, "Usage: %s [-b vecs-per-block] [-s rans-scale-bits] "
+		"[-n max-vecs] bins-file index-file\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+/* the packed codes are not blocks, and are timed on their own */
+void
+bench_packed(const model_set *ms, const float *F, const float *expect,
+		float *G, size_t dim, size_t num_vecs) {
+	packed_file pf;
+	size_t nF=num_vecs*dim, len, i;
+	uint32_t *bins;
+	uint8_t *codes;
+	double t_enc, t_dec;
+	char label[64];
+	int isa, top_isa;
+
+	if (!packed_setup(&pf, ms, dim, num_vecs)) {
+		fprintf(stderr, "skipping packed, cannot be set up\n");
+		return;
+	}
+	len = packed_bytes(&pf, num_vecs);
+	bins = malloc(nF*sizeof(*bins));
+	codes = calloc(len + PACK_PAD, 1);
+	assert((bins || nF==0) && codes);
+
+	t_enc = seconds();
+	set_floats_to_bins(ms, 0, F, nF, bins);
+	pack_vectors(&pf, bins, num_vecs, codes);
+	t_enc = seconds()-t_enc;
+
+	top_isa = packed_isa<0 ? best_isa() : packed_isa;
+	for (isa=top_isa; isa>=ISA_SCALAR; isa--) {
+		packed_isa = isa;
+		sprintf(label, "packed/%s", isa_names[isa]);
+		t_dec = seconds();
+		unpack_vectors(&pf, codes, 0, num_vecs, G);
+		t_dec = seconds()-t_dec;
+		for (i=0; i<nF; i++) {
+			if (G[i] != expect[i]) {
+				fprintf(stderr, "%s: float %lu decoded "
+					"wrongly\n", label, i);
+				exit(EXIT_FAILURE);
+			}
+		}
+		printf("%-14s %7.4f %10.1f %10.1f\n",
+			label, 8.0*(PACK_HEADER_BYTES+len+PACK_PAD)/nF,
+			nF*sizeof(float)/t_enc/1e6,
+			nF*sizeof(float)/t_dec/1e6);
+	}
+	packed_isa = top_isa;
+
+	free(bins);
+	free(codes);
+	packed_free(&pf);
+}
+
+int
+main(int argc, char *argv[]) {
+
+	FILE *fb=NULL, *fi=NULL;
+	char head[HEADER];
+	model_set ms;
+	rans_tables rt;
+	size_t vecs_per_block=1024, max_vecs=0;
+	size_t dim, num_vecs, nF, i, j, b, bytes;
+	int scale_bits=RANS_DEFAULT_SCALE;
+	int opt, k, isa, top_isa, best=best_isa();
+	char label[64];
+	float *F, *G, *expect;
+	uint32_t *bins, *bins2;
+	coded_block *coded;
+	block_header bh;
+	elias_fano ef;
+	double t_enc, t_dec;
+
+	while ((opt=getopt(argc, argv, "b:s:n:")) != -1) {
+		switch (opt) {
+		case 'b':
+			vecs_per_block = atol(optarg);
+			if (vecs_per_block<1) usage(argv[0]);
+			break;
+		case 's':
+			scale_bits = atoi(optarg);
+			break;
+		case 'n':
+			max_vecs = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if ((argc-optind != 2) ||
+		(fb=fopen(argv[optind], "r")) == NULL ||
+		(fi=fopen(argv[optind+1], "r")) == NULL) {
+		usage(argv[0]);
+	}
+
+	if (!read_model_set(&ms, fb)) {
+		read_error();
+	}
+
+	if (fread(head, sizeof(*head), HEADER, fi) != HEADER) {
+		read_error();
+	}
+	dim = header_dim(head);
+	num_vecs = header_count(head)/dim;
+	if (ms.dim && ms.dim != dim) {
+		fprintf(stderr, "bins file is for vectors of %lu floats\n",
+			ms.dim);
+		exit(EXIT_FAILURE);
+	}
+	if (max_vecs && max_vecs<num_vecs) {
+		num_vecs = max_vecs;
+	}
+	nF = num_vecs*dim;
+	F = malloc(nF*sizeof(*F));
+	G = malloc(nF*sizeof(*G));
+	expect = malloc(nF*sizeof(*expect));
+	bins = malloc(nF*sizeof(*bins));
+	bins2 = malloc(nF*sizeof(*bins2));
+	assert(F && G && expect && bins && bins2);
+	if (fread(F, sizeof(*F), nF, fi) != nF) {
+		read_error();
+	}
+	fclose(fi);
+	/* first up, the float to bin mapping that all the coders share,
+	   by table and by binary search */
+	t_enc = seconds();
+	for (i=0, j=0; i<nF; i++, j=next_column(&ms, j)) {
+		bins[i] = float_to_bin(column_model(&ms, j), F[i]);
+	}
+	t_enc = seconds()-t_enc;
+	t_dec = seconds();
+	for (i=0, j=0; i<nF; i++, j=next_column(&ms, j)) {
+		bins2[i] = float_to_bin_bsearch(column_model(&ms, j), F[i]);
+	}
+	t_dec = seconds()-t_dec;
+	for (i=0, j=0; i<nF; i++, j=next_column(&ms, j)) {
+		if (bins[i] != bins2[i]) {
+			fprintf(stderr, "float %lu mapped to the wrong bin\n", i);
+			exit(EXIT_FAILURE);
+		}
+		expect[i] = column_model(&ms, j)->S[bins[i]];
+	}
+	fprintf(stderr, "bin lookup %.1f Mfloats/s by table, ", nF/t_enc/1e6);
+	fprintf(stderr, "%.1f Mfloats/s by binary search\n", nF/t_dec/1e6);
+
+	/* and a vector at a time, with each of the kernels */
+	fprintf(stderr, "whole vectors");
+	for (isa=ISA_SCALAR; isa<=best; isa++) {
+		binmap_isa = isa;
+		t_enc = seconds();
+		for (i=0; i<nF; i+=dim) {
+			set_floats_to_bins(&ms, 0, F+i, dim, bins2+i);
+		}
+		t_enc = seconds()-t_enc;
+		if (memcmp(bins, bins2, nF*sizeof(*bins)) != 0) {
+			fprintf(stderr, "\n%s kernel mapped floats to the "
+				"wrong bins\n", isa_names[isa]);
+			exit(EXIT_FAILURE);
+		}
+		fprintf(stderr, "%s %.1f Mfloats/s by %s",
+			isa==ISA_SCALAR ? "" : ",", nF/t_enc/1e6,
+			isa_names[isa]);
+	}
+	fprintf(stderr, "\n");
+	binmap_isa = best;
+	free(bins);
+	free(bins2);
+
+	fprintf(stderr, "%lu vectors of %lu floats, ", num_vecs, dim);
+	if (ms.dim) {
+		fprintf(stderr, "%lu bin tables, ", ms.num_models);
+	} else {
+		fprintf(stderr, "%lu bins, ", ms.models[0].num_bins);
+	}
+	fprintf(stderr, "blocks of %lu vectors\n", vecs_per_block);
+	printf("%-14s %7s %10s %10s\n",
+		"coder", "bits/f", "enc MB/s", "dec MB/s");
+
+	for (k=0; k<NUM_CODERS; k++) {
+		if (k==CODER_PACKED) {
+			bench_packed(&ms, F, expect, G, dim, num_vecs);
+			continue;
+		}
+		block_header_init(&bh, &ms, k,
+			block_coder_param(&ms, k, scale_bits),
+			dim, num_vecs, vecs_per_block);
+		if (!block_coder_setup(&bh)) {
+			fprintf(stderr, "skipping %s, cannot be set up\n",
+				coder_names[k]);
+			block_header_free(&bh);
+			continue;
+		}
+		coded = malloc(bh.num_blocks*sizeof(*coded));
+		assert(coded);
+
+		t_enc = seconds();
+		for (b=0; b<bh.num_blocks; b++) {
+			encode_block(&bh, F + b*vecs_per_block*dim,
+				block_vecs(&bh, b)*dim, coded+b);
+		}
+		t_enc = seconds()-t_enc;
+
+		/* size includes the block offsets, as they would be stored */
+		for (bytes=0, b=0; b<bh.num_blocks; b++) {
+			bytes += coded[b].len;
+			bh.offsets[b+1] = bytes;
+		}
+		ef_build(&ef, bh.offsets, bh.num_blocks+1);
+		bytes += BLOCK_HEADER_BYTES + ef_bytes(&ef);
+		ef_free(&ef);
+
+		top_isa = k==CODER_RANSX16 ? ransx16_isa : ISA_SCALAR;
+		for (isa=top_isa; isa>=ISA_SCALAR; isa--) {
+			if (k==CODER_RANSX16) {
+				ransx16_isa = isa;
+				sprintf(label, "%s/%s", coder_names[k],
+					isa_names[isa]);
+			} else {
+				sprintf(label, "%s", coder_names[k]);
+			}
+			t_dec = seconds();
+			for (b=0; b<bh.num_blocks; b++) {
+				decode_block(&bh, coded[b].buf, coded[b].len,
+					G + b*vecs_per_block*dim,
+					block_vecs(&bh, b)*dim);
+			}
+			t_dec = seconds()-t_dec;
+
+			for (i=0; i<nF; i++) {
+				if (G[i] != expect[i]) {
+					fprintf(stderr, "%s: float %lu "
+						"decoded wrongly\n",
+						coder_names[k], i);
+					exit(EXIT_FAILURE);
+				}
+			}
+			printf("%-14s %7.4f %10.1f %10.1f\n",
+				label, 8.0*bytes/nF,
+				nF*sizeof(float)/t_enc/1e6,
+				nF*sizeof(float)/t_dec/1e6);
+		}
+		if (k==CODER_RANSX16) {
+			ransx16_isa = top_isa;
+		}
+
+		for (b=0; b<bh.num_blocks; b++) {
+			free(coded[b].buf);
+		}
+		free(coded);
+		block_header_free(&bh);
+	}
+
+	fprintf(stderr, "bin model entropy %.4f bits/float",
+		model_set_entropy(&ms));
+	if (rans_make_tables(&rt, &ms, scale_bits)) {
+		fprintf(stderr, ", %.4f once normalised to 2^%u",
+			rans_model_bits(&rt), rt.scale);
+		rans_free_tables(&rt);
+	}
+	fprintf(stderr, "\n");
+	free_model_set(&ms);
+	return 0;
+}
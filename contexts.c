@@ -0,0 +1,222 @@
+/* Trains order-1 context counts for a bins file from quantize.c, so that
+   encoder -c context can code each float with counts that depend on the
+   bin of the float before it in the same vector, see order1.c.
+
+   The floats of the index (usually the one the bins were built from) are
+   mapped to their bins, the bins of each table are cut into -n buckets
+   (default 16) of about equal probability, and the bins that follow each
+   bucket are counted, as are the bins in column zero. Each row of counts
+   is then scaled down to 16 bits, every bin keeping at least a count of
+   one, and the rows are written after a copy of the tables to the output
+   bins file, which replaces the input one for encoding and decoding.
+   Any contexts the input bins file already had are replaced.
+
+   Reports the bits per float that the bins file's own counts and the
+   context counts would need for the floats counted, and so what the
+   contexts should save against the plain arithmetic coder.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "helpers.c"
+#include "binmap.c"
+
+#define DEFAULT_BUCKETS 16
+#define CHUNK_VECS 4096		// vectors read and counted at a time
+#define ROW_SCALE 65534		// rows are scaled to about this total
+
+void
+usage(char *prog) {
+	fprintf(stderr, "Usage: %s [-n buckets] bins-file index-file "
+		"out-bins-file\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+/* bytes at the start of the bins file that hold the tables, that is,
+   everything before any contexts */
+size_t
+tables_bytes(const model_set *ms) {
+	size_t bytes=0, k;
+
+	if (ms->dim) {
+		bytes = 3*sizeof(size_t) + ms->dim*sizeof(uint32_t);
+	}
+	for (k=0; k<ms->num_models; k++) {
+		bytes += 2*sizeof(size_t) + ms->models[k].num_bins *
+			(2*sizeof(float) + sizeof(size_t));
+	}
+	return bytes;
+}
+
+int
+main(int argc, char *argv[]) {
+
+	FILE *fb=NULL, *fi=NULL, *fo=NULL;
+	char head[HEADER];
+	model_set ms;
+	size_t nb=DEFAULT_BUCKETS, magic=CONTEXT_MAGIC;
+	size_t dim, num_vecs, n, nF, v, i, k, b, s, col, ctx_bytes;
+	uint64_t **cnt, row_total, prev, floats=0;
+	double bits0=0, bits1=0, bits;
+	const bin_model *m;
+	uint32_t *syms;
+	uint16_t *q;
+	uint8_t *copy;
+	float *F;
+	int opt;
+
+	while ((opt=getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nb = atol(optarg);
+			if (nb<1 || nb>MAX_BUCKETS) usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if ((argc-optind != 3) ||
+		(fb=fopen(argv[optind], "r")) == NULL ||
+		(fi=fopen(argv[optind+1], "r")) == NULL) {
+		usage(argv[0]);
+	}
+	if (!read_model_set(&ms, fb)) {
+		read_error();
+	}
+	if (fread(head, sizeof(*head), HEADER, fi) != HEADER) {
+		read_error();
+	}
+	dim = header_dim(head);
+	num_vecs = header_count(head)/dim;
+	if (ms.dim && ms.dim != dim) {
+		fprintf(stderr, "bins file is for vectors of %lu floats\n",
+			ms.dim);
+		exit(EXIT_FAILURE);
+	}
+
+	/* buckets for nb, whatever the bins file had before */
+	free_contexts(&ms);
+	cnt = malloc(ms.num_models*sizeof(*cnt));
+	assert(cnt);
+	for (k=0; k<ms.num_models; k++) {
+		ms.models[k].ctx = NULL;
+		make_buckets(ms.models+k, nb);
+		cnt[k] = calloc((nb+1)*ms.models[k].num_bins,
+			sizeof(*cnt[k]));
+		assert(cnt[k]);
+	}
+	ms.num_buckets = nb;
+
+	/* count which bins follow which buckets, a chunk of vectors at a
+	   time; for counting, the last row is for column zero */
+	F = malloc(CHUNK_VECS*dim*sizeof(*F));
+	syms = malloc(CHUNK_VECS*dim*sizeof(*syms));
+	assert(F && syms);
+	for (v=0; v<num_vecs; v+=n) {
+		n = num_vecs-v < CHUNK_VECS ? num_vecs-v : CHUNK_VECS;
+		nF = n*dim;
+		if (fread(F, sizeof(*F), nF, fi) != nF) {
+			read_error();
+		}
+		set_floats_to_bins(&ms, 0, F, nF, syms);
+		for (i=0, col=0; i<nF; i++) {
+			k = ms.dim ? ms.col_model[col] : 0;
+			b = col ? column_model(&ms, col-1)->bucket[syms[i-1]] :
+				nb;
+			cnt[k][b*ms.models[k].num_bins + syms[i]]++;
+			col = col+1==dim ? 0 : col+1;
+		}
+		floats += nF;
+	}
+	fclose(fi);
+	free(F);
+	free(syms);
+
+	/* copy the tables over, then the scaled rows */
+	if ((fb=fopen(argv[optind], "r")) == NULL ||
+		(fo=fopen(argv[optind+2], "w")) == NULL) {
+		usage(argv[0]);
+	}
+	n = tables_bytes(&ms);
+	copy = malloc(n);
+	assert(copy);
+	if (fread(copy, 1, n, fb) != n) {
+		read_error();
+	}
+	fclose(fb);
+	fwrite(copy, 1, n, fo);
+	free(copy);
+	fwrite(&magic, sizeof(magic), 1, fo);
+	fwrite(&nb, sizeof(nb), 1, fo);
+
+	ctx_bytes = 2*sizeof(size_t);
+	for (k=0; k<ms.num_models; k++) {
+		m = ms.models+k;
+		q = malloc(m->num_bins*sizeof(*q));
+		assert(q);
+		for (b=0; b<=nb; b++) {
+			for (row_total=0, s=0; s<m->num_bins; s++) {
+				row_total += cnt[k][b*m->num_bins + s];
+			}
+			for (prev=0, s=0; s<m->num_bins; s++) {
+				if (row_total) {
+					q[s] = 1 + cnt[k][b*m->num_bins + s] *
+						ROW_SCALE / row_total;
+				} else {
+					/* never seen, so the table's counts */
+					q[s] = 1 + (m->c[s]-prev) *
+						ROW_SCALE / m->total;
+				}
+				prev = m->c[s];
+			}
+			for (row_total=0, s=0; s<m->num_bins; s++) {
+				row_total += q[s];
+			}
+
+			/* and what coding the counted floats would cost */
+			for (prev=0, s=0; s<m->num_bins; s++) {
+				n = cnt[k][b*m->num_bins + s];
+				if (n) {
+					bits0 -= n*log2((double)(m->c[s]-prev)
+						/ m->total);
+					bits1 -= n*log2((double)q[s] /
+						row_total);
+				}
+				prev = m->c[s];
+			}
+			fwrite(q, sizeof(*q), m->num_bins, fo);
+			ctx_bytes += m->num_bins*sizeof(*q);
+		}
+		free(q);
+		free(cnt[k]);
+	}
+	free(cnt);
+	if (fclose(fo) != 0) {
+		fprintf(stderr, "unable to write %s\n", argv[optind+2]);
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(stderr, "counted %lu vectors of %lu floats, ",
+		num_vecs, dim);
+	fprintf(stderr, "%lu buckets for each of %lu bin tables\n",
+		nb, ms.num_models);
+	bits = floats ? bits0/floats : 0;
+	fprintf(stderr, "order-0 %.4f bits/float, ", bits);
+	fprintf(stderr, "order-1 %.4f bits/float, ",
+		floats ? bits1/floats : 0);
+	fprintf(stderr, "saving %.4f bits/float (%.1f%%)\n",
+		floats ? (bits0-bits1)/floats : 0,
+		bits0>0 ? 100.0*(bits0-bits1)/bits0 : 0);
+	fprintf(stderr, "wrote %lu bytes of contexts to %s\n",
+		ctx_bytes, argv[optind+2]);
+
+	free_model_set(&ms);
+	return 0;
+}
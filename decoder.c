@@ -5,6 +5,13 @@
    surrogate floating point values that should be generated for each
    bin number decoded.
 
+   Compressed files that were coded as independent blocks (encoder -b)
+   are recognised by their block header, see blocks.c, and are decoded
+   by -t threads (default, all of them), with whichever coder the header
+   says was used.
+
+   All of the decoding is done by liblssy, see lssy.h.
+
    Written by Alistair Moffat (The University of Melbourne) as part
    of the paper "Lossy Compression Options for Dense Index Retention"
    at SIGIR-AP 2023.
@@ -13,55 +20,71 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <math.h>
-#include <assert.h>
+#include <unistd.h>
 
-/* yes, doing it this way is a bit ugly, but also convenient */
-#include "helpers.c"
+#include "lssy.h"
+
+void
+usage(char *prog) {
+	fprintf(stderr, "Usage: %s [-t threads] binsfile.bin compressed.bin"
+		" index-out.bin\n", prog);
+	exit(EXIT_FAILURE);
+}
 
 int
 main(int argc, char *argv[]) {
 
-	FILE *fb=NULL, *fi=NULL, *fo=NULL;
-	int i;
+	lssy_model *m;
+	lssy_stats st;
+	int nthreads=0;
+	int opt, err;
 
-	if ((argc<4) ||
-		(fb=fopen(argv[1], "r")) == NULL ||
-		(fi=fopen(argv[2], "r")) == NULL ||
-		(fo=fopen(argv[3], "w")) == NULL) {
-		fprintf(stderr, "Usage: %s binsfile.bin compressed.bin"
-			" index-out.bin\n", argv[0]);
-		exit(EXIT_FAILURE);
+	while ((opt=getopt(argc, argv, "t:")) != -1) {
+		switch (opt) {
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads<1) usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
 	}
 
-	make_arrays_and_read_bin_data(fb);
-	fprintf(stderr, "read descriptions for %lu bins, ", num_bins);
-        fprintf(stderr, "covering %zu symbols\n", total);
+	if (argc-optind<3) {
+		usage(argv[0]);
+	}
+	if ((m=lssy_model_load(argv[optind])) == NULL) {
+		fprintf(stderr, "%s: unable to read bins file %s\n",
+			argv[0], argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	if (lssy_model_tables(m) == 1) {
+		fprintf(stderr, "read descriptions for %lu bins, ",
+			lssy_model_bins(m, 0));
+	} else {
+		fprintf(stderr, "read %lu bin tables for %lu columns, ",
+			lssy_model_tables(m), lssy_model_dim(m));
+	}
+	fprintf(stderr, "covering %lu symbols\n", lssy_model_total(m));
+	if (lssy_model_contexts(m)) {
+		fprintf(stderr, "with order-1 contexts in %lu buckets\n",
+			lssy_model_contexts(m));
+	}
 
 	/* should now be in synch with the encoder
 	*/
 
-	/* ok, have the bin data, next step is to copy over the
-	   is a sequence of float values, each must be searched for
-	   and mapped to a bin number */
-
-	if (fread(head, sizeof(*head), HEADER, fi) != 1) {
-    read_error();
-  }
-	fwrite(head, sizeof(*head), HEADER, fo);
-
-	size_t cnt=0;
-	size_t v;
-
-	decoder_start(fi);
-
-	for (i=0; i<total; i++) {
-		v = arith_decode(c, num_bins, fi);
-		fwrite(S+v, sizeof(float), 1, fo);
-		cnt++;
+	err = lssy_decode_file(m, argv[optind+1], argv[optind+2], nthreads,
+		&st);
+	if (err != LSSY_OK) {
+		fprintf(stderr, "%s: %s\n", argv[0], lssy_strerror(err));
+		exit(EXIT_FAILURE);
 	}
 
-	fclose(fo);
-	fprintf(stderr, "expanded %lu codes for quantized floats\n", cnt);
+	fprintf(stderr, "expanded %lu codes for quantized floats\n",
+		st.floats);
+	fprintf(stderr, "decoded in %.2f seconds, %.1f MB/s of floats\n",
+		st.seconds, st.floats*sizeof(float)/st.seconds/1e6);
+	lssy_model_free(m);
 	return 0;
 }
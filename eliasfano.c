@@ -0,0 +1,153 @@
+/* Elias-Fano coding of a non-decreasing sequence of n integers, each
+   less than u, in n*(2+ceil(log2(u/n))) bits or thereabouts, with
+   access to any one of them in constant time.
+
+   Each value is split into l low bits, stored verbatim, and the high
+   part, stored in unary as the gaps between one bits in a bitvector.
+   The i'th value's high part is then the position of the i'th one bit,
+   less i. To find that position quickly, the position of every
+   EF_SAMPLE'th one bit is noted when the bitvector is loaded.
+*/
+
+#define EF_SAMPLE 256
+
+typedef struct {
+	uint64_t n;		// number of values
+	uint64_t u;		// all values less than this
+	uint64_t l;		// low bits per value
+	uint64_t low_words;
+	uint64_t high_words;
+	uint64_t *low;
+	uint64_t *high;
+	uint64_t *samples;	// position of one bit k*EF_SAMPLE in high
+} elias_fano;
+
+static inline void
+ef_set_bits(uint64_t *words, uint64_t pos, uint64_t bits, uint64_t val) {
+	if (bits==0) return;
+	words[pos/64] |= val << (pos%64);
+	if (pos%64 + bits > 64) {
+		words[pos/64+1] |= val >> (64 - pos%64);
+	}
+}
+
+static inline uint64_t
+ef_get_bits(const uint64_t *words, uint64_t pos, uint64_t bits) {
+	uint64_t val;
+	if (bits==0) return 0;
+	val = words[pos/64] >> (pos%64);
+	if (pos%64 + bits > 64) {
+		val |= words[pos/64+1] << (64 - pos%64);
+	}
+	return val & ((bits==64) ? ~0ULL : ((1ULL<<bits)-1));
+}
+
+/* sample the positions of the one bits, every EF_SAMPLE'th of them */
+void
+ef_make_samples(elias_fano *ef) {
+	uint64_t w, word, ones=0, k=0;
+	ef->samples = malloc((ef->n/EF_SAMPLE + 1)*sizeof(*ef->samples));
+	assert(ef->samples);
+	for (w=0; w<ef->high_words; w++) {
+		for (word=ef->high[w]; word; word &= word-1) {
+			if (ones%EF_SAMPLE == 0) {
+				ef->samples[k++] = 64*w + __builtin_ctzll(word);
+			}
+			ones++;
+		}
+	}
+	assert(ones==ef->n);
+}
+
+void
+ef_build(elias_fano *ef, const uint64_t *vals, uint64_t n) {
+	uint64_t i;
+	ef->n = n;
+	ef->u = n ? vals[n-1]+1 : 1;
+	ef->l = 0;
+	while (n && (ef->u >> (ef->l+1)) >= n) {
+		ef->l++;
+	}
+	ef->low_words = (n*ef->l + 63)/64 + 1;
+	ef->high_words = (n + (ef->u >> ef->l) + 63)/64 + 1;
+	ef->low = calloc(ef->low_words, sizeof(*ef->low));
+	ef->high = calloc(ef->high_words, sizeof(*ef->high));
+	assert(ef->low && ef->high);
+	for (i=0; i<n; i++) {
+		assert(i==0 || vals[i-1]<=vals[i]);
+		ef_set_bits(ef->low, i*ef->l, ef->l,
+			vals[i] & ((1ULL<<ef->l)-1));
+		ef_set_bits(ef->high, (vals[i]>>ef->l) + i, 1, 1);
+	}
+	ef_make_samples(ef);
+}
+
+/* the i'th value, 0<=i<n */
+uint64_t
+ef_get(const elias_fano *ef, uint64_t i) {
+	uint64_t pos, w, word, skip;
+
+	assert(i<ef->n);
+	/* start at the nearest sample, then count ones a word at a time */
+	pos = ef->samples[i/EF_SAMPLE];
+	skip = i%EF_SAMPLE;
+	w = pos/64;
+	word = ef->high[w] & (~0ULL << (pos%64));
+	while (skip >= (uint64_t)__builtin_popcountll(word)) {
+		skip -= __builtin_popcountll(word);
+		word = ef->high[++w];
+	}
+	while (skip--) {
+		word &= word-1;
+	}
+	pos = 64*w + __builtin_ctzll(word);
+
+	return ((pos - i) << ef->l) | ef_get_bits(ef->low, i*ef->l, ef->l);
+}
+
+/* bytes that ef_write() will produce */
+size_t
+ef_bytes(const elias_fano *ef) {
+	return (5 + ef->low_words + ef->high_words)*sizeof(uint64_t);
+}
+
+void
+ef_write(const elias_fano *ef, FILE *fp) {
+	fwrite(&ef->n, sizeof(ef->n), 1, fp);
+	fwrite(&ef->u, sizeof(ef->u), 1, fp);
+	fwrite(&ef->l, sizeof(ef->l), 1, fp);
+	fwrite(&ef->low_words, sizeof(ef->low_words), 1, fp);
+	fwrite(&ef->high_words, sizeof(ef->high_words), 1, fp);
+	fwrite(ef->low, sizeof(*ef->low), ef->low_words, fp);
+	fwrite(ef->high, sizeof(*ef->high), ef->high_words, fp);
+}
+
+/* returns zero if the read fails */
+int
+ef_read(elias_fano *ef, FILE *fp) {
+	if (fread(&ef->n, sizeof(ef->n), 1, fp) != 1 ||
+			fread(&ef->u, sizeof(ef->u), 1, fp) != 1 ||
+			fread(&ef->l, sizeof(ef->l), 1, fp) != 1 ||
+			fread(&ef->low_words, sizeof(ef->low_words), 1, fp) != 1 ||
+			fread(&ef->high_words, sizeof(ef->high_words), 1, fp) != 1) {
+		return 0;
+	}
+	ef->low = malloc(ef->low_words*sizeof(*ef->low));
+	ef->high = malloc(ef->high_words*sizeof(*ef->high));
+	assert(ef->low && ef->high);
+	if (fread(ef->low, sizeof(*ef->low), ef->low_words, fp)
+			!= ef->low_words ||
+			fread(ef->high, sizeof(*ef->high), ef->high_words, fp)
+			!= ef->high_words) {
+		return 0;
+	}
+	ef_make_samples(ef);
+	return 1;
+}
+
+void
+ef_free(elias_fano *ef) {
+	free(ef->low);
+	free(ef->high);
+	free(ef->samples);
+}
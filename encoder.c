@@ -7,6 +7,25 @@
 
    That stream of bin numbers is then entropy coded.
 
+   With -b, the floats are instead coded as independent blocks of the
+   given number of vectors, spread across -t threads (default, all of
+   them), see blocks.c. Blocks can be coded with the arithmetic coder
+   (-c arith, the default) or with rANS (-c rans, with -s giving log2 of
+   the normalised frequency total), see rans.c, or with sixteen-way
+   interleaved rANS for SIMD decoding (-c ransx16), see ransx16.c. Or,
+   with -c adaptive, each block gets the arithmetic coder with whichever
+   of the bins file's counts and counts that adapt to the block's own
+   floats codes it in fewer bytes, see adaptive.c. And -c context codes
+   each float with counts that depend on the float before it in the same
+   vector, which needs a bins file with contexts from contexts.c, see
+   order1.c.
+
+   For the fastest decoding, -c packed stores each bin number in a fixed
+   number of bits instead, ceil(log2(num_bins)), so that every vector is
+   where it is expected to be, without blocks; see packed.c.
+
+   All of the coding is done by liblssy, see lssy.h.
+
    Written by Alistair Moffat (The University of Melbourne) as part
    of the paper "Lossy Compression Options for Dense Index Retention"
    at SIGIR-AP 2023.
@@ -18,84 +37,105 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <math.h>
-#include <assert.h>
+#include <unistd.h>
+
+#include "lssy.h"
 
-#include "helpers.c"
+void
+usage(char *prog) {
+	fprintf(stderr, "Usage: %s [-b vecs-per-block] [-t threads] "
+		"[-c arith|rans|ransx16|adaptive|context|packed] "
+		"[-s rans-scale-bits] bins-file index-file prox-file\n", prog);
+	exit(EXIT_FAILURE);
+}
 
 int
 main(int argc, char *argv[]) {
 
-	FILE *fb=NULL, *fi=NULL, *fo=NULL;
+	lssy_model *m;
+	lssy_encode_options opt;
+	lssy_stats st;
+	int opt_c, err;
+	long n;
+
+	lssy_encode_defaults(&opt);
+	while ((opt_c=getopt(argc, argv, "b:t:c:s:")) != -1) {
+		switch (opt_c) {
+		case 'b':
+			n = atol(optarg);
+			if (n<1) usage(argv[0]);
+			opt.vecs_per_block = n;
+			break;
+		case 't':
+			opt.threads = atoi(optarg);
+			if (opt.threads<1) usage(argv[0]);
+			break;
+		case 'c':
+			opt.coder = lssy_coder_by_name(optarg);
+			if (opt.coder<0) usage(argv[0]);
+			break;
+		case 's':
+			opt.scale_bits = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
 
-	if ((argc != 4) ||
-		(fb=fopen(argv[1], "r")) == NULL ||
-		(fi=fopen(argv[2], "r")) == NULL ||
-		(fo=fopen(argv[3], "w")) == NULL) {
-		fprintf(stderr, "Usage: %s bins-file index-file prox-file\n",
-			argv[0]);
+	if (argc-optind != 3) {
+		usage(argv[0]);
+	}
+	if ((m=lssy_model_load(argv[optind])) == NULL) {
+		fprintf(stderr, "%s: unable to read bins file %s\n",
+			argv[0], argv[optind]);
 		exit(EXIT_FAILURE);
 	}
 
-	make_arrays_and_read_bin_data(fb);
-
-        fprintf(stderr, "read descriptions for %lu bins, ", num_bins);
-	fprintf(stderr, "covering %zu symbols\n", total);
+	if (lssy_model_tables(m) == 1) {
+		fprintf(stderr, "read descriptions for %lu bins, ",
+			lssy_model_bins(m, 0));
+	} else {
+		fprintf(stderr, "read %lu bin tables for %lu columns, ",
+			lssy_model_tables(m), lssy_model_dim(m));
+	}
+	fprintf(stderr, "covering %lu symbols\n", lssy_model_total(m));
+	if (lssy_model_contexts(m)) {
+		fprintf(stderr, "with order-1 contexts in %lu buckets\n",
+			lssy_model_contexts(m));
+	}
 
 
 	/* ok, have the bin data, now for the fun part, second file
 	   is a sequence of float values, each must be searched for
 	   and mapped to a bin number */
 
-	float f;
-
-	if (fread(head, sizeof(*head), HEADER, fi) != 1) {
-    read_error();
-  } 
-	fwrite(head, sizeof(*head), HEADER, fo);
-
-	size_t cnt=0;
-
-	while (fread(&f, sizeof(f), 1, fi) == 1) {
-
-		// printf("f = %10.7f, ", f);
-
-		/* loop fetches and processes one number */
-		int lo, hi, md;
-
-		/* writing binary search, now that's brave */
-		lo = 0; hi = num_bins-1;
-		while (lo < hi) {
-			md = lo + (hi-lo)/2;
-			if (f <= U[md]) {
-				hi = md;
-			} else {
-				lo = md+1;
-			}
-		}
-
-		assert(lo==0 || U[lo-1]<f);
-		assert(f <= U[lo]);
-
-		cnt++;
-
-		/* ok, so the bin number we want to code is "lo",
-		   let's give it our best shot! */
-		arith_encode(lo, c, num_bins, fo);
+	err = lssy_encode_file(m, argv[optind+1], argv[optind+2], &opt, &st);
+	if (err != LSSY_OK) {
+		fprintf(stderr, "%s: %s\n", argv[0], lssy_strerror(err));
+		exit(EXIT_FAILURE);
 	}
 
-	encoder_close(fo);
-	fclose(fo);
-
+	if (st.blocks) {
+		fprintf(stderr, "coded %lu blocks of %lu vectors ",
+			st.blocks, st.vecs_per_block);
+		fprintf(stderr, "with %s on %d threads\n",
+			lssy_coder_name(st.coder), st.threads);
+	} else if (st.coder == LSSY_PACKED) {
+		fprintf(stderr, "packed fixed-width codes on %d threads\n",
+			st.threads);
+	}
 	fprintf(stderr, "wrote %lu codes for floats to %s\n",
-		cnt, COMPRESS_FILE);
+		st.floats, COMPRESS_FILE);
 	fprintf(stderr, "wrote %lu bytes of output ",
-		bytes_out);
-	fprintf(stderr, "including %d bytes of header\n", HEADER);
+		st.bytes);
+	fprintf(stderr, "including %d bytes of header\n", LSSY_HEADER);
 	fprintf(stderr, "corresponds to %.4f bits/float, ",
-		8.0*bytes_out/cnt);
+		8.0*st.bytes/st.floats);
 	fprintf(stderr, "or %.2f%% of raw float size\n",
-		100*(8.0*bytes_out)/(32.0*cnt));
+		100*(8.0*st.bytes)/(32.0*st.floats));
+	fprintf(stderr, "coded in %.2f seconds, %.1f MB/s of floats\n",
+		st.seconds, st.floats*sizeof(float)/st.seconds/1e6);
 		
+	lssy_model_free(m);
 	return 0;
 }
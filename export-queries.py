@@ -0,0 +1,41 @@
+import numpy as np
+import argparse
+import os
+import pandas as pd
+
+
+def read_pkl(path):
+    """
+    Read a pickled query with id/embeddings stored.
+    This corresponds to Pyserini ANCE embedded queries
+    """
+    df = pd.read_pickle(os.path.join(path, 'embedding.pkl'))
+    return df['id'].tolist(), df['embedding'].tolist()
+
+def read_queries(path):
+    """
+    Read the queries generated by the random queries tool
+    """
+    data = np.load(path)
+    return data['qids'].tolist(), data['query_vectors'].tolist()
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--queries', type=str, help='query directory (embedding.pkl), or .queries file from gen-random-queries.py', required=True)
+    parser.add_argument('--output', type=str, help='output text file for search', required=True)
+    args = parser.parse_args()
+
+    # (1): Load the queries, as run-faiss.py does
+    print ("Loading query embeddings from file")
+    if os.path.isdir(args.queries):
+        qids, query_embeddings = read_pkl(args.queries)
+    else:
+        qids, query_embeddings = read_queries(args.queries)
+    query_embeddings = np.array(query_embeddings, dtype=np.float32)
+
+    # (2): One line per query, its id and then its floats; numpy prints
+    # float32 values with just enough digits to get them back exactly
+    print ("Exporting the queries...")
+    with open(args.output, 'w') as output:
+        for qid, vector in zip(qids, query_embeddings):
+            output.write("{} {}\n".format(qid, " ".join(str(v) for v in vector)))
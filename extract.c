@@ -0,0 +1,86 @@
+/* Pulls individual vectors out of a compressed index, without decoding
+   the whole thing. The index must have been coded in blocks (encoder -b),
+   and the fewer vectors per block, the less there is to decode for each
+   one fetched; with -b 1, every vector can be decoded on its own. So can
+   every vector of a packed index (encoder -c packed).
+
+   The ids file is a list of vector numbers (counting from zero), in text,
+   and the output file gets the corresponding vectors, in the same order,
+   as dim binary 32-bit floats each.
+
+   Uses the bins file that the index was coded with, and the index
+   functions of liblssy, see lssy.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <time.h>
+
+#include "lssy.h"
+
+int
+main(int argc, char *argv[]) {
+
+	FILE *fi=NULL, *fo=NULL;
+	lssy_model *m=NULL;
+	lssy_index *ix;
+	size_t *ids, num_ids=0, max_ids=1024, id, dim;
+	float *out;
+	struct timespec t0, t1;
+
+	if ((argc != 5) ||
+		(m=lssy_model_load(argv[1])) == NULL ||
+		(fi=fopen(argv[3], "r")) == NULL ||
+		(fo=fopen(argv[4], "w")) == NULL) {
+		fprintf(stderr, "Usage: %s bins-file compressed-file "
+			"ids-file vectors-out\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if ((ix=lssy_index_open(m, argv[2])) == NULL) {
+		fprintf(stderr, "%s is not a block-coded or packed index, "
+			"see encoder -b\n", argv[2]);
+		exit(EXIT_FAILURE);
+	}
+	dim = lssy_index_dim(ix);
+
+	ids = malloc(max_ids*sizeof(*ids));
+	assert(ids);
+	while (fscanf(fi, "%zu", &id) == 1) {
+		if (id >= lssy_index_vectors(ix)) {
+			fprintf(stderr, "vector %zu is out of range, "
+				"index has %lu\n", id, lssy_index_vectors(ix));
+			exit(EXIT_FAILURE);
+		}
+		if (num_ids == max_ids) {
+			max_ids *= 2;
+			ids = realloc(ids, max_ids*sizeof(*ids));
+			assert(ids);
+		}
+		ids[num_ids++] = id;
+	}
+	fclose(fi);
+
+	out = malloc(num_ids*dim*sizeof(*out));
+	assert(out || num_ids==0);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	lssy_index_fetch(ix, ids, num_ids, out);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	fwrite(out, sizeof(*out), num_ids*dim, fo);
+	fclose(fo);
+
+	fprintf(stderr, "fetched %lu vectors of %lu floats ",
+		num_ids, dim);
+	fprintf(stderr, "from blocks of %lu vectors ",
+		lssy_index_vecs_per_block(ix));
+	fprintf(stderr, "in %.2f ms\n", 1e3*(t1.tv_sec-t0.tv_sec) +
+		1e-6*(t1.tv_nsec-t0.tv_nsec));
+
+	lssy_index_close(ix);
+	lssy_model_free(m);
+	return 0;
+}
@@ -4,109 +4,460 @@
 #include <ios>
 #include <cstring>
 #include <cstdlib>
+#include <cstdio>
 #include <execution>
+#include <numeric>
+#include <queue>
+#include <random>
+#include <string>
+#include <unistd.h>
 
-// 37 bytes before the data begins; this is the FAISS
-// header. 
-// https://github.com/facebookresearch/faiss/blob/main/faiss/impl/io.cpp 
-struct flat_header {
-  uint32_t fourcc;  // 'IFxI'
-  int32_t  dim;     // Vector dimensionality
-  int64_t  ntotal;  // Number of vectors stored
-  int64_t  dummy_a; // A dummy value, 1 << 20
-  int64_t  dummy_b; // A dummy value, 1 << 20
-  bool     trained; // Is the model trained? Meaningless here.
-  uint32_t   metric;  // Metric type; actually an enum in FAISS, meaningless here.
-
-  // Loads into self from an istream
-  void load(std::istream& in) {
-    in.read(reinterpret_cast<char *>(&fourcc), sizeof(uint32_t));
-    in.read(reinterpret_cast<char *>(&dim), sizeof(int32_t));
-    in.read(reinterpret_cast<char *>(&ntotal), sizeof(int64_t));
-    in.read(reinterpret_cast<char *>(&dummy_a), sizeof(int64_t));
-    in.read(reinterpret_cast<char *>(&dummy_b), sizeof(int64_t));
-    in.read(reinterpret_cast<char *>(&trained), sizeof(bool));
-    in.read(reinterpret_cast<char *>(&metric), sizeof(uint32_t));
-  }
+#include "flat_index.hpp"
+#include "radix_sort.hpp"
 
-  // Back to disk
-  void write(std::ostream& out) {
-    out.write(reinterpret_cast<const char *>(&fourcc), sizeof(uint32_t));
-    out.write(reinterpret_cast<char *>(&dim), sizeof(int32_t));
-    out.write(reinterpret_cast<char *>(&ntotal), sizeof(int64_t));
-    out.write(reinterpret_cast<char *>(&dummy_a), sizeof(int64_t));
-    out.write(reinterpret_cast<char *>(&dummy_b), sizeof(int64_t));
-    out.write(reinterpret_cast<char *>(&trained), sizeof(bool));
-    out.write(reinterpret_cast<char *>(&metric), sizeof(uint32_t));
-  }
+// Run-length sidx files, from -r, start with this rather than with the
+// number of dimensions; see quantize.c
+const size_t SIDX_RUNS_MAGIC = 0x4c535352;
 
-  // Some basic info from the header
-  void info() const {
-    std::cout << "Dim    = " << dim << "\n"
-              << "Ntotal = " << ntotal << "\n";
-  }
+// Writes sorted floats as runs of equal floats, for -r: a set of floats
+// (the whole index, or one dimension of it) is written as the number of
+// runs, then a (float, count) pair for each. The number of runs is only
+// known at the end, so it is filled in then. A run is of floats with the
+// same bits, so -0.0 and 0.0 are kept apart, and no run is longer than
+// a count can say.
+class run_writer {
+
+  public:
+    explicit run_writer(std::ostream& out) : m_out(out), m_start(out.tellp()) {
+      m_out.write(reinterpret_cast<const char *>(&m_runs), sizeof(size_t));
+      m_buf.reserve(BUF_RUNS);
+    }
+
+    void add(const float *f, size_t n) {
+      for (size_t i = 0; i < n; ++i) {
+        if (m_buf.empty() || !same_bits(m_buf.back().value, f[i]) ||
+            m_buf.back().count == UINT32_MAX) {
+          if (m_buf.size() == BUF_RUNS) {
+            // The last run may go on, so it stays
+            write(m_buf.size() - 1);
+          }
+          m_buf.push_back({f[i], 0});
+        }
+        m_buf.back().count++;
+      }
+    }
+
+    // Writes the rest, and goes back for the number of runs
+    size_t finish() {
+      write(m_buf.size());
+      auto end = m_out.tellp();
+      m_out.seekp(m_start);
+      m_out.write(reinterpret_cast<const char *>(&m_runs), sizeof(size_t));
+      m_out.seekp(end);
+      return m_runs;
+    }
 
+  private:
+    struct run {
+      float    value;
+      uint32_t count;
+    };
+    static_assert(sizeof(run) == 8, "runs are written as they are");
+
+    static bool same_bits(float a, float b) {
+      return std::memcmp(&a, &b, sizeof(float)) == 0;
+    }
+
+    // Writes the first n runs of the buffer
+    void write(size_t n) {
+      m_out.write(reinterpret_cast<const char *>(m_buf.data()), n * sizeof(run));
+      m_runs += n;
+      m_buf.erase(m_buf.begin(), m_buf.begin() + n);
+    }
+
+    static constexpr size_t BUF_RUNS = 1 << 16;
+
+    std::ostream&       m_out;
+    std::streampos      m_start;        // Where the number of runs goes
+    size_t              m_runs = 0;     // Runs written
+    std::vector<run>    m_buf;
 };
 
+
 // Everything we need to store/recover vectors without FAISS
 class vector_data_32 {
 
   public:
     vector_data_32(size_t dim, size_t ntotal) : m_dimensions(dim), m_num_vectors(ntotal) {}
 
-    // Loads into self from an istream and checks vector length
-    void load(std::istream& in) {
-      size_t vals_to_read;
-      in.read(reinterpret_cast<char *>(&vals_to_read), sizeof(size_t));
-      m_codes.resize(vals_to_read); // This is in terms of bytes
-      in.read(reinterpret_cast<char *>(&m_codes[0]), vals_to_read * sizeof(float));
-      if (!in) {
-        std::cout << "Error: only " << in.gcount() << " bytes could be read\n";
-        std::exit(-1);
-      }
+    // Copies the floats of a mapped index, as sorting changes them
+    void load(const float_span& floats) {
+      m_codes = floats.to_vector();
     }
 
     // New format
     void write(std::ostream& out) const {
-      size_t elements = m_dimensions * m_num_vectors;
+      write_header(out);
+      write_codes(out);
+    }
+
+    // Just the two sizes, for when the floats are written some other way
+    void write_header(std::ostream& out) const {
       out.write(reinterpret_cast<const char *>(&m_dimensions), sizeof(size_t));
       out.write(reinterpret_cast<const char *>(&m_num_vectors), sizeof(size_t));
-      out.write(reinterpret_cast<const char *>(&m_codes[0]), elements * sizeof(uint32_t)); // Assume 32 bits
     }
 
+    // And just the floats held
+    void write_codes(std::ostream& out) const {
+      out.write(reinterpret_cast<const char *>(&m_codes[0]), m_codes.size() * sizeof(uint32_t)); // Assume 32 bits
+    }
+
+    // Or the head of a run-length file, with the number of sets of runs
+    void write_runs_header(std::ostream& out, size_t sets) const {
+      out.write(reinterpret_cast<const char *>(&SIDX_RUNS_MAGIC), sizeof(size_t));
+      write_header(out);
+      out.write(reinterpret_cast<const char *>(&sets), sizeof(size_t));
+    }
+
+    // And the floats held as runs, in sets of set_size floats, returning
+    // the number of runs
+    size_t write_runs(std::ostream& out, size_t set_size) const {
+      size_t runs = 0;
+      for (size_t first = 0; first < m_codes.size(); first += set_size) {
+        run_writer writer(out);
+        writer.add(&m_codes[first], std::min(set_size, m_codes.size() - first));
+        runs += writer.finish();
+      }
+      return runs;
+    }
+
+    // Needs as much memory again for the radix sort's scratch
     void sort() {
-      std::sort(std::execution::par_unseq, m_codes.begin(), m_codes.end());
+      radix_sorter().sort(m_codes.data(), m_codes.size());
+    }
+
+    // Lays the floats of dimensions first..last-1 of a mapped index out a
+    // dimension at a time, each dimension sorted on its own, so that
+    // quantize can bin each dimension separately; this is the only copy
+    // made of them
+    void load_by_dimension(const float_span& floats, size_t first, size_t last) {
+      m_codes.resize((last - first) * m_num_vectors);
+      std::vector<size_t> dims(last - first);
+      std::iota(dims.begin(), dims.end(), first);
+      // A radix sort of one thread per column, the columns spread over
+      // the cores; each thread keeps one column of scratch, on top of
+      // the budget
+      std::for_each(std::execution::par, dims.begin(), dims.end(), [&](size_t d) {
+        thread_local std::vector<float> scratch;
+        float *col = &m_codes[(d - first) * m_num_vectors];
+        for (size_t i = 0; i < m_num_vectors; ++i) {
+          col[i] = floats[i * m_dimensions + d];
+        }
+        scratch.resize(m_num_vectors);
+        radix_sorter(1).sort(col, m_num_vectors, scratch.data());
+      });
     }
 
   private:
     size_t               m_dimensions;  // How large are the strides?
     size_t               m_num_vectors; // Where does the data end?
-    std::vector<float>   m_codes;       // The data itself 
+    std::vector<float>   m_codes;       // The data itself
+};
+
+
+// Sorts indexes bigger than the memory budget. The floats are sorted a
+// run at a time, each run half the budget, the other half the radix
+// sort's scratch, and the runs spilled one after another to a temporary
+// file; then they are merged into the output, each run read through a
+// buffer of its own, with the budget shared between those and the
+// output buffer. All reads and writes are of whole buffers.
+class external_sorter {
+
+  public:
+    external_sorter(size_t budget_bytes, const std::string& spill_path)
+      : m_budget(budget_bytes / sizeof(float)), m_spill_path(spill_path) {}
+
+    // Sorts the floats and appends them to out, or to writer if given
+    void sort(const float_span& floats, std::ostream& out, run_writer *writer = nullptr) {
+      size_t run_floats = std::min(std::max<size_t>(m_budget / 2, 1), floats.size());
+      std::vector<size_t> run_starts;
+
+      // The runs, sorted in parallel and spilled
+      {
+        std::ofstream spill(m_spill_path, std::ios::binary);
+        std::vector<float> run(run_floats), scratch(run_floats);
+        radix_sorter sorter;
+        for (size_t first = 0; first < floats.size(); first += run_floats) {
+          size_t n = std::min(run_floats, floats.size() - first);
+          floats.copy(first, n, run.data());
+          sorter.sort(run.data(), n, scratch.data());
+          spill.write(reinterpret_cast<const char *>(run.data()), n * sizeof(float));
+          run_starts.push_back(first);
+        }
+        if (!spill.flush()) {
+          fail("unable to write " + m_spill_path);
+        }
+      }
+      run_starts.push_back(floats.size());
+      std::cerr << "Sorted " << run_starts.size() - 1 << " runs of up to "
+                << run_floats << " floats, merging\n";
+
+      merge(run_starts, out, writer);
+      std::remove(m_spill_path.c_str());
+    }
+
+  private:
+    // One run being merged, and where it is up to
+    struct run_reader {
+      std::ifstream in;
+      std::vector<float> buf;
+      size_t pos = 0;           // next float of buf
+      size_t left = 0;          // floats of the run not yet in buf
+
+      // Refills buf, false once the run is done
+      bool refill() {
+        size_t n = std::min(buf.capacity(), left);
+        if (n == 0) {
+          return false;
+        }
+        buf.resize(n);
+        if (!in.read(reinterpret_cast<char *>(buf.data()), n * sizeof(float))) {
+          fail("unable to read back a run");
+        }
+        left -= n;
+        pos = 0;
+        return true;
+      }
+    };
+
+    void merge(const std::vector<size_t>& run_starts, std::ostream& out, run_writer *writer) {
+      size_t num_runs = run_starts.size() - 1;
+      size_t block = std::max<size_t>(m_budget / (num_runs + 1), MIN_BLOCK_FLOATS);
+      std::vector<run_reader> runs(num_runs);
+
+      // Smallest value first, then the lowest run, so ties come out in
+      // the order they went in; values are compared as the radix sort
+      // does, so that -0.0 comes before 0.0 here too
+      using item = std::pair<float, size_t>;
+      auto later = [](const item& a, const item& b) {
+        uint32_t ka = radix_sorter::key(a.first), kb = radix_sorter::key(b.first);
+        return ka != kb ? ka > kb : a.second > b.second;
+      };
+      std::priority_queue<item, std::vector<item>, decltype(later)> heap(later);
+      for (size_t r = 0; r < num_runs; ++r) {
+        runs[r].in.open(m_spill_path, std::ios::binary);
+        runs[r].in.seekg(run_starts[r] * sizeof(float));
+        runs[r].buf.reserve(block);
+        runs[r].left = run_starts[r + 1] - run_starts[r];
+        if (!runs[r].in || !runs[r].refill()) {
+          fail("unable to read back " + m_spill_path);
+        }
+        heap.push({runs[r].buf[0], r});
+      }
+
+      std::vector<float> merged;
+      merged.reserve(block);
+      while (!heap.empty()) {
+        auto [value, r] = heap.top();
+        heap.pop();
+        merged.push_back(value);
+        if (merged.size() == block) {
+          flush(merged, out, writer);
+        }
+        run_reader& run = runs[r];
+        if (++run.pos < run.buf.size() || run.refill()) {
+          heap.push({run.buf[run.pos], r});
+        }
+      }
+      flush(merged, out, writer);
+    }
+
+    static void flush(std::vector<float>& merged, std::ostream& out, run_writer *writer) {
+      if (writer) {
+        writer->add(merged.data(), merged.size());
+      } else {
+        out.write(reinterpret_cast<const char *>(merged.data()), merged.size() * sizeof(float));
+      }
+      merged.clear();
+    }
+
+    [[noreturn]] static void fail(const std::string& why) {
+      std::cerr << "Error: " << why << "\n";
+      std::exit(EXIT_FAILURE);
+    }
+
+    // No block smaller than this, whatever the budget, to keep I/O large
+    static constexpr size_t MIN_BLOCK_FLOATS = 1 << 18;
+
+    size_t       m_budget;      // floats
+    std::string  m_spill_path;
 };
 
 
+// Samples for -p, so that bins can be built from far fewer floats than
+// the index has, and then counted over all of them, see quantize -c.
+// The same seed every time, so a sample can be made again.
+const uint64_t SAMPLE_SEED = 42;
+
+// A stratified sample of n whole vectors: the index is cut into n strata
+// of consecutive vectors, as near equal in size as they can be, and one
+// vector is picked at random from each, so that no part of the index is
+// missed. Only the vectors picked are read.
+std::vector<float> sample_vectors(const mapped_flat_index& flat, size_t n) {
+  std::mt19937_64 gen(SAMPLE_SEED);
+  std::vector<float> sample(n * flat.dim());
+  for (size_t s = 0; s < n; ++s) {
+    size_t first = flat.size() * s / n, last = flat.size() * (s + 1) / n;
+    size_t v = first + std::uniform_int_distribution<size_t>(0, last - first - 1)(gen);
+    flat.floats().copy(v * flat.dim(), flat.dim(), &sample[s * flat.dim()]);
+  }
+  return sample;
+}
+
+// A uniform random sample of n floats from anywhere in the index, each
+// float as likely as any other to be picked, by selection sampling
+// (Knuth's Algorithm S) in one pass over the floats
+std::vector<float> sample_floats(const float_span& floats, size_t n) {
+  std::mt19937_64 gen(SAMPLE_SEED);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  std::vector<float> sample;
+  sample.reserve(n);
+  for (size_t i = 0; i < floats.size() && sample.size() < n; ++i) {
+    if ((floats.size() - i) * uniform(gen) < n - sample.size()) {
+      sample.push_back(floats[i]);
+    }
+  }
+  return sample;
+}
+
+
 // Assume 4-byte (floats)
 const size_t UNIT_BYTES = 4;
 
+static void usage(const char *prog) {
+  std::cerr << "Usage " << prog << " [-d] [-r] [-m <budget_MB>] [-p <sample_vectors> [-u]] "
+            << "<path_to_flat_FAISS_index> <out_index>\n";
+  std::exit(-1);
+}
+
 int main(int argc, char **argv) {
 
-  if (argc != 3) {
-    std::cerr << "Usage " << argv[0] << "<path_to_flat_FAISS_index> <out_index>\n";
-    return -1;
+  // -d sorts each dimension on its own, for quantize -d or -k; -r writes
+  // runs of equal floats rather than every float; -m keeps memory for
+  // the floats to about that many MB; -p sorts a sample of that many
+  // vectors instead of the whole index, or as many floats picked
+  // uniformly at random with -u
+  bool by_dimension = false;
+  bool runs = false;
+  bool uniform = false;
+  size_t budget = 0;
+  size_t sample_size = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "drm:p:u")) != -1) {
+    switch (opt) {
+    case 'd':
+      by_dimension = true;
+      break;
+    case 'r':
+      runs = true;
+      break;
+    case 'm':
+      budget = std::atol(optarg) * (size_t(1) << 20);
+      if (budget == 0) usage(argv[0]);
+      break;
+    case 'p':
+      sample_size = std::atol(optarg);
+      if (sample_size == 0) usage(argv[0]);
+      break;
+    case 'u':
+      uniform = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2 || (uniform && (!sample_size || by_dimension))) {
+    usage(argv[0]);
   }
+  char **files = argv + optind;
 
-  // Load the FAISS flat index
-  std::ifstream ifs(argv[1], std::ios::binary);
-  flat_header fh;
-  fh.load(ifs);
-  vector_data_32 idx(fh.dim, fh.ntotal);
-  idx.load(ifs);
+  // Map the FAISS flat index, and take the sample if there is to be one
+  mapped_flat_index flat(files[0]);
+  float_span source = flat.floats();
+  size_t num_vectors = flat.size();
+  std::vector<float> sample;
+  if (sample_size && sample_size < flat.size()) {
+    if (uniform) {
+      flat.sequential();
+      sample = sample_floats(flat.floats(), sample_size * flat.dim());
+    } else {
+      sample = sample_vectors(flat, sample_size);
+    }
+    source = float_span(reinterpret_cast<const char *>(sample.data()), sample.size());
+    num_vectors = sample_size;
+    std::cerr << "Sampled " << sample.size() << " of " << flat.floats().size() << " floats, "
+              << (uniform ? "uniformly" : "by vector") << "\n";
+  }
 
-  // Sort the numbers for quantization later
-  idx.sort();
+  vector_data_32 idx(flat.dim(), num_vectors);
+  size_t bytes = source.size() * UNIT_BYTES;
+  std::ofstream ofs(files[1], std::ios::binary);
+  size_t num_runs = 0;
 
-  // Dump the data as an `sidx` file
-  std::ofstream ofs(argv[2], std::ios::binary);
-  idx.write(ofs);
- 
+  // Sort the numbers for quantization later, and dump the data as an
+  // `sidx` file
+  if (by_dimension) {
+    // As many dimensions at a time as fit the budget, each lot read in
+    // one pass over the index
+    size_t column = num_vectors * UNIT_BYTES;
+    size_t per_pass = budget ? budget / std::max<size_t>(column, 1) : flat.dim();
+    if (per_pass == 0) {
+      std::cerr << "Error: -d needs a budget of at least " << (column >> 20) + 1
+                << " MB, to hold one dimension\n";
+      return -1;
+    }
+    if (runs) {
+      idx.write_runs_header(ofs, flat.dim());
+    } else {
+      idx.write_header(ofs);
+    }
+    for (size_t d = 0; d < flat.dim(); d += per_pass) {
+      idx.load_by_dimension(source, d, std::min(d + per_pass, flat.dim()));
+      if (runs) {
+        num_runs += idx.write_runs(ofs, num_vectors);
+      } else {
+        idx.write_codes(ofs);
+      }
+    }
+  } else if (budget && bytes > budget) {
+    flat.sequential();
+    external_sorter sorter(budget, std::string(files[1]) + ".runs");
+    if (runs) {
+      idx.write_runs_header(ofs, 1);
+      run_writer writer(ofs);
+      sorter.sort(source, ofs, &writer);
+      num_runs = writer.finish();
+    } else {
+      idx.write_header(ofs);
+      sorter.sort(source, ofs);
+    }
+  } else {
+    flat.sequential();
+    idx.load(source);
+    idx.sort();
+    if (runs) {
+      idx.write_runs_header(ofs, 1);
+      num_runs = idx.write_runs(ofs, source.size());
+    } else {
+      idx.write(ofs);
+    }
+  }
+  if (!ofs.flush()) {
+    std::cerr << "Error: unable to write " << files[1] << "\n";
+    return -1;
+  }
+  if (runs) {
+    std::cerr << "Wrote " << num_runs << " runs of equal floats for "
+              << source.size() << " floats\n";
+  }
 }
@@ -0,0 +1,179 @@
+// The FAISS flat index format, shared by the C++ tools.
+//
+// A flat index is a flat_header, then the number of floats as a size_t,
+// then the floats themselves, vector after vector. Tools map the file
+// with mapped_flat_index and read the floats where they are, making a
+// copy only of what they need to change.
+
+#ifndef FLAT_INDEX_HPP
+#define FLAT_INDEX_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// 37 bytes before the data begins; this is the FAISS
+// header. 
+// https://github.com/facebookresearch/faiss/blob/main/faiss/impl/io.cpp 
+struct flat_header {
+  uint32_t fourcc;  // 'IFxI'
+  int32_t  dim;     // Vector dimensionality
+  int64_t  ntotal;  // Number of vectors stored
+  int64_t  dummy_a; // A dummy value, 1 << 20
+  int64_t  dummy_b; // A dummy value, 1 << 20
+  bool     trained; // Is the model trained? Meaningless here.
+  uint32_t   metric;  // Metric type; actually an enum in FAISS, meaningless here.
+
+  // Loads into self from an istream
+  void load(std::istream& in) {
+    in.read(reinterpret_cast<char *>(&fourcc), sizeof(uint32_t));
+    in.read(reinterpret_cast<char *>(&dim), sizeof(int32_t));
+    in.read(reinterpret_cast<char *>(&ntotal), sizeof(int64_t));
+    in.read(reinterpret_cast<char *>(&dummy_a), sizeof(int64_t));
+    in.read(reinterpret_cast<char *>(&dummy_b), sizeof(int64_t));
+    in.read(reinterpret_cast<char *>(&trained), sizeof(bool));
+    in.read(reinterpret_cast<char *>(&metric), sizeof(uint32_t));
+  }
+
+  // Loads into self from the start of a mapped index
+  void load(const char *p) {
+    std::memcpy(&fourcc, p, sizeof(uint32_t)); p += sizeof(uint32_t);
+    std::memcpy(&dim, p, sizeof(int32_t)); p += sizeof(int32_t);
+    std::memcpy(&ntotal, p, sizeof(int64_t)); p += sizeof(int64_t);
+    std::memcpy(&dummy_a, p, sizeof(int64_t)); p += sizeof(int64_t);
+    std::memcpy(&dummy_b, p, sizeof(int64_t)); p += sizeof(int64_t);
+    std::memcpy(&trained, p, sizeof(bool)); p += sizeof(bool);
+    std::memcpy(&metric, p, sizeof(uint32_t));
+  }
+
+  // Back to disk
+  void write(std::ostream& out) {
+    out.write(reinterpret_cast<const char *>(&fourcc), sizeof(uint32_t));
+    out.write(reinterpret_cast<char *>(&dim), sizeof(int32_t));
+    out.write(reinterpret_cast<char *>(&ntotal), sizeof(int64_t));
+    out.write(reinterpret_cast<char *>(&dummy_a), sizeof(int64_t));
+    out.write(reinterpret_cast<char *>(&dummy_b), sizeof(int64_t));
+    out.write(reinterpret_cast<char *>(&trained), sizeof(bool));
+    out.write(reinterpret_cast<char *>(&metric), sizeof(uint32_t));
+  }
+
+  // Some basic info from the header
+  void info() const {
+    std::cout << "Dim    = " << dim << "\n"
+              << "Ntotal = " << ntotal << "\n";
+  }
+
+};
+
+// Bytes of the header as load() reads it, and where the floats start
+constexpr size_t FLAT_HEADER_BYTES = 37;
+constexpr size_t FLAT_DATA_OFFSET = FLAT_HEADER_BYTES + sizeof(size_t);
+
+// Floats that are read where they are. In a mapped index they start 45
+// bytes in, so they are not aligned, and are only read with memcpy (or
+// unaligned loads, from bytes()).
+class float_span {
+
+  public:
+    float_span(const char *bytes, size_t size) : m_bytes(bytes), m_size(size) {}
+
+    size_t size() const { return m_size; }
+    const char *bytes() const { return m_bytes; }
+
+    float operator[](size_t i) const {
+      float f;
+      std::memcpy(&f, m_bytes + i * sizeof(float), sizeof(float));
+      return f;
+    }
+
+    // Floats first..first+n-1 to out
+    void copy(size_t first, size_t n, float *out) const {
+      std::memcpy(out, m_bytes + first * sizeof(float), n * sizeof(float));
+    }
+
+    // A copy of them all, for when they have to be changed
+    std::vector<float> to_vector() const {
+      std::vector<float> v(m_size);
+      copy(0, m_size, v.data());
+      return v;
+    }
+
+  private:
+    const char *m_bytes;
+    size_t      m_size;
+};
+
+// A FAISS flat index, mapped read-only. The header and the float count
+// are checked against each other and against the size of the file; a
+// file that fails is reported and the program exits. Nothing else is
+// read until it is used, and the page cache holds the only copy.
+class mapped_flat_index {
+
+  public:
+    explicit mapped_flat_index(const std::string &path) {
+      int fd = open(path.c_str(), O_RDONLY);
+      struct stat st;
+      if (fd < 0 || fstat(fd, &st) != 0) {
+        fail(path, "cannot be opened");
+      }
+      m_len = st.st_size;
+      if (m_len < FLAT_DATA_OFFSET) {
+        fail(path, "is not a FAISS flat index");
+      }
+      void *map = mmap(nullptr, m_len, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (map == MAP_FAILED) {
+        fail(path, "cannot be mapped");
+      }
+      m_map = static_cast<const char *>(map);
+
+      size_t count;
+      m_header.load(m_map);
+      std::memcpy(&count, m_map + FLAT_HEADER_BYTES, sizeof(size_t));
+      if (std::memcmp(m_map, "IxF", 3) != 0 || m_header.dim <= 0 ||
+          m_header.ntotal < 0 ||
+          count != size_t(m_header.dim) * size_t(m_header.ntotal)) {
+        fail(path, "is not a FAISS flat index");
+      }
+      if (m_len < FLAT_DATA_OFFSET + count * sizeof(float)) {
+        fail(path, "is cut short");
+      }
+    }
+
+    mapped_flat_index(const mapped_flat_index &) = delete;
+    mapped_flat_index &operator=(const mapped_flat_index &) = delete;
+    ~mapped_flat_index() { munmap(const_cast<char *>(m_map), m_len); }
+
+    const flat_header &header() const { return m_header; }
+    size_t dim() const { return m_header.dim; }
+    size_t size() const { return m_header.ntotal; }
+
+    float_span floats() const {
+      return float_span(m_map + FLAT_DATA_OFFSET, dim() * size());
+    }
+
+    // The floats will be read from start to end, so the kernel can read ahead
+    void sequential() const {
+      madvise(const_cast<char *>(m_map), m_len, MADV_SEQUENTIAL);
+    }
+
+  private:
+    [[noreturn]] static void fail(const std::string &path, const char *why) {
+      std::cerr << "Error: " << path << " " << why << "\n";
+      std::exit(EXIT_FAILURE);
+    }
+
+    const char   *m_map = nullptr;
+    size_t        m_len = 0;
+    flat_header   m_header;
+};
+
+#endif
@@ -1,5 +1,7 @@
 /* Constant and variables common to the encoder and decoder.
- * Handled as globals in this file.
+ * The bin model and the coder state are each held in a struct, so that
+ * there can be more than one of each, and so that all of this can be
+ * built into a library, see lssy.c.
  *
  * Written by Alistair Moffat (The University of Melbourne) as part
  * of the paper "Lossy Compression Options for Dense Index Retention"
@@ -8,12 +10,46 @@
 
 #define HEADER 45       // bytes in index file to put straight through; FAISS has 45 byte headers
 
-size_t num_bins=0;	    // the number of bins in this quantized model
-float *U;               // the bin upper boundaries
-float *S;               // the corresponding representative values
-size_t *c;              // and the corresponding bin frequency counts
+typedef struct bin_model {
+	size_t num_bins;	// the number of bins in this quantized model
+	float *U;		// the bin upper boundaries
+	float *S;		// the corresponding representative values
+	size_t *c;		// and the cumulative bin frequency counts
+	uint64_t total;		// sum of the bin frequency counts
 
-char head[HEADER+1];
+	/* float to bin lookup, see make_bin_lookup() */
+	uint32_t *lut;		// first possible bin for each cell
+	size_t lut_cells;	// number of cells covering U[0..num_bins-1]
+	uint32_t lut_key0;	// the key of U[0]
+	uint32_t lut_shift;	// log2 of the keys per cell
+
+	/* target to symbol lookup, see make_decode_lookup() */
+	uint32_t *sym_lut;	// symbol of the first target in each bucket
+	uint64_t sym_buckets;	// number of buckets covering 0..total-1
+	uint32_t sym_shift;	// log2 of the targets per bucket
+
+	/* order-1 contexts, if the bins file has them, see context.c */
+	uint16_t *bucket;	// context bucket of each bin, when previous
+	struct bin_model *ctx;	// counts for each context, U and S shared
+} bin_model;
+
+/* the bins files from quantize -d and -k have a table for each column
+   of the vectors, although columns can share them; a plain bins file is
+   a single table for every column. Either way, coding starts at column
+   zero, at the start of a vector */
+
+#define BINS_SET_MAGIC 0x4c53534d	// first size_t of a set, "MSSL"
+
+typedef struct {
+	size_t num_models;	// the number of tables
+	bin_model *models;	// the tables themselves
+	size_t dim;		// columns covered, or 0 for one table for all
+	uint32_t *col_model;	// which table each column uses, if dim>0
+	size_t num_buckets;	// order-1 context buckets, 0 for none
+} model_set;
+
+#define CONTEXT_MAGIC 0x4c534358	// after the tables, "XCSL"
+#define MAX_BUCKETS 256
 
 
 /* constants that control the arithmetic coder */
@@ -28,34 +64,190 @@ char head[HEADER+1];
 #define ZERO (0)
 #define MINR ((1LL<<(BBITS-15)))
 
-/* and then state variables for encoding */
+/* and then state variables for encoding, bundled together so that
+   independently coded blocks can each have their own coder; output bytes
+   go into a buffer, which is either written to fp each time it fills or,
+   if fp is NULL, grown as required */
+
+#define IO_BUF_SIZE (1<<20)
+
+typedef struct {
+	uint64_t L;
+	uint64_t R;
+	uint8_t last_non_ff_byte;
+	uint32_t num_ff_bytes;
+	int first;
+	size_t bytes_out;
+	FILE *fp;
+	uint8_t *buf;
+	size_t buf_len, buf_size;
+} arith_encoder;
+
+/* plus the state required for decoding, with input bytes coming from
+   the buffer in[0..in_end-1], usually a mapped file */
+
+typedef struct {
+	uint64_t R;
+	uint64_t D;
+	const uint8_t *in, *in_end;
+} arith_decoder;
 
-uint64_t L=ZERO;
-uint64_t R=FULL;
-uint64_t low, high, total, scale;
-uint8_t last_non_ff_byte=0, byte;
-uint32_t num_ff_bytes=0;
-int first=1;
+void read_error() {
+    fprintf(stderr, "Did not read the expected number of bytes. Exiting, sorry!\n");
+    exit(EXIT_FAILURE);
+}
 
-size_t bytes_out=HEADER;
+/* pick up the vector dimension and the number of floats from a
+   FAISS flat index header
+*/
+size_t
+header_dim(const char *h) {
+	int32_t dim;
+	memcpy(&dim, h+4, sizeof(dim));
+	return dim;
+}
 
-/* plus one additional state variable for decoding */
+size_t
+header_count(const char *h) {
+	size_t count;
+	memcpy(&count, h+HEADER-sizeof(count), sizeof(count));
+	return count;
+}
 
-uint64_t D;
+/* wall clock time, for throughput reporting */
+double
+seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
 
+/* find the bin number of float f, that is, the first bin whose upper
+   boundary is not less than f, or the last bin if there is none
+*/
+size_t
+float_to_bin_bsearch(const bin_model *m, float f) {
+	const float *U = m->U;
+	size_t lo, hi, md;
+
+	/* writing binary search, now that's brave */
+	lo = 0; hi = m->num_bins-1;
+	while (lo < hi) {
+		md = lo + (hi-lo)/2;
+		if (f <= U[md]) {
+			hi = md;
+		} else {
+			lo = md+1;
+		}
+	}
 
-void read_error() {
-    fprintf(stderr, "Did not read the expected number of bytes. Exiting, sorry!\n");
-    exit(EXIT_FAILURE);
+	assert(lo==0 || U[lo-1]<f);
+	assert(f <= U[lo] || lo==m->num_bins-1);
+	return lo;
 }
 
-/* most of the setup and initializations are common to both
-   encoder and decoder
+/* the same thing, but via a table. Floats are mapped to integer keys
+   that sort the same way they do, and the keys from U[0] to U[num_bins-1]
+   are cut into cells of 2^lut_shift keys each. Cell t records in lut[t]
+   the first bin that any float in it can be in, and lut[t+1] is then the
+   last, so most of the time there is nothing left to do at all
 */
+
+#define LUT_CELLS_PER_BIN 8
+#define LUT_MIN_CELLS (1<<12)
+#define LUT_SET_MIN_CELLS (1<<8)	// tables of a set are used together
+#define LUT_MAX_CELLS (1<<20)
+
+static inline uint32_t
+float_key(float f) {
+	uint32_t k;
+	f += 0.0f;		/* so that -0.0 gets the same key as 0.0 */
+	memcpy(&k, &f, sizeof(k));
+	return k ^ ((k>>31) ? 0xffffffff : 0x80000000);
+}
+
 void
-make_arrays_and_read_bin_data(FILE *fb) {
+make_bin_lookup(bin_model *m, size_t min_cells) {
+	size_t want = LUT_CELLS_PER_BIN*m->num_bins, j, t;
+	uint32_t range;
+	uint64_t start;
+
+	if (want < min_cells) want = min_cells;
+	if (want > LUT_MAX_CELLS) want = LUT_MAX_CELLS;
+	m->lut_key0 = float_key(m->U[0]);
+	range = float_key(m->U[m->num_bins-1]) - m->lut_key0;
+	for (m->lut_shift=0; (range>>m->lut_shift) >= want; m->lut_shift++) {
+	}
+	m->lut_cells = (range>>m->lut_shift) + 1;
+
+	m->lut = malloc((m->lut_cells+1)*sizeof(*m->lut));
+	assert(m->lut);
+	for (j=0, t=0; t<=m->lut_cells; t++) {
+		start = m->lut_key0 + ((uint64_t)t<<m->lut_shift);
+		while (j<m->num_bins-1 && float_key(m->U[j]) < start) {
+			j++;
+		}
+		m->lut[t] = j;
+	}
+}
 
-	int i;
+static inline size_t
+float_to_bin(const bin_model *m, float f) {
+	uint32_t k = float_key(f);
+	size_t lo, hi;
+
+	if (k <= m->lut_key0) {
+		return 0;
+	}
+	k = (k-m->lut_key0) >> m->lut_shift;
+	if (k >= m->lut_cells) {
+		return m->num_bins-1;
+	}
+	/* and then step through any boundaries inside the cell */
+	lo = m->lut[k];
+	hi = m->lut[k+1];
+	while (lo<hi && f>m->U[lo]) {
+		lo++;
+	}
+	return lo;
+}
+
+/* and the decoder's side of things, going from a target cumulative
+   frequency to the symbol whose range holds it. Targets 0..total-1 are
+   cut into buckets of 2^sym_shift, and sym_lut[t] is the symbol of the
+   first target in bucket t, so the symbol for any target in the bucket
+   is somewhere in sym_lut[t]..sym_lut[t+1], and nearly always that is
+   just the one symbol
+*/
+void
+make_decode_lookup(bin_model *m, size_t min_cells) {
+	size_t want = LUT_CELLS_PER_BIN*m->num_bins, v, t;
+
+	if (want < min_cells) want = min_cells;
+	if (want > LUT_MAX_CELLS) want = LUT_MAX_CELLS;
+	for (m->sym_shift=0; ((m->total-1)>>m->sym_shift) >= want;
+			m->sym_shift++) {
+	}
+	m->sym_buckets = ((m->total-1)>>m->sym_shift) + 1;
+
+	m->sym_lut = malloc((m->sym_buckets+1)*sizeof(*m->sym_lut));
+	assert(m->sym_lut);
+	for (v=0, t=0; t<=m->sym_buckets; t++) {
+		while (v<m->num_bins-1 &&
+				m->c[v] <= (uint64_t)t<<m->sym_shift) {
+			v++;
+		}
+		m->sym_lut[t] = v;
+	}
+}
+
+/* read one table of bins and counts from fb, as written by quantize.c;
+   returns zero, with nothing left allocated, if it is not there
+*/
+static int
+read_bin_model(bin_model *m, FILE *fb, size_t min_cells) {
+
+	size_t i, ncols;
 
 	/* file fb is bin descriptions, has format:
 		ncols:		size_t [should be 2]
@@ -64,174 +256,565 @@ make_arrays_and_read_bin_data(FILE *fb) {
 		bin_frqs	size_t [x numbins]
 	*/
 
-	if (fread(&num_bins, sizeof(size_t), 1, fb) != 1) {
-    read_error();
-  }
-	assert(num_bins==2);
-	if (fread(&num_bins, sizeof(size_t), 1, fb) != 1) {
-    read_error();
-  }
-	U = malloc(num_bins*sizeof(*U));
-	S = malloc(num_bins*sizeof(*S));
-	c = malloc(num_bins*sizeof(*c));
-	assert(U && S && c);
-
-	for (i=0; i<num_bins; i++) {
-    if (fread(U+i, sizeof(float), 1, fb) != 1) {
-      read_error();
-    }
-		if (fread(S+i, sizeof(float), 1, fb) != 1) {
-      read_error();
-    }
-	}
-	for (i=0; i<num_bins; i++) {
-		if (fread(c+i, sizeof(size_t), 1, fb) != 1) {
-      read_error();
-    }
+	memset(m, 0, sizeof(*m));
+	if (fread(&ncols, sizeof(size_t), 1, fb) != 1 || ncols != 2 ||
+			fread(&m->num_bins, sizeof(size_t), 1, fb) != 1 ||
+			m->num_bins == 0) {
+		return 0;
+	}
+	m->U = malloc(m->num_bins*sizeof(*m->U));
+	m->S = malloc(m->num_bins*sizeof(*m->S));
+	m->c = malloc(m->num_bins*sizeof(*m->c));
+	assert(m->U && m->S && m->c);
+
+	for (i=0; i<m->num_bins; i++) {
+		if (fread(m->U+i, sizeof(float), 1, fb) != 1 ||
+				fread(m->S+i, sizeof(float), 1, fb) != 1) {
+			break;
+		}
+	}
+	if (i<m->num_bins || fread(m->c, sizeof(size_t), m->num_bins, fb)
+			!= m->num_bins) {
+		free(m->U);
+		free(m->S);
+		free(m->c);
+		return 0;
 	}
-	fclose(fb);
 
 	/* last setup step is to convert to cumfreqs, and assign total */
-	for (i=1; i<num_bins; i++) {
-		c[i] += c[i-1];
+	for (i=1; i<m->num_bins; i++) {
+		m->c[i] += m->c[i-1];
+	}
+	m->total = m->c[m->num_bins-1];
+	if (m->total == 0) {
+		free(m->U);
+		free(m->S);
+		free(m->c);
+		return 0;
 	}
-	total = c[num_bins-1];
+
+	make_bin_lookup(m, min_cells);
+	make_decode_lookup(m, min_cells);
+	return 1;
 }
 
-/* encode symbol 0<=s<n relative to comfreqs[0..n-1], send any output
-   bytes that get generated to fp
-*/
 void
-arith_encode(size_t s, size_t c[], size_t n, FILE *fp) {
+free_bin_model(bin_model *m) {
+	free(m->U);
+	free(m->S);
+	free(m->c);
+	free(m->lut);
+	free(m->sym_lut);
+}
 
-	// printf("coding %lu, ", s);
+/* the context bucket of each bin of m, for when it is the previous
+   symbol: the bins are cut into nb runs of roughly equal probability,
+   by where the middle of each bin's share of the total falls */
+static void
+make_buckets(bin_model *m, size_t nb) {
+	uint64_t prev=0, b;
+	size_t i;
+
+	m->bucket = malloc(m->num_bins*sizeof(*m->bucket));
+	assert(m->bucket);
+	for (i=0; i<m->num_bins; i++) {
+		b = (prev + m->c[i]) * nb / (2*m->total);
+		m->bucket[i] = b<nb ? b : nb-1;
+		prev = m->c[i];
+	}
+}
 
-	assert(R>total);
+/* the context rows of each table share U and S with it */
+static void
+free_contexts(model_set *ms) {
+	bin_model *m;
+	size_t k, b;
+
+	for (k=0; k<ms->num_models; k++) {
+		m = ms->models+k;
+		for (b=0; m->ctx && b<=ms->num_buckets; b++) {
+			free(m->ctx[b].c);
+			free(m->ctx[b].sym_lut);
+		}
+		free(m->ctx);
+		free(m->bucket);
+	}
+}
 
-	/* allocated probability range for this symbol */
-	if (s==0) {
-		low = 0;
-	} else {
-		low = c[s-1];
+void
+free_model_set(model_set *ms) {
+	size_t k;
+	free_contexts(ms);
+	for (k=0; k<ms->num_models; k++) {
+		free_bin_model(ms->models+k);
 	}
-	high = c[s];
-	// printf("low = %llu, high = %llu, ", low, high);
-	
-	/* the actual arithmetic coding step */
-	scale = R/total;
-	L += low*scale;
-	if (high<total) {
-		/* top symbol gets benefit of rounding gaps */
-		R = (high-low)*scale;
+	free(ms->models);
+	free(ms->col_model);
+}
+
+/* the order-1 context counts that can follow the tables, as written by
+   contexts.c, with format:
+
+	magic:		size_t [CONTEXT_MAGIC]
+	num_buckets:	size_t
+	counts:		uint16_t [x (num_buckets+1) x num_bins] for each
+			table in turn; row b is for floats whose previous
+			float is in bucket b, and the last row for column zero
+
+   returns zero if they are there but cannot be read; having none is fine
+*/
+static int
+read_contexts(model_set *ms, FILE *fb) {
+	size_t magic, k, b, i;
+	uint16_t *cnt=NULL;
+	bin_model *m, *row;
+	int ok=1;
+
+	if (fread(&magic, sizeof(magic), 1, fb) != 1) {
+		return feof(fb);
+	}
+	if (magic != CONTEXT_MAGIC ||
+			fread(&ms->num_buckets, sizeof(ms->num_buckets), 1, fb)
+			!= 1 || ms->num_buckets == 0 ||
+			ms->num_buckets > MAX_BUCKETS) {
+		ms->num_buckets = 0;
+		return 0;
+	}
+	for (k=0; ok && k<ms->num_models; k++) {
+		m = ms->models+k;
+		make_buckets(m, ms->num_buckets);
+		m->ctx = calloc(ms->num_buckets+1, sizeof(*m->ctx));
+		cnt = realloc(cnt, m->num_bins*sizeof(*cnt));
+		assert(m->ctx && cnt);
+		for (b=0; ok && b<=ms->num_buckets; b++) {
+			row = m->ctx+b;
+			if (fread(cnt, sizeof(*cnt), m->num_bins, fb)
+					!= m->num_bins) {
+				ok = 0;
+				break;
+			}
+			row->num_bins = m->num_bins;
+			row->U = m->U;
+			row->S = m->S;
+			row->c = malloc(m->num_bins*sizeof(*row->c));
+			assert(row->c);
+			for (row->total=0, i=0; i<m->num_bins; i++) {
+				row->total += cnt[i];
+				row->c[i] = row->total;
+			}
+			if (row->total == 0) {
+				ok = 0;
+				break;
+			}
+			make_decode_lookup(row, LUT_SET_MIN_CELLS);
+		}
+	}
+	free(cnt);
+	return ok;
+}
+
+/* most of the setup and initializations are common to both encoder and
+   decoder. fb is either a plain bins file, one table for every column,
+   or a set of them from quantize -d or -k, with format:
+
+	magic:		size_t [BINS_SET_MAGIC]
+	dim:		size_t, columns of the vectors
+	num_models:	size_t
+	col_model:	uint32_t [x dim], the table each column uses
+	tables:		num_models tables, each as in a plain bins file
+
+   and either can be followed by order-1 contexts, see read_contexts().
+   Returns zero, with nothing left allocated, if fb does not hold a valid
+   bins file; fb is closed either way
+*/
+int
+read_model_set(model_set *ms, FILE *fb) {
+	size_t magic, k;
+	int ok=1;
+
+	memset(ms, 0, sizeof(*ms));
+	if (fread(&magic, sizeof(magic), 1, fb) != 1) {
+		fclose(fb);
+		return 0;
+	}
+	if (magic != BINS_SET_MAGIC) {
+		/* just the one table, read from the start */
+		ms->num_models = 1;
+		ms->models = malloc(sizeof(*ms->models));
+		assert(ms->models);
+		if (fseeko(fb, 0, SEEK_SET) != 0 ||
+				!read_bin_model(ms->models, fb,
+				LUT_MIN_CELLS)) {
+			free(ms->models);
+			fclose(fb);
+			return 0;
+		}
+	} else if (fread(&ms->dim, sizeof(ms->dim), 1, fb) != 1 ||
+			ms->dim == 0 ||
+			fread(&ms->num_models, sizeof(ms->num_models), 1, fb)
+			!= 1 || ms->num_models == 0 ||
+			ms->num_models > ms->dim) {
+		fclose(fb);
+		return 0;
 	} else {
-		R = R - low*scale;
+		ms->col_model = malloc(ms->dim*sizeof(*ms->col_model));
+		ms->models = calloc(ms->num_models, sizeof(*ms->models));
+		assert(ms->col_model && ms->models);
+		if (fread(ms->col_model, sizeof(*ms->col_model), ms->dim, fb)
+				!= ms->dim) {
+			ok = 0;
+		}
+		for (k=0; ok && k<ms->dim; k++) {
+			ok = ms->col_model[k] < ms->num_models;
+		}
+		for (k=0; ok && k<ms->num_models; k++) {
+			ok = read_bin_model(ms->models+k, fb,
+				LUT_SET_MIN_CELLS);
+			if (!ok) {
+				/* only the tables before it need freeing */
+				ms->num_models = k;
+			}
+		}
+	}
+	ok = ok && read_contexts(ms, fb);
+	fclose(fb);
+	if (!ok) {
+		free_model_set(ms);
+		memset(ms, 0, sizeof(*ms));
+		return 0;
 	}
+	return 1;
+}
 
-	/* now sort out the carry/renormalization process */
-	if (L>FULL) {
+/* the table for floats in column col, counting from zero */
+static inline const bin_model *
+column_model(const model_set *ms, size_t col) {
+	return ms->dim ? ms->models + ms->col_model[col] : ms->models;
+}
+
+/* and the column after col; for a single table, columns do not matter */
+static inline size_t
+next_column(const model_set *ms, size_t col) {
+	return col+1 == ms->dim ? 0 : col+1;
+}
+
+/* sum of the counts of all of the tables, which is the number of floats
+   they were built from */
+uint64_t
+model_set_total(const model_set *ms) {
+	uint64_t total=0;
+	size_t k;
+	for (k=0; k<ms->num_models; k++) {
+		total += ms->models[k].total;
+	}
+	return total;
+}
+
+/* set up a fresh encoder, writing to fp if it is non-NULL, otherwise
+   to a buffer that grows as required
+*/
+void
+encoder_start(arith_encoder *ae, FILE *fp) {
+	ae->L = ZERO;
+	ae->R = FULL;
+	ae->last_non_ff_byte = 0;
+	ae->num_ff_bytes = 0;
+	ae->first = 1;
+	ae->bytes_out = 0;
+	ae->fp = fp;
+	ae->buf = NULL;
+	ae->buf_len = ae->buf_size = 0;
+	if (fp) {
+		ae->buf_size = IO_BUF_SIZE;
+		ae->buf = malloc(ae->buf_size);
+		assert(ae->buf);
+	}
+}
+
+/* write out whatever is buffered for fp */
+static void
+flush_bytes(arith_encoder *ae) {
+	if (fwrite(ae->buf, 1, ae->buf_len, ae->fp) != ae->buf_len) {
+		perror("fwrite");
+		exit(EXIT_FAILURE);
+	}
+	ae->buf_len = 0;
+}
+
+static inline void
+put_byte(arith_encoder *ae, uint8_t b) {
+	if (ae->buf_len == ae->buf_size) {
+		if (ae->fp) {
+			flush_bytes(ae);
+		} else {
+			ae->buf_size = ae->buf_size ? 2*ae->buf_size : 1024;
+			ae->buf = realloc(ae->buf, ae->buf_size);
+			assert(ae->buf);
+		}
+	}
+	ae->buf[ae->buf_len++] = b;
+	ae->bytes_out++;
+}
+
+static inline void
+propagate_carry(arith_encoder *ae) {
+	if (ae->L>FULL) {
 		/* lower bound has overflowed, need first to push
 		   a carry through the ff bytes and into the pending
 		   non-ff byte */
-		last_non_ff_byte += 1;
-		L &= FULL;
-		while (num_ff_bytes>0) {
-			fputc(last_non_ff_byte, fp);
-			num_ff_bytes--;
-			last_non_ff_byte = ZERO;
-			bytes_out++;
+		ae->last_non_ff_byte += 1;
+		ae->L &= FULL;
+		while (ae->num_ff_bytes>0) {
+			put_byte(ae, ae->last_non_ff_byte);
+			ae->num_ff_bytes--;
+			ae->last_non_ff_byte = ZERO;
+		}
+	}
+}
+
+/* self-information of the bin model, in bits per symbol, which is what
+   the coders are aiming for
+*/
+double
+entropy_bits(const bin_model *m) {
+	double ent=0.0;
+	uint64_t prev=0;
+	size_t i;
+	for (i=0; i<m->num_bins; i++) {
+		if (m->c[i]>prev) {
+			ent += (m->c[i]-prev) *
+				log2((double)m->total/(m->c[i]-prev));
 		}
+		prev = m->c[i];
+	}
+	return ent/m->total;
+}
+
+/* and of a set of them, averaged over the columns */
+double
+model_set_entropy(const model_set *ms) {
+	double ent=0.0;
+	size_t j;
+	if (ms->dim == 0) {
+		return entropy_bits(ms->models);
+	}
+	for (j=0; j<ms->dim; j++) {
+		ent += entropy_bits(column_model(ms, j));
+	}
+	return ent/ms->dim;
+}
+
+/* encode the symbol that has range [low, high) of total, send any output
+   bytes that get generated to the encoder's output
+*/
+static inline void
+arith_encode_range(arith_encoder *ae, uint64_t low, uint64_t high,
+		uint64_t total) {
+
+	uint64_t scale;
+	uint8_t byte;
+
+	assert(ae->R>total);
+	assert(low<high && high<=total);
+
+	/* the actual arithmetic coding step */
+	scale = ae->R/total;
+	ae->L += low*scale;
+	if (high<total) {
+		/* top symbol gets benefit of rounding gaps */
+		ae->R = (high-low)*scale;
+	} else {
+		ae->R = ae->R - low*scale;
 	}
 
+	/* now sort out the carry/renormalization process */
+	propagate_carry(ae);
+
 	/* more normal type of renorm step */
-	while (R < PART)  {
+	while (ae->R < PART)  {
 		/* can output (or rather, save for later output)
 		   a byte from the front of L */
-		byte = (L>>(BBITS-8));
+		byte = (ae->L>>(BBITS-8));
 		if (byte!=FULLBYTE) {
 			/* not ff, so can bring everything up to date */
-			if (!first) {
-				fputc(last_non_ff_byte, fp);
-				bytes_out++;
+			if (!ae->first) {
+				put_byte(ae, ae->last_non_ff_byte);
 			}
-			while (num_ff_bytes) {
-				fputc(FULLBYTE, fp);
-				num_ff_bytes--;
-				bytes_out++;
+			while (ae->num_ff_bytes) {
+				put_byte(ae, FULLBYTE);
+				ae->num_ff_bytes--;
 			}
-			last_non_ff_byte = byte;
-			first = 0;
+			ae->last_non_ff_byte = byte;
+			ae->first = 0;
 		} else {
 			/* ff bytes just get counted */
-			num_ff_bytes++;
+			ae->num_ff_bytes++;
 		}
-		L <<= 8;
-		L &= FULL;
-		R <<= 8;
+		ae->L <<= 8;
+		ae->L &= FULL;
+		ae->R <<= 8;
 	}
 }
 
+/* encode symbol 0<=s<num_bins relative to the model's comfreqs */
+void
+arith_encode(arith_encoder *ae, const bin_model *m, size_t s) {
+	// printf("coding %lu, ", s);
+
+	/* allocated probability range for this symbol */
+	arith_encode_range(ae, s==0 ? 0 : m->c[s-1], m->c[s], m->total);
+}
+
 /* finish off the output stream, then switch off the engine
 */
 void
-encoder_close(FILE *fp) {
+encoder_close(arith_encoder *ae) {
 	int i;
-        if (!first) {
-                fputc(last_non_ff_byte, fp);
-		bytes_out++;
+        if (!ae->first) {
+                put_byte(ae, ae->last_non_ff_byte);
         }
-        while (num_ff_bytes) {
-                fputc(FULLBYTE, fp);
-		bytes_out++;
-                num_ff_bytes--;
+        while (ae->num_ff_bytes) {
+                put_byte(ae, FULLBYTE);
+                ae->num_ff_bytes--;
         }
 
         /* then send the final bytes from L, to be sure to be sure */
         for (i=BBYTES-1; i>=0; i--) {
-                fputc((L>>((8*i)))&FULLBYTE, fp);
-		bytes_out++;
+                put_byte(ae, (ae->L>>((8*i)))&FULLBYTE);
         }
+
+	if (ae->fp) {
+		flush_bytes(ae);
+		free(ae->buf);
+		ae->buf = NULL;
+	}
+}
+
+/* finish off a buffered stream, for which the decoder supplies zero bytes
+   once the real ones run out. Then only enough of L needs to go out to
+   pin down some value in [L, L+R), and, since R>=PART, rounding L up to
+   a multiple of PART always does that. Rounding up to a multiple of
+   FULL+1 might too, in which case nothing of L needs to be sent at all.
+   Zero bytes left at the end are then redundant as well
+*/
+void
+encoder_close_buffer(arith_encoder *ae) {
+	uint64_t V;
+	int last_byte=1;
+
+	assert(ae->fp==NULL);
+	V = ae->L==ZERO ? ZERO : FULL+1;
+	if (V - ae->L >= ae->R) {
+		V = (ae->L + PART-1) & ~(PART-1);
+		assert(V - ae->L < ae->R);
+	} else {
+		last_byte = 0;
+	}
+	ae->L = V;
+	propagate_carry(ae);
+
+	if (!ae->first) {
+		put_byte(ae, ae->last_non_ff_byte);
+	}
+	while (ae->num_ff_bytes) {
+		put_byte(ae, FULLBYTE);
+		ae->num_ff_bytes--;
+	}
+	if (last_byte) {
+		put_byte(ae, ae->L>>(BBITS-8));
+	}
+
+	while (ae->buf_len>0 && ae->buf[ae->buf_len-1]==0) {
+		ae->buf_len--;
+		ae->bytes_out--;
+	}
+}
+
+static inline uint8_t
+get_byte(arith_decoder *ad) {
+	/* past the end of the buffer, pretend there are zeros */
+	return ad->in<ad->in_end ? *ad->in++ : 0;
 }
 
 /* when starting decoding, first thing required is to wind the handle
-   and start the pump
+   and start the pump; bytes come from the buffer in[0..len-1]
 */
 void
-decoder_start(FILE *fp) {
+decoder_start(arith_decoder *ad, const uint8_t *in, size_t len) {
 	int i;
-	D = 0;
+	ad->R = FULL;
+	ad->D = 0;
+	ad->in = in;
+	ad->in_end = in+len;
         for (i=0; i<BBYTES; i++) {
-                D <<= 8;
-                D += fgetc(fp);
+                ad->D <<= 8;
+                ad->D += get_byte(ad);
         }
 }
 
-/* decode symbol 0<=s<n relative to comfreqs[0..n-1], return the integer
-   symbol number. All bytes are read from fp.
+/* the first half of decoding a symbol: the target frequency in
+   [0, total) that the next symbol's range holds, and the scale that
+   arith_decode_range() then needs
 */
-size_t
-arith_decode(size_t c[], size_t n, FILE *fp) {
-
+static inline uint64_t
+arith_decode_target(const arith_decoder *ad, uint64_t total,
+		uint64_t *scale) {
 	uint64_t target;
-	uint64_t low, high, scale;
-	size_t v=0;
 
-	scale = R/total;
-	assert(scale>0);
-	target = D/scale;
+	*scale = ad->R/total;
+	assert(*scale>0);
+	target = ad->D / *scale;
 
 	/* handle the rounding that might accrue at the top of the
 	   range, and adjust downward if required */
 	if (target>=total) target = total-1;
+	return target;
+}
 
-	// printf("target = %llu, ", target);
+/* and the second, once the symbol with range [low, high) holding the
+   target has been found; all bytes are read from the decoder's input */
+static inline void
+arith_decode_range(arith_decoder *ad, uint64_t low, uint64_t high,
+		uint64_t total, uint64_t scale) {
 
-#if 0
-	/* could use linear search in c[] */
-	for (v=0; v<n && target>=c[v]; v++) {
+	/* adjust, tracing the encoder, with D=V-L throughout */
+	ad->D -= low*scale;
+	if (high<total) {
+		ad->R = (high-low)*scale;
+	} else {
+		ad->R = ad->R - low*scale;
 	}
-#else
-	/* or can use binary search and maybe go a little faster */
-	int lo=0, hi=n-1;
+	assert(ad->D<=ad->R);
+
+	while (ad->R < PART) {
+		/* range has shrunk, time to bring in another byte */
+		ad->R <<= 8;
+		ad->D <<= 8;
+		ad->D &= FULL;
+		ad->D += get_byte(ad);
+	}
+	assert(ad->D<=ad->R);
+}
+
+/* decode symbol 0<=s<num_bins relative to the model's comfreqs, return
+   the integer symbol number
+*/
+size_t
+arith_decode(arith_decoder *ad, const bin_model *m) {
+
+	const size_t *c = m->c;
+	uint64_t target, scale;
+	size_t v=0;
+
+	target = arith_decode_target(ad, m->total, &scale);
+
+	// printf("target = %llu, ", target);
+
+	/* could use linear search in c[], or binary search, but the bucket
+	   that target is in narrows it down to (usually) a single symbol,
+	   and binary search then has little or nothing to do */
+	size_t lo = m->sym_lut[target>>m->sym_shift];
+	size_t hi = m->sym_lut[(target>>m->sym_shift) + 1];
 	/* elements c[lo..hi] inclusive being considered */
 	while (lo<hi) {
 		v = lo + (hi-lo)/2;
@@ -242,37 +825,13 @@ arith_decode(size_t c[], size_t n, FILE *fp) {
 		}
 	}
 	v = lo;
-#endif
 
 	assert(v==0 || c[v-1]<=target);
-	assert(v<n);
+	assert(v<m->num_bins);
 	assert(target<c[v]);
 
 	// printf("decoded %lu\n", v);
 
-	/* adjust, tracing the encoder, with D=V-L throughout */
-	if (v==0) {
-		low = 0;
-	} else {
-		low = c[v-1];
-	}
-	high = c[v];
-	D -= low*scale;
-	if (high<total) {
-		R = (high-low)*scale;
-	} else {
-		R = R - low*scale;
-	}
-	assert(D<=R);
-
-	while (R < PART) {
-		/* range has shrunk, time to bring in another byte */
-		R <<= 8;
-		D <<= 8;
-		D &= FULL;
-		D += fgetc(fp);
-	}
-	assert(D<=R);
-
+	arith_decode_range(ad, v==0 ? 0 : c[v-1], c[v], m->total, scale);
 	return v;
 }
@@ -0,0 +1,554 @@
+/* A KLL quantile sketch (Karnin, Lang and Liberty, "Optimal Quantile
+   Approximation in Streams", FOCS 2016), so that quantize -s can find
+   bin boundaries in one pass over an index, in space that depends on the
+   accuracy wanted and hardly at all on the number of floats.
+
+   The sketch keeps items in levels, an item at level h standing for 2^h
+   of the floats seen. Floats go into level 0, and whenever the levels
+   hold more items than their capacities add up to, the lowest level at
+   or over its capacity is compacted: sorted, and every second item,
+   starting at random with the first or the second, merged into the
+   level above, the others dropped. Only level 0 ever needs sorting, as
+   the levels above it are kept in order. An odd item out stays where
+   it is, so the weights always add up to exactly the number of floats
+   seen. The top level has capacity k, and each level below it two
+   thirds of the one above, down to KLL_MIN_CAP, so that the sketch
+   holds about 3k items.
+
+   The estimated rank of any value is then within eps*n of its true
+   rank, where eps is about 2.296/k^0.9723, with probability 99%; that is
+   the fit the Apache DataSketches library gives for this same scheme,
+   see kll_error() and kll_k_for_error(). Compaction is random, but the
+   generator is seeded, so that a given input always gives the same
+   sketch.
+
+   Sketches of the same k merge by adding each level of one to the same
+   level of the other and compacting, with the same error bound, so that
+   a sketch can be kept per column and then merged into one per group.
+
+   As well, the tail smallest and tail largest floats are kept exactly,
+   for bins at the extremes that only hold a few floats each; and the
+   sum and sum of squares of the floats, for their spread.
+*/
+
+#define KLL_MAX_LEVELS 64	// enough for 2^64 floats
+#define KLL_MIN_CAP 8		// smallest capacity of any level
+#define KLL_SHRINK (2.0/3.0)	// capacity of a level relative to the next
+
+typedef struct {
+	size_t k;		// capacity of the top level
+	size_t num_levels;	// levels in use
+	float *items[KLL_MAX_LEVELS];
+	size_t size[KLL_MAX_LEVELS];	// items held at each level
+	size_t room[KLL_MAX_LEVELS];	// and space for them
+	size_t held;		// items held at all levels
+	size_t capacity;	// the sum of the level capacities
+	uint64_t n;		// floats seen
+	uint64_t rng;		// xorshift state, for the compactions
+
+	size_t tail;		// floats kept exactly at each end
+	float *lo;		// the smallest, a max-heap of up to tail
+	float *hi;		// the largest, a min-heap of up to tail
+	size_t nlo, nhi;
+	double sum, sumsq;	// of all the floats seen
+} kll_sketch;
+
+/* what is needed to answer queries, built from a sketch once all floats
+   have been added: the items in order, each with the number of floats
+   that it and all the items before it stand for, and the sums of those
+   floats; and the tails in order, with their sums. A view can also be
+   made from runs of equal floats, as quantize reads them from run-length
+   sidx files, and then the items are the floats themselves, and the
+   answers exact
+*/
+typedef struct {
+	int exact;		// items are runs of floats, not a sketch
+	uint64_t n;		// floats seen
+	size_t m;		// items
+	float *v;		// their values, ascending
+	uint64_t *w;		// floats up to and including each item
+	double *s;		// and their sum
+	size_t nlo, nhi;	// tail floats at each end
+	float *lo, *hi;		// ascending
+	double *slo;		// slo[r], sum of the r smallest floats
+	double *shi;		// shi[r], sum of the r largest floats
+	double sum;		// of all the floats
+} kll_view;
+
+/* the rank error, as a fraction of n, that k gives with probability 99% */
+double
+kll_error(size_t k) {
+	return 2.296/pow(k, 0.9723);
+}
+
+/* and the k that gives a rank error of at most eps */
+size_t
+kll_k_for_error(double eps) {
+	double k=ceil(pow(2.296/eps, 1/0.9723));
+	return k < KLL_MIN_CAP ? KLL_MIN_CAP : (size_t)k;
+}
+
+/* capacity of level h, given how many levels there are */
+size_t
+kll_level_capacity(const kll_sketch *s, size_t h) {
+	double cap=ceil(s->k*pow(KLL_SHRINK, s->num_levels-1-h));
+	return cap < KLL_MIN_CAP ? KLL_MIN_CAP : (size_t)cap;
+}
+
+void
+kll_add_level(kll_sketch *s) {
+	size_t h;
+
+	assert(s->num_levels < KLL_MAX_LEVELS);
+	s->num_levels++;
+	for (s->capacity=0, h=0; h<s->num_levels; h++) {
+		s->capacity += kll_level_capacity(s, h);
+	}
+}
+
+void
+kll_init(kll_sketch *s, size_t k, size_t tail, uint64_t seed) {
+	memset(s, 0, sizeof(*s));
+	s->k = k;
+	s->rng = seed ? seed : 1;
+	s->tail = tail;
+	s->lo = malloc((tail ? tail : 1)*sizeof(*s->lo));
+	s->hi = malloc((tail ? tail : 1)*sizeof(*s->hi));
+	assert(s->lo && s->hi);
+	kll_add_level(s);
+}
+
+void
+kll_free(kll_sketch *s) {
+	size_t h;
+
+	for (h=0; h<s->num_levels; h++) {
+		free(s->items[h]);
+	}
+	free(s->lo);
+	free(s->hi);
+}
+
+/* make space for need more items at level h */
+static inline void
+kll_reserve(kll_sketch *s, size_t h, size_t need) {
+	if (s->size[h]+need <= s->room[h]) {
+		return;
+	}
+	s->room[h] = 2*(s->size[h]+need);
+	if (s->room[h] < KLL_MIN_CAP) {
+		s->room[h] = KLL_MIN_CAP;
+	}
+	s->items[h] = realloc(s->items[h], s->room[h]*sizeof(*s->items[h]));
+	assert(s->items[h]);
+}
+
+/* sort a[0..n-1], for level 0; qsort() and its calls back for every
+   comparison would take most of the time spent adding floats
+*/
+void
+kll_sort(float *a, size_t n) {
+	size_t i, j;
+	float p, t;
+
+	while (n > 16) {
+		/* median of three as the pivot, then partition */
+		if (a[n/2] < a[0]) { t=a[0]; a[0]=a[n/2]; a[n/2]=t; }
+		if (a[n-1] < a[0]) { t=a[0]; a[0]=a[n-1]; a[n-1]=t; }
+		if (a[n-1] < a[n/2]) { t=a[n/2]; a[n/2]=a[n-1]; a[n-1]=t; }
+		p = a[n/2];
+		for (i=0, j=n-1; ; i++, j--) {
+			while (a[i] < p) i++;
+			while (p < a[j]) j--;
+			if (i >= j) break;
+			t=a[i]; a[i]=a[j]; a[j]=t;
+		}
+		/* recurse on the smaller part, loop on the larger */
+		if (j+1 < n-j-1) {
+			kll_sort(a, j+1);
+			a += j+1;
+			n -= j+1;
+		} else {
+			kll_sort(a+j+1, n-j-1);
+			n = j+1;
+		}
+	}
+	for (i=1; i<n; i++) {
+		for (t=a[i], j=i; j>0 && t<a[j-1]; j--) {
+			a[j] = a[j-1];
+		}
+		a[j] = t;
+	}
+}
+
+/* merge the sorted items of level h+1 with the sorted add[0..n-1] */
+void
+kll_merge_up(kll_sketch *s, size_t h, const float *add, size_t n) {
+	float *old=s->items[h+1], *out;
+	size_t i=0, j=0, o=0, m=s->size[h+1];
+
+	s->room[h+1] = 2*(m+n);
+	out = malloc(s->room[h+1]*sizeof(*out));
+	assert(out);
+	while (i<m && j<n) {
+		out[o++] = add[j]<old[i] ? add[j++] : old[i++];
+	}
+	while (i<m) out[o++] = old[i++];
+	while (j<n) out[o++] = add[j++];
+	free(old);
+	s->items[h+1] = out;
+	s->size[h+1] = o;
+}
+
+/* compact the lowest level that is at or over its capacity, adding a
+   level on top first if that is the top one
+*/
+void
+kll_compress(kll_sketch *s) {
+	size_t h, i, j, m, first;
+	float *it;
+
+	for (h=0; h+1<s->num_levels; h++) {
+		if (s->size[h] >= kll_level_capacity(s, h)) {
+			break;
+		}
+	}
+	if (h+1 == s->num_levels) {
+		kll_add_level(s);
+	}
+	it = s->items[h];
+	m = s->size[h];
+	if (h == 0) {
+		kll_sort(it, m);
+	}
+
+	/* the odd one out, the smallest, stays; of the rest, every second
+	   one is gathered at the front, and then moves up */
+	first = m%2;
+	s->rng ^= s->rng << 13;
+	s->rng ^= s->rng >> 7;
+	s->rng ^= s->rng << 17;
+	for (j=0, i=first + (s->rng&1); i<m; i+=2) {
+		it[first+j++] = it[i];
+	}
+	kll_merge_up(s, h, it+first, j);
+	s->size[h] = first;
+	s->held -= j;
+}
+
+/* keep f if it is among the tail smallest or largest seen so far */
+static inline void
+kll_heap_add(float *heap, size_t *nh, size_t tail, float f, int max) {
+	size_t i, c;
+
+	if (*nh < tail) {
+		/* sift up */
+		for (i=(*nh)++; i>0 && (max ? heap[(i-1)/2] < f :
+				heap[(i-1)/2] > f); i=(i-1)/2) {
+			heap[i] = heap[(i-1)/2];
+		}
+		heap[i] = f;
+		return;
+	}
+	if (tail==0 || (max ? f >= heap[0] : f <= heap[0])) {
+		return;
+	}
+	/* replace the root, and sift down */
+	for (i=0; (c=2*i+1) < tail; i=c) {
+		if (c+1 < tail && (max ? heap[c+1] > heap[c] :
+				heap[c+1] < heap[c])) {
+			c++;
+		}
+		if (max ? heap[c] <= f : heap[c] >= f) {
+			break;
+		}
+		heap[i] = heap[c];
+	}
+	heap[i] = f;
+}
+
+static inline void
+kll_add(kll_sketch *s, float f) {
+	if (s->held >= s->capacity) {
+		kll_compress(s);
+	}
+	kll_reserve(s, 0, 1);
+	s->items[0][s->size[0]++] = f;
+	s->held++;
+	s->n++;
+	s->sum += f;
+	s->sumsq += (double)f*f;
+	kll_heap_add(s->lo, &s->nlo, s->tail, f, 1);
+	kll_heap_add(s->hi, &s->nhi, s->tail, f, 0);
+}
+
+/* add everything b has seen to a; both must have the same k and tail */
+void
+kll_merge(kll_sketch *a, const kll_sketch *b) {
+	size_t h, i;
+
+	assert(a->k==b->k && a->tail==b->tail);
+	while (a->num_levels < b->num_levels) {
+		kll_add_level(a);
+	}
+	/* level 0 is in no order, and the others are kept sorted */
+	kll_reserve(a, 0, b->size[0]);
+	memcpy(a->items[0]+a->size[0], b->items[0],
+		b->size[0]*sizeof(*b->items[0]));
+	a->size[0] += b->size[0];
+	for (h=1; h<b->num_levels; h++) {
+		kll_merge_up(a, h-1, b->items[h], b->size[h]);
+	}
+	a->held += b->held;
+	a->n += b->n;
+	a->sum += b->sum;
+	a->sumsq += b->sumsq;
+	for (i=0; i<b->nlo; i++) {
+		kll_heap_add(a->lo, &a->nlo, a->tail, b->lo[i], 1);
+	}
+	for (i=0; i<b->nhi; i++) {
+		kll_heap_add(a->hi, &a->nhi, a->tail, b->hi[i], 0);
+	}
+	while (a->held >= a->capacity) {
+		kll_compress(a);
+	}
+}
+
+/* an item and its level, for building a view */
+typedef struct {
+	float v;
+	uint32_t h;
+} kll_item;
+
+int
+kll_item_cmp(const void *x1, const void *x2) {
+	const kll_item *i1=x1, *i2=x2;
+	if (i1->v<i2->v) return -1;
+	if (i1->v>i2->v) return +1;
+	return 0;
+}
+
+void
+kll_make_view(const kll_sketch *s, kll_view *V) {
+	kll_item *all;
+	size_t h, i, j;
+	uint64_t w=0;
+	double sum=0.0;
+
+	assert(s->n > 0);
+	all = malloc(s->held*sizeof(*all));
+	V->v = malloc(s->held*sizeof(*V->v));
+	V->w = malloc(s->held*sizeof(*V->w));
+	V->s = malloc(s->held*sizeof(*V->s));
+	assert(all && V->v && V->w && V->s);
+	for (j=0, h=0; h<s->num_levels; h++) {
+		for (i=0; i<s->size[h]; i++, j++) {
+			all[j].v = s->items[h][i];
+			all[j].h = h;
+		}
+	}
+	assert(j == s->held);
+	qsort(all, s->held, sizeof(*all), kll_item_cmp);
+	for (i=0; i<s->held; i++) {
+		w += (uint64_t)1 << all[i].h;
+		sum += ldexp(all[i].v, all[i].h);
+		V->v[i] = all[i].v;
+		V->w[i] = w;
+		V->s[i] = sum;
+	}
+	assert(w == s->n);
+	free(all);
+	V->exact = 0;
+	V->n = s->n;
+	V->m = s->held;
+	V->sum = s->sum;
+
+	/* and the tails, in order, with their running sums */
+	V->nlo = s->nlo;
+	V->nhi = s->nhi;
+	V->lo = malloc((s->nlo+1)*sizeof(*V->lo));
+	V->hi = malloc((s->nhi+1)*sizeof(*V->hi));
+	V->slo = malloc((s->nlo+1)*sizeof(*V->slo));
+	V->shi = malloc((s->nhi+1)*sizeof(*V->shi));
+	assert(V->lo && V->hi && V->slo && V->shi);
+	memcpy(V->lo, s->lo, s->nlo*sizeof(*V->lo));
+	memcpy(V->hi, s->hi, s->nhi*sizeof(*V->hi));
+	kll_sort(V->lo, s->nlo);
+	kll_sort(V->hi, s->nhi);
+	V->slo[0] = V->shi[0] = 0.0;
+	for (i=0; i<s->nlo; i++) {
+		V->slo[i+1] = V->slo[i] + V->lo[i];
+	}
+	for (i=0; i<s->nhi; i++) {
+		V->shi[i+1] = V->shi[i] + V->hi[s->nhi-1-i];
+	}
+}
+
+/* a run of equal floats, count of them */
+typedef struct {
+	float v;
+	uint32_t count;
+} float_run;
+
+/* the exact view of m runs, in ascending order of float */
+void
+kll_make_run_view(const float_run *runs, size_t m, kll_view *V) {
+	uint64_t w=0;
+	double sum=0.0;
+	size_t i;
+
+	V->v = malloc((m ? m : 1)*sizeof(*V->v));
+	V->w = malloc((m ? m : 1)*sizeof(*V->w));
+	V->s = malloc((m ? m : 1)*sizeof(*V->s));
+	V->lo = malloc(sizeof(*V->lo));
+	V->hi = malloc(sizeof(*V->hi));
+	V->slo = malloc(sizeof(*V->slo));
+	V->shi = malloc(sizeof(*V->shi));
+	assert(V->v && V->w && V->s && V->lo && V->hi && V->slo && V->shi);
+	for (i=0; i<m; i++) {
+		assert(i==0 || runs[i-1].v <= runs[i].v);
+		w += runs[i].count;
+		sum += (double)runs[i].count*runs[i].v;
+		V->v[i] = runs[i].v;
+		V->w[i] = w;
+		V->s[i] = sum;
+	}
+	V->exact = 1;
+	V->n = w;
+	V->m = m;
+	V->sum = sum;
+	V->nlo = V->nhi = 0;
+	V->slo[0] = V->shi[0] = 0.0;
+}
+
+void
+kll_free_view(kll_view *V) {
+	free(V->v);
+	free(V->w);
+	free(V->s);
+	free(V->lo);
+	free(V->hi);
+	free(V->slo);
+	free(V->shi);
+}
+
+/* how many of the sorted floats f[0..n-1] are less than x */
+size_t
+kll_count_below(const float *f, size_t n, double x) {
+	size_t lo=0, hi=n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi-lo)/2;
+		if (f[mid] < x) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* the number of floats less than x: exact if x is within the tails,
+   and otherwise from the items, interpolating between the two either
+   side of x unless the items are exact
+*/
+uint64_t
+kll_rank(const kll_view *V, double x) {
+	size_t i;
+	uint64_t r;
+
+	if (V->nlo == V->n || (V->nlo && x <= V->lo[V->nlo-1])) {
+		return kll_count_below(V->lo, V->nlo, x);
+	}
+	if (V->nhi && x > V->hi[0]) {
+		return V->n - V->nhi + kll_count_below(V->hi, V->nhi, x);
+	}
+	i = kll_count_below(V->v, V->m, x);
+	if (V->exact) {
+		return i ? V->w[i-1] : 0;
+	}
+	if (i == 0) {
+		r = 0;
+	} else if (i == V->m) {
+		r = V->n;
+	} else {
+		r = V->w[i-1] + (uint64_t)((V->w[i]-V->w[i-1]) *
+			(x - V->v[i-1]) / (V->v[i] - V->v[i-1]));
+	}
+	if (r < V->nlo) r = V->nlo;
+	if (r > V->n - V->nhi) r = V->n - V->nhi;
+	return r;
+}
+
+/* the float of rank r, counting from zero, for r less than n: the item
+   that takes the count past r; exact within the tails, or if the items
+   are, and otherwise interpolated between that item and the one before
+   it, so that neighbouring ranks within one heavy item still get
+   different values
+*/
+float
+kll_quantile(const kll_view *V, uint64_t r) {
+	size_t lo=0, hi=V->m, mid;
+
+	assert(r < V->n);
+	if (r < V->nlo) {
+		return V->lo[r];
+	}
+	if (r >= V->n - V->nhi) {
+		return V->hi[r - (V->n - V->nhi)];
+	}
+	while (lo < hi) {
+		mid = lo + (hi-lo)/2;
+		if (V->w[mid] <= r) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (V->exact) {
+		return V->v[lo];
+	}
+	if (lo == 0) {
+		return V->v[0];
+	}
+	if (lo == V->m) {
+		return V->v[V->m-1];
+	}
+	return V->v[lo-1] + (V->v[lo] - V->v[lo-1]) *
+		(double)(r+1 - V->w[lo-1]) / (V->w[lo] - V->w[lo-1]);
+}
+
+/* the sum of the items' floats of rank less than r */
+double
+kll_item_sum(const kll_view *V, uint64_t r) {
+	size_t lo=0, hi=V->m, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi-lo)/2;
+		if (V->w[mid] <= r) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == V->m) {
+		return V->s[V->m-1];
+	}
+	/* all of the items before lo, and part of lo itself */
+	return (lo ? V->s[lo-1] : 0.0) +
+		(double)(r - (lo ? V->w[lo-1] : 0))*V->v[lo];
+}
+
+/* the sum of the r smallest floats: exact if they end within the tails,
+   and otherwise from the items
+*/
+double
+kll_prefix_sum(const kll_view *V, uint64_t r) {
+	if (r <= V->nlo) {
+		return V->slo[r];
+	}
+	if (V->n - r <= V->nhi) {
+		return V->sum - V->shi[V->n - r];
+	}
+	return V->slo[V->nlo] + kll_item_sum(V, r) - kll_item_sum(V, V->nlo);
+}
@@ -0,0 +1,555 @@
+/* liblssy, see lssy.h. The coders are the same .c files that the
+   programs used to #include, built here as a single translation unit,
+   and only the lssy_ functions are exported from the shared library.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "lssy.h"
+
+#include "helpers.c"
+#include "binmap.c"
+#include "eliasfano.c"
+#include "rans.c"
+#include "ransx16.c"
+#include "adaptive.c"
+#include "order1.c"
+#include "blocks.c"
+#include "packed.c"
+
+#define DEFAULT_VECS_PER_BLOCK 1024	// if a block-only coder is chosen
+#define CHUNK_FLOATS 4096		// mapped to bins at a time otherwise
+
+struct lssy_model {
+	model_set ms;
+};
+
+struct lssy_encoder {
+	const model_set *ms;
+	size_t col;		// of the next float
+	arith_encoder ae;
+	int finished;
+};
+
+struct lssy_decoder {
+	const model_set *ms;
+	size_t col;
+	arith_decoder ad;
+};
+
+struct lssy_index {
+	int packed;		// which of these it is
+	block_file bf;
+	packed_file pf;
+};
+
+const char *
+lssy_strerror(int err) {
+	switch (err) {
+	case LSSY_OK:
+		return "success";
+	case LSSY_ERR_OPEN:
+		return "unable to open file";
+	case LSSY_ERR_FORMAT:
+		return "file is not in the expected format";
+	case LSSY_ERR_CODER:
+		return "coder cannot be used with this model";
+	case LSSY_ERR_IO:
+		return "unable to read, write or map file";
+	case LSSY_ERR_DIM:
+		return "model is for vectors of a different dimension";
+	case LSSY_ERR_SAMPLE:
+		return "bins were counted on a sample; recount them with "
+			"quantize -c or use a block coder";
+	}
+	return "unknown error";
+}
+
+const char *
+lssy_coder_name(int coder) {
+	return coder>=0 && coder<NUM_CODERS ? coder_names[coder] : NULL;
+}
+
+int
+lssy_coder_by_name(const char *name) {
+	return coder_by_name(name);
+}
+
+/* models */
+
+lssy_model *
+lssy_model_load(const char *bins_file) {
+	lssy_model *lm;
+	FILE *fb;
+
+	if ((fb=fopen(bins_file, "r")) == NULL) {
+		return NULL;
+	}
+	lm = malloc(sizeof(*lm));
+	assert(lm);
+	if (!read_model_set(&lm->ms, fb)) {
+		free(lm);
+		return NULL;
+	}
+	return lm;
+}
+
+void
+lssy_model_free(lssy_model *lm) {
+	if (lm) {
+		free_model_set(&lm->ms);
+		free(lm);
+	}
+}
+
+size_t
+lssy_model_dim(const lssy_model *lm) {
+	return lm->ms.dim;
+}
+
+size_t
+lssy_model_contexts(const lssy_model *lm) {
+	return lm->ms.num_buckets;
+}
+
+size_t
+lssy_model_tables(const lssy_model *lm) {
+	return lm->ms.num_models;
+}
+
+size_t
+lssy_model_bins(const lssy_model *lm, size_t col) {
+	assert(col < lm->ms.dim || lm->ms.dim == 0);
+	return column_model(&lm->ms, col)->num_bins;
+}
+
+uint64_t
+lssy_model_total(const lssy_model *lm) {
+	return model_set_total(&lm->ms);
+}
+
+float
+lssy_model_value(const lssy_model *lm, size_t col, uint32_t bin) {
+	assert(col < lm->ms.dim || lm->ms.dim == 0);
+	assert(bin < column_model(&lm->ms, col)->num_bins);
+	return column_model(&lm->ms, col)->S[bin];
+}
+
+double
+lssy_model_entropy(const lssy_model *lm) {
+	return model_set_entropy(&lm->ms);
+}
+
+uint32_t
+lssy_float_to_bin(const lssy_model *lm, size_t col, float f) {
+	assert(col < lm->ms.dim || lm->ms.dim == 0);
+	return float_to_bin(column_model(&lm->ms, col), f);
+}
+
+void
+lssy_floats_to_bins(const lssy_model *lm, size_t col, const float *F,
+		size_t n, uint32_t *bins) {
+	assert(col < lm->ms.dim || lm->ms.dim == 0);
+	set_floats_to_bins(&lm->ms, col, F, n, bins);
+}
+
+/* streams */
+
+lssy_encoder *
+lssy_encoder_new(const lssy_model *lm) {
+	lssy_encoder *e = malloc(sizeof(*e));
+	assert(e);
+	e->ms = &lm->ms;
+	e->col = 0;
+	e->finished = 0;
+	encoder_start(&e->ae, NULL);
+	return e;
+}
+
+void
+lssy_encode_bin(lssy_encoder *e, uint32_t bin) {
+	const bin_model *m = column_model(e->ms, e->col);
+	assert(!e->finished && bin < m->num_bins);
+	arith_encode(&e->ae, m, bin);
+	e->col = next_column(e->ms, e->col);
+}
+
+void
+lssy_encode_floats(lssy_encoder *e, const float *F, size_t n) {
+	uint32_t syms[CHUNK_FLOATS];
+	size_t i, j, k;
+
+	assert(!e->finished);
+	for (i=0; i<n; i+=k) {
+		k = n-i < CHUNK_FLOATS ? n-i : CHUNK_FLOATS;
+		set_floats_to_bins(e->ms, e->col, F+i, k, syms);
+		for (j=0; j<k; j++) {
+			arith_encode(&e->ae, column_model(e->ms, e->col),
+				syms[j]);
+			e->col = next_column(e->ms, e->col);
+		}
+	}
+}
+
+const uint8_t *
+lssy_encoder_finish(lssy_encoder *e, size_t *len) {
+	if (!e->finished) {
+		encoder_close_buffer(&e->ae);
+		e->finished = 1;
+	}
+	*len = e->ae.buf_len;
+	return e->ae.buf;
+}
+
+void
+lssy_encoder_free(lssy_encoder *e) {
+	if (e) {
+		free(e->ae.buf);
+		free(e);
+	}
+}
+
+lssy_decoder *
+lssy_decoder_new(const lssy_model *lm, const uint8_t *in, size_t len) {
+	lssy_decoder *d = malloc(sizeof(*d));
+	assert(d);
+	d->ms = &lm->ms;
+	d->col = 0;
+	decoder_start(&d->ad, in, len);
+	return d;
+}
+
+uint32_t
+lssy_decode_bin(lssy_decoder *d) {
+	uint32_t bin = arith_decode(&d->ad, column_model(d->ms, d->col));
+	d->col = next_column(d->ms, d->col);
+	return bin;
+}
+
+void
+lssy_decode_floats(lssy_decoder *d, float *F, size_t n) {
+	const bin_model *m;
+	size_t i;
+	for (i=0; i<n; i++) {
+		m = column_model(d->ms, d->col);
+		F[i] = m->S[arith_decode(&d->ad, m)];
+		d->col = next_column(d->ms, d->col);
+	}
+}
+
+void
+lssy_decoder_free(lssy_decoder *d) {
+	free(d);
+}
+
+/* whole files */
+
+void
+lssy_encode_defaults(lssy_encode_options *opt) {
+	opt->coder = LSSY_ARITH;
+	opt->scale_bits = RANS_DEFAULT_SCALE;
+	opt->vecs_per_block = 0;
+	opt->threads = 0;
+}
+
+/* the single stream, from a mapped index; the floats are not aligned
+   after the header, so they are copied out a chunk at a time */
+static int
+encode_stream(const model_set *ms, FILE *fi, FILE *fo, lssy_stats *st) {
+	arith_encoder ae;
+	size_t map_len, i, j, n, cnt, col=0;
+	uint8_t *map = map_input(fi, &map_len);
+	float *F = malloc(CHUNK_FLOATS*sizeof(*F));
+	uint32_t *syms = malloc(CHUNK_FLOATS*sizeof(*syms));
+
+	assert(F && syms);
+	if (map == NULL) {
+		free(F);
+		free(syms);
+		return LSSY_ERR_IO;
+	}
+	cnt = (map_len-HEADER)/sizeof(float);
+	encoder_start(&ae, fo);
+	for (i=0; i<cnt; i+=n) {
+		n = cnt-i < CHUNK_FLOATS ? cnt-i : CHUNK_FLOATS;
+		memcpy(F, map+HEADER+i*sizeof(float), n*sizeof(float));
+		set_floats_to_bins(ms, col, F, n, syms);
+		for (j=0; j<n; j++) {
+			arith_encode(&ae, column_model(ms, col), syms[j]);
+			col = next_column(ms, col);
+		}
+	}
+	encoder_close(&ae);
+
+	st->floats = cnt;
+	st->bytes += ae.bytes_out;
+	munmap(map, map_len);
+	free(F);
+	free(syms);
+	return LSSY_OK;
+}
+
+int
+lssy_encode_file(const lssy_model *lm, const char *index_file,
+		const char *out_file, const lssy_encode_options *opt,
+		lssy_stats *st) {
+	const model_set *ms = &lm->ms;
+	char head[HEADER];
+	FILE *fi, *fo;
+	size_t dim, cnt, bytes;
+	int err=LSSY_OK;
+
+	memset(st, 0, sizeof(*st));
+	st->coder = opt->coder;
+	st->threads = opt->threads>0 ? opt->threads : default_threads();
+	st->vecs_per_block = opt->vecs_per_block;
+	if (opt->coder<0 || opt->coder>=NUM_CODERS ||
+			((opt->coder==LSSY_RANS || opt->coder==LSSY_RANSX16) &&
+			!rans_scale_ok(ms, opt->scale_bits)) ||
+			(opt->coder==LSSY_CONTEXT && !ms->num_buckets) ||
+			(opt->coder==LSSY_PACKED && !packed_model_ok(ms))) {
+		return LSSY_ERR_CODER;
+	}
+	if (opt->coder==LSSY_PACKED) {
+		/* vectors are found without blocks */
+		st->vecs_per_block = 0;
+	} else if (opt->coder!=LSSY_ARITH && !st->vecs_per_block) {
+		/* only the arithmetic coder can do a single stream */
+		st->vecs_per_block = DEFAULT_VECS_PER_BLOCK;
+	}
+
+	if ((fi=fopen(index_file, "r")) == NULL) {
+		return LSSY_ERR_OPEN;
+	}
+	if (fread(head, sizeof(*head), HEADER, fi) != HEADER) {
+		fclose(fi);
+		return LSSY_ERR_FORMAT;
+	}
+	/* older decoders take a stream's count from the models, so a
+	   stream is only coded with bins counted over this index; refused
+	   before the output is touched */
+	if (opt->coder!=LSSY_PACKED && !st->vecs_per_block &&
+			model_set_total(ms) != header_count(head)) {
+		fclose(fi);
+		return LSSY_ERR_SAMPLE;
+	}
+	/* readable as well, so that it can be mapped */
+	if ((fo=fopen(out_file, "w+")) == NULL) {
+		fclose(fi);
+		return LSSY_ERR_OPEN;
+	}
+	st->seconds = seconds();
+	if (ms->dim && header_dim(head) != ms->dim) {
+		err = LSSY_ERR_DIM;
+	} else if (fwrite(head, sizeof(*head), HEADER, fo) != HEADER) {
+		err = LSSY_ERR_IO;
+	} else if (opt->coder==LSSY_PACKED) {
+		dim = header_dim(head);
+		cnt = header_count(head);
+		if (dim==0 || cnt%dim!=0 || !(bytes=encode_packed(ms, fi, fo,
+				dim, cnt/dim, st->threads))) {
+			/* most likely, the index is short */
+			err = LSSY_ERR_FORMAT;
+		} else {
+			st->floats = cnt;
+			st->bytes = bytes;
+		}
+	} else if (st->vecs_per_block) {
+		dim = header_dim(head);
+		cnt = header_count(head);
+		if (dim==0 || cnt%dim!=0) {
+			err = LSSY_ERR_FORMAT;
+		} else if (!(bytes=encode_blocks(ms, fi, fo, dim, cnt/dim,
+				st->vecs_per_block, opt->coder,
+				block_coder_param(ms, opt->coder,
+				opt->scale_bits), st->threads))) {
+			/* the coder was checked, so the index is short */
+			err = LSSY_ERR_FORMAT;
+		} else {
+			st->floats = cnt;
+			st->bytes = bytes;
+			st->blocks = (cnt/dim + st->vecs_per_block - 1) /
+				st->vecs_per_block;
+		}
+	} else {
+		err = encode_stream(ms, fi, fo, st);
+	}
+	fclose(fi);
+	if (fclose(fo) != 0 && err==LSSY_OK) {
+		err = LSSY_ERR_IO;
+	}
+	st->bytes += HEADER;
+	st->seconds = seconds() - st->seconds;
+	return err;
+}
+
+/* the single stream, into a mapped output file; it has no count of its
+   own, so the count in the index header, passed through as head, is
+   used: bins trained on a sample do not hold the count of the index */
+static int
+decode_stream(const model_set *ms, const char *head, FILE *fi, FILE *fo,
+		lssy_stats *st) {
+	const bin_model *m;
+	arith_decoder ad;
+	off_t in_pos = ftello(fi);
+	uint64_t total = header_count(head);
+	size_t in_len=0, out_len = HEADER + total*sizeof(float), cnt, col=0;
+	uint8_t *in = map_input(fi, &in_len);
+	uint8_t *out = map_output(fo, out_len);
+
+	if (in == NULL || out == NULL) {
+		if (in) munmap(in, in_len);
+		if (out) munmap(out, out_len);
+		return LSSY_ERR_IO;
+	}
+	decoder_start(&ad, in+in_pos, in_len-in_pos);
+	for (cnt=0; cnt<total; cnt++) {
+		m = column_model(ms, col);
+		memcpy(out+HEADER+cnt*sizeof(float),
+			m->S + arith_decode(&ad, m), sizeof(float));
+		col = next_column(ms, col);
+	}
+	munmap(in, in_len);
+	munmap(out, out_len);
+	st->floats = cnt;
+	return LSSY_OK;
+}
+
+int
+lssy_decode_file(const lssy_model *lm, const char *in_file,
+		const char *index_file, int threads, lssy_stats *st) {
+	const model_set *ms = &lm->ms;
+	char head[HEADER];
+	block_header bh;
+	packed_file pf;
+	FILE *fi, *fo;
+	int err=LSSY_OK, found;
+
+	memset(st, 0, sizeof(*st));
+	st->threads = threads>0 ? threads : default_threads();
+	if ((fi=fopen(in_file, "r")) == NULL) {
+		return LSSY_ERR_OPEN;
+	}
+	/* readable as well, so that it can be mapped */
+	if ((fo=fopen(index_file, "w+")) == NULL) {
+		fclose(fi);
+		return LSSY_ERR_OPEN;
+	}
+	st->seconds = seconds();
+	if (fread(head, sizeof(*head), HEADER, fi) != HEADER) {
+		err = LSSY_ERR_FORMAT;
+	} else if (ms->dim && header_dim(head) != ms->dim) {
+		err = LSSY_ERR_DIM;
+	} else if (fwrite(head, sizeof(*head), HEADER, fo) != HEADER) {
+		err = LSSY_ERR_IO;
+	} else if ((found=read_block_header(&bh, ms, head, fi)) == 1) {
+		st->coder = bh.coder;
+		st->blocks = bh.num_blocks;
+		st->vecs_per_block = bh.vecs_per_block;
+		st->floats = decode_blocks(fi, fo, &bh, st->threads);
+		if (st->floats==0 && bh.num_vecs*bh.dim>0) {
+			err = LSSY_ERR_IO;
+		}
+		block_header_free(&bh);
+	} else if (found == 0 &&
+			(found=read_packed_header(&pf, ms, fi)) == 1) {
+		st->coder = LSSY_PACKED;
+		st->floats = decode_packed(fi, fo, &pf, st->threads);
+		if (st->floats==0 && pf.num_vecs>0) {
+			err = LSSY_ERR_IO;
+		}
+		packed_free(&pf);
+	} else if (found == 0) {
+		st->coder = LSSY_ARITH;
+		err = decode_stream(ms, head, fi, fo, st);
+	} else {
+		err = LSSY_ERR_FORMAT;
+	}
+	fseeko(fi, 0, SEEK_END);
+	st->bytes = ftello(fi);
+	fclose(fi);
+	if (fclose(fo) != 0 && err==LSSY_OK) {
+		err = LSSY_ERR_IO;
+	}
+	st->seconds = seconds() - st->seconds;
+	return err;
+}
+
+/* indexes */
+
+lssy_index *
+lssy_index_open(const lssy_model *lm, const char *in_file) {
+	lssy_index *ix = malloc(sizeof(*ix));
+	assert(ix);
+	ix->packed = 0;
+	if (!block_file_open(&ix->bf, &lm->ms, in_file)) {
+		ix->packed = 1;
+		if (!packed_file_open(&ix->pf, &lm->ms, in_file)) {
+			free(ix);
+			return NULL;
+		}
+	}
+	return ix;
+}
+
+void
+lssy_index_close(lssy_index *ix) {
+	if (ix) {
+		if (ix->packed) {
+			packed_free(&ix->pf);
+		} else {
+			block_file_close(&ix->bf);
+		}
+		free(ix);
+	}
+}
+
+size_t
+lssy_index_dim(const lssy_index *ix) {
+	return ix->packed ? ix->pf.dim : ix->bf.bh.dim;
+}
+
+size_t
+lssy_index_vectors(const lssy_index *ix) {
+	return ix->packed ? ix->pf.num_vecs : ix->bf.bh.num_vecs;
+}
+
+/* packed vectors can each be had on their own */
+size_t
+lssy_index_vecs_per_block(const lssy_index *ix) {
+	return ix->packed ? 1 : ix->bf.bh.vecs_per_block;
+}
+
+/* what it takes in memory, as it is mapped */
+size_t
+lssy_index_bytes(const lssy_index *ix) {
+	return ix->packed ? ix->pf.map_len : ix->bf.map_len;
+}
+
+void
+lssy_index_fetch_range(const lssy_index *ix, size_t first, size_t n,
+		float *out) {
+	if (ix->packed) {
+		assert(first+n <= ix->pf.num_vecs);
+		unpack_vectors(&ix->pf, ix->pf.codes, first, n, out);
+	} else {
+		fetch_range(&ix->bf, first, n, out);
+	}
+}
+
+void
+lssy_index_fetch(const lssy_index *ix, const size_t *ids, size_t n,
+		float *out) {
+	if (ix->packed) {
+		fetch_packed(&ix->pf, ids, n, out);
+	} else {
+		fetch_vectors(&ix->bf, ids, n, out);
+	}
+}
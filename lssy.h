@@ -0,0 +1,154 @@
+/* liblssy, the quantizing coders of this repository as a library.
+
+   A model is a bins file from quantize, read once and then shared,
+   read-only, by any number of encoders, decoders, indexes and threads.
+   It has either one table of bins for every column of the vectors, or,
+   from quantize -d or -k, a table for each column (or group of columns),
+   and then it can only be used for vectors of that many columns. Bin
+   numbers are always relative to the table of their column.
+
+   Encoders and decoders code a stream of bin numbers (or floats, which
+   are mapped to their bins, and come back as the bins' representative
+   values) in memory, with the arithmetic coder; each belongs to one
+   thread at a time. Streams start at column zero, and go through the
+   columns in order, vector after vector. The stream is the same as one
+   block of an index coded with encoder -c arith.
+
+   Whole index files can be coded and decoded as the encoder and decoder
+   programs do, and the vectors of a block-coded or packed index can be
+   fetched one at a time; fetching is safe from many threads at once.
+
+   Functions returning pointers return NULL on failure; those returning
+   int return LSSY_OK, or one of the (negative) errors below.
+
+   Link with -llssy -lm -lpthread. See lssy.hpp for C++.
+*/
+
+#ifndef LSSY_H
+#define LSSY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define LSSY_API __attribute__((visibility("default")))
+#else
+#define LSSY_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LSSY_HEADER 45		/* FAISS header bytes, passed straight through */
+
+#define LSSY_OK 0
+#define LSSY_ERR_OPEN (-1)	/* a file could not be opened */
+#define LSSY_ERR_FORMAT (-2)	/* or is not what it should be */
+#define LSSY_ERR_CODER (-3)	/* the coder cannot be used with the model */
+#define LSSY_ERR_IO (-4)	/* reading, writing or mapping failed */
+#define LSSY_ERR_DIM (-5)	/* the model is for vectors of another size */
+#define LSSY_ERR_SAMPLE (-6)	/* the model's counts are not the index's */
+
+/* coders, as in encoder -c */
+#define LSSY_ARITH 0
+#define LSSY_RANS 1
+#define LSSY_RANSX16 2
+#define LSSY_ADAPTIVE 3		/* arith, adaptive where that is smaller */
+#define LSSY_CONTEXT 4		/* arith, order-1 contexts from the model */
+#define LSSY_PACKED 5		/* fixed-width codes, no blocks needed */
+
+typedef struct lssy_model lssy_model;
+typedef struct lssy_encoder lssy_encoder;
+typedef struct lssy_decoder lssy_decoder;
+typedef struct lssy_index lssy_index;
+
+LSSY_API const char *lssy_strerror(int err);
+LSSY_API const char *lssy_coder_name(int coder);
+LSSY_API int lssy_coder_by_name(const char *name);	/* or -1 */
+
+/* models; col is a column number, less than lssy_model_dim(), unless
+   that is zero and there is just the one table */
+LSSY_API lssy_model *lssy_model_load(const char *bins_file);
+LSSY_API void lssy_model_free(lssy_model *m);
+LSSY_API size_t lssy_model_dim(const lssy_model *m);	/* 0: any */
+LSSY_API size_t lssy_model_tables(const lssy_model *m);
+/* order-1 context buckets, 0 if the bins file has none, see contexts */
+LSSY_API size_t lssy_model_contexts(const lssy_model *m);
+LSSY_API size_t lssy_model_bins(const lssy_model *m, size_t col);
+LSSY_API uint64_t lssy_model_total(const lssy_model *m);
+LSSY_API float lssy_model_value(const lssy_model *m, size_t col,
+	uint32_t bin);
+/* bits per float, averaged over the columns */
+LSSY_API double lssy_model_entropy(const lssy_model *m);
+LSSY_API uint32_t lssy_float_to_bin(const lssy_model *m, size_t col,
+	float f);
+/* F[0] is in column col, and F[1] in the next one, and so on */
+LSSY_API void lssy_floats_to_bins(const lssy_model *m, size_t col,
+	const float *F, size_t n, uint32_t *bins);
+
+/* streams */
+LSSY_API lssy_encoder *lssy_encoder_new(const lssy_model *m);
+LSSY_API void lssy_encode_bin(lssy_encoder *e, uint32_t bin);
+LSSY_API void lssy_encode_floats(lssy_encoder *e, const float *F, size_t n);
+/* ends the stream; the bytes belong to e, and no more can be added */
+LSSY_API const uint8_t *lssy_encoder_finish(lssy_encoder *e, size_t *len);
+LSSY_API void lssy_encoder_free(lssy_encoder *e);
+
+/* in[0..len-1] must stay put until the decoder is freed */
+LSSY_API lssy_decoder *lssy_decoder_new(const lssy_model *m,
+	const uint8_t *in, size_t len);
+LSSY_API uint32_t lssy_decode_bin(lssy_decoder *d);
+LSSY_API void lssy_decode_floats(lssy_decoder *d, float *F, size_t n);
+LSSY_API void lssy_decoder_free(lssy_decoder *d);
+
+/* whole FAISS flat index files */
+typedef struct {
+	int coder;		/* LSSY_ARITH, LSSY_RANS, ... */
+	int scale_bits;		/* rANS: log2 of the frequency total */
+	size_t vecs_per_block;	/* 0: one arithmetic-coded stream,
+				   LSSY_ERR_SAMPLE unless the bins
+				   were counted over this index;
+				   not used by LSSY_PACKED */
+	int threads;		/* 0: one per core */
+} lssy_encode_options;
+
+typedef struct {
+	uint64_t floats;	/* coded or decoded */
+	uint64_t bytes;		/* of compressed file, FAISS header included */
+	uint64_t blocks;	/* 0 for a single stream */
+	uint64_t vecs_per_block;
+	int coder;
+	int threads;
+	double seconds;
+} lssy_stats;
+
+LSSY_API void lssy_encode_defaults(lssy_encode_options *opt);
+LSSY_API int lssy_encode_file(const lssy_model *m, const char *index_file,
+	const char *out_file, const lssy_encode_options *opt,
+	lssy_stats *stats);
+LSSY_API int lssy_decode_file(const lssy_model *m, const char *in_file,
+	const char *index_file, int threads, lssy_stats *stats);
+
+/* vectors of a block-coded index */
+LSSY_API lssy_index *lssy_index_open(const lssy_model *m,
+	const char *in_file);
+LSSY_API void lssy_index_close(lssy_index *ix);
+LSSY_API size_t lssy_index_dim(const lssy_index *ix);
+LSSY_API size_t lssy_index_vectors(const lssy_index *ix);
+LSSY_API size_t lssy_index_vecs_per_block(const lssy_index *ix);
+/* bytes of the file, all of which is mapped */
+LSSY_API size_t lssy_index_bytes(const lssy_index *ix);
+/* vectors ids[0..n-1] to out[0..n*dim-1], in that order */
+LSSY_API void lssy_index_fetch(const lssy_index *ix, const size_t *ids,
+	size_t n, float *out);
+/* vectors first..first+n-1 to out[0..n*dim-1]; for a block-coded index,
+   quickest when first is the first vector of a block */
+LSSY_API void lssy_index_fetch_range(const lssy_index *ix, size_t first,
+	size_t n, float *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,152 @@
+// C++ wrapper for liblssy, see lssy.h. Each class owns its handle and
+// frees it when it goes out of scope; failures throw lssy::error.
+// Models must outlive the encoders, decoders and indexes that use them,
+// and a decoder's input must stay put for as long as the decoder does.
+
+#ifndef LSSY_HPP
+#define LSSY_HPP
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "lssy.h"
+
+namespace lssy {
+
+class error : public std::runtime_error {
+  public:
+    explicit error(const std::string &what) : std::runtime_error(what) {}
+    explicit error(int err) : std::runtime_error(lssy_strerror(err)) {}
+};
+
+// shared base for the handle-owning classes, move-only
+template <typename T, void (*Free)(T *)>
+class handle {
+  public:
+    handle(const handle &) = delete;
+    handle &operator=(const handle &) = delete;
+    handle(handle &&o) noexcept
+      : m_handle(std::exchange(o.m_handle, nullptr)) {}
+    handle &operator=(handle &&o) noexcept {
+      std::swap(m_handle, o.m_handle);
+      return *this;
+    }
+    ~handle() { Free(m_handle); }
+    T *get() const { return m_handle; }
+
+  protected:
+    explicit handle(T *p) : m_handle(p) {}
+    T *m_handle;
+};
+
+class model : public handle<lssy_model, lssy_model_free> {
+  public:
+    explicit model(const std::string &bins_file)
+      : handle(lssy_model_load(bins_file.c_str())) {
+      if (!m_handle) throw error("unable to read bins file " + bins_file);
+    }
+    // columns the model is for, 0 if any
+    size_t dim() const { return lssy_model_dim(m_handle); }
+    size_t tables() const { return lssy_model_tables(m_handle); }
+    size_t contexts() const { return lssy_model_contexts(m_handle); }
+    size_t bins(size_t col = 0) const { return lssy_model_bins(m_handle, col); }
+    uint64_t total() const { return lssy_model_total(m_handle); }
+    // the representative of bin, in column col's table, as in the C API
+    float value(size_t col, uint32_t bin) const {
+      return lssy_model_value(m_handle, col, bin);
+    }
+    // and with just the one table
+    float value(uint32_t bin) const { return value(0, bin); }
+    double entropy() const { return lssy_model_entropy(m_handle); }
+    uint32_t bin(float f, size_t col = 0) const {
+      return lssy_float_to_bin(m_handle, col, f);
+    }
+    // F[0] is in column col
+    std::vector<uint32_t> bins(const float *F, size_t n, size_t col = 0) const {
+      std::vector<uint32_t> b(n);
+      lssy_floats_to_bins(m_handle, col, F, n, b.data());
+      return b;
+    }
+
+    lssy_stats encode_file(const std::string &index_file,
+        const std::string &out_file,
+        const lssy_encode_options *opt = nullptr) const {
+      lssy_encode_options defaults;
+      lssy_stats st;
+      if (!opt) {
+        lssy_encode_defaults(&defaults);
+        opt = &defaults;
+      }
+      int err = lssy_encode_file(m_handle, index_file.c_str(),
+        out_file.c_str(), opt, &st);
+      if (err != LSSY_OK) throw error(err);
+      return st;
+    }
+    lssy_stats decode_file(const std::string &in_file,
+        const std::string &index_file, int threads = 0) const {
+      lssy_stats st;
+      int err = lssy_decode_file(m_handle, in_file.c_str(),
+        index_file.c_str(), threads, &st);
+      if (err != LSSY_OK) throw error(err);
+      return st;
+    }
+};
+
+class encoder : public handle<lssy_encoder, lssy_encoder_free> {
+  public:
+    explicit encoder(const model &m) : handle(lssy_encoder_new(m.get())) {}
+    void bin(uint32_t b) { lssy_encode_bin(m_handle, b); }
+    void floats(const float *F, size_t n) { lssy_encode_floats(m_handle, F, n); }
+    void floats(const std::vector<float> &F) { floats(F.data(), F.size()); }
+    std::vector<uint8_t> finish() {
+      size_t len;
+      const uint8_t *buf = lssy_encoder_finish(m_handle, &len);
+      return std::vector<uint8_t>(buf, buf+len);
+    }
+};
+
+class decoder : public handle<lssy_decoder, lssy_decoder_free> {
+  public:
+    decoder(const model &m, const uint8_t *in, size_t len)
+      : handle(lssy_decoder_new(m.get(), in, len)) {}
+    decoder(const model &m, const std::vector<uint8_t> &in)
+      : decoder(m, in.data(), in.size()) {}
+    uint32_t bin() { return lssy_decode_bin(m_handle); }
+    void floats(float *F, size_t n) { lssy_decode_floats(m_handle, F, n); }
+    std::vector<float> floats(size_t n) {
+      std::vector<float> F(n);
+      floats(F.data(), n);
+      return F;
+    }
+};
+
+class index : public handle<lssy_index, lssy_index_close> {
+  public:
+    index(const model &m, const std::string &in_file)
+      : handle(lssy_index_open(m.get(), in_file.c_str())) {
+      if (!m_handle) throw error(in_file + " is not a block-coded or packed index");
+    }
+    size_t dim() const { return lssy_index_dim(m_handle); }
+    size_t size() const { return lssy_index_vectors(m_handle); }
+    size_t vecs_per_block() const { return lssy_index_vecs_per_block(m_handle); }
+    size_t bytes() const { return lssy_index_bytes(m_handle); }
+    void fetch(const size_t *ids, size_t n, float *out) const {
+      lssy_index_fetch(m_handle, ids, n, out);
+    }
+    std::vector<float> fetch(const std::vector<size_t> &ids) const {
+      std::vector<float> out(ids.size()*dim());
+      fetch(ids.data(), ids.size(), out.data());
+      return out;
+    }
+    // vectors first..first+n-1
+    void fetch_range(size_t first, size_t n, float *out) const {
+      lssy_index_fetch_range(m_handle, first, n, out);
+    }
+};
+
+}  // namespace lssy
+
+#endif
@@ -0,0 +1,57 @@
+/* Order-1 contexts for the arithmetic coder. Neighbouring columns of a
+   vector are often related, so each float is coded with counts that
+   depend on the bin of the float before it in the same vector. Rather
+   than a row of counts for every possible previous bin, the bins of each
+   table are cut into num_buckets runs of about equal probability (see
+   make_buckets() in helpers.c), and there is a row for each bucket, plus
+   one more for column zero, which has no float before it. With a table
+   for each column, the bucket comes from the previous column's table,
+   and the rows belong to the table of the column being coded.
+
+   The rows are trained by contexts.c and kept after the tables in the
+   bins file, as 16-bit counts, so that they stay small; they are read
+   along with everything else by read_model_set().
+
+   Needs helpers.c to have been included first.
+*/
+
+/* the counts for a float in column col, given bin prev of the float
+   before it; prev is not used in column zero */
+static inline const bin_model *
+context_model(const model_set *ms, size_t col, size_t prev) {
+	const bin_model *m = column_model(ms, col);
+
+	if (col == 0) {
+		return m->ctx + ms->num_buckets;
+	}
+	return m->ctx + column_model(ms, col-1)->bucket[prev];
+}
+
+/* code the nS bin numbers in syms[], vectors of dim, starting at
+   column zero */
+void
+context_encode(const model_set *ms, size_t dim, const uint32_t *syms,
+		size_t nS, arith_encoder *ae) {
+	size_t i, col;
+
+	for (i=0, col=0; i<nS; i++) {
+		arith_encode(ae, context_model(ms, col, col ? syms[i-1] : 0),
+			syms[i]);
+		col = col+1==dim ? 0 : col+1;
+	}
+}
+
+/* and decode nF floats into F */
+void
+context_decode(const model_set *ms, size_t dim, arith_decoder *ad,
+		float *F, size_t nF) {
+	const bin_model *m;
+	size_t i, col, s=0;
+
+	for (i=0, col=0; i<nF; i++) {
+		m = context_model(ms, col, s);
+		s = arith_decode(ad, m);
+		F[i] = m->S[s];
+		col = col+1==dim ? 0 : col+1;
+	}
+}
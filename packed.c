@@ -0,0 +1,459 @@
+/* Fixed-width codes, for when decoding speed matters more than the last
+   fraction of a bit. Each float's bin number is stored in exactly
+   ceil(log2(num_bins)) bits of its table, packed one after the other,
+   least significant bits first, so every vector takes the same number of
+   bits, and the start of any vector can be worked out directly, with no
+   offsets to store or look up. The compressed file is laid out as
+
+	FAISS header:	HEADER bytes, put straight through
+	magic:		"LSPK"
+	dim:		uint64_t, floats per vector
+	num_vecs:	uint64_t
+	vec_bits:	uint64_t, bits per vector, to check the model against
+	codes:		num_vecs*vec_bits bits, to a whole number of bytes,
+			then PACK_PAD zero bytes
+
+   The padding means that a code can always be fetched with a single
+   unaligned load of four (or eight) bytes, shifted and masked. The AVX2
+   and AVX-512 kernels do that with a gather, eight or sixteen columns at
+   a time, and then gather the bins' values straight from a table of all
+   the values of all the tables, so that floats come out at close to
+   memory speed. Chunks of vectors are shared out between threads, in
+   multiples of eight, so that each starts on a byte boundary.
+
+   Needs helpers.c, binmap.c and blocks.c to have been included first.
+*/
+
+#define PACK_MAGIC "LSPK"
+#define PACK_MAGIC_LEN 4
+#define PACK_HEADER_BYTES (PACK_MAGIC_LEN + 3*sizeof(uint64_t))
+#define PACK_PAD 8
+#define PACK_MAX_WIDTH 25	// shifted by up to 7, still in 32 bits
+#define PACK_CHUNK_VECS 4096	// claimed by a thread at a time, 8k
+
+int packed_isa=-1;		// which unpacker to use, best available if -1
+
+typedef struct {
+	const model_set *ms;
+	uint64_t dim;
+	uint64_t num_vecs;
+	uint64_t vec_bits;
+	uint32_t *col_bit;	// where each column starts in a vector
+	uint32_t *col_mask;	// and the mask for its width
+	uint32_t *col_base;	// where its table starts in val[]
+	float *val;		// every table's S[], one after the other
+
+	/* when reading */
+	uint8_t *map;
+	size_t map_len;
+	const uint8_t *codes;	// the first byte of the codes
+} packed_file;
+
+/* bits needed for bin numbers 0..num_bins-1 */
+static int
+pack_width(size_t num_bins) {
+	int w;
+	for (w=0; ((size_t)1<<w) < num_bins; w++) {
+	}
+	return w;
+}
+
+/* whether every table of ms has few enough bins to be packed */
+int
+packed_model_ok(const model_set *ms) {
+	size_t k;
+	for (k=0; k<ms->num_models; k++) {
+		if (pack_width(ms->models[k].num_bins) > PACK_MAX_WIDTH) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* set pf up for vectors of dim floats coded with ms; zero if the model
+   is for another dim, or has too many bins to pack */
+int
+packed_setup(packed_file *pf, const model_set *ms, size_t dim,
+		size_t num_vecs) {
+	size_t k, col, nv=0;
+	uint32_t *base;
+	const bin_model *m;
+	int w;
+
+	memset(pf, 0, sizeof(*pf));
+	if (dim==0 || (ms->dim && ms->dim != dim) || !packed_model_ok(ms)) {
+		return 0;
+	}
+	for (k=0; k<ms->num_models; k++) {
+		nv += ms->models[k].num_bins;
+	}
+	pf->ms = ms;
+	pf->dim = dim;
+	pf->num_vecs = num_vecs;
+	pf->col_bit = malloc(dim*sizeof(*pf->col_bit));
+	pf->col_mask = malloc(dim*sizeof(*pf->col_mask));
+	pf->col_base = malloc(dim*sizeof(*pf->col_base));
+	pf->val = malloc(nv*sizeof(*pf->val));
+	base = malloc(ms->num_models*sizeof(*base));
+	assert(pf->col_bit && pf->col_mask && pf->col_base && pf->val &&
+		base);
+	for (nv=0, k=0; k<ms->num_models; k++) {
+		base[k] = nv;
+		memcpy(pf->val+nv, ms->models[k].S,
+			ms->models[k].num_bins*sizeof(*pf->val));
+		nv += ms->models[k].num_bins;
+	}
+	for (col=0; col<dim; col++) {
+		m = column_model(ms, col);
+		w = pack_width(m->num_bins);
+		pf->col_bit[col] = pf->vec_bits;
+		pf->col_mask[col] = ((uint64_t)1<<w) - 1;
+		pf->col_base[col] = base[m - ms->models];
+		pf->vec_bits += w;
+	}
+	free(base);
+	return 1;
+}
+
+void
+packed_free(packed_file *pf) {
+	free(pf->col_bit);
+	free(pf->col_mask);
+	free(pf->col_base);
+	free(pf->val);
+	if (pf->map) {
+		munmap(pf->map, pf->map_len);
+	}
+}
+
+/* bytes of codes for n vectors, not counting the padding */
+static inline size_t
+packed_bytes(const packed_file *pf, size_t n) {
+	return (n*pf->vec_bits + 7) / 8;
+}
+
+void
+write_packed_header(const packed_file *pf, FILE *fp) {
+	fwrite(PACK_MAGIC, 1, PACK_MAGIC_LEN, fp);
+	fwrite(&pf->dim, sizeof(pf->dim), 1, fp);
+	fwrite(&pf->num_vecs, sizeof(pf->num_vecs), 1, fp);
+	fwrite(&pf->vec_bits, sizeof(pf->vec_bits), 1, fp);
+}
+
+/* as for read_block_header(): zero, with fp wound back, if the next
+   bytes are not a packed header, -1 if they are but do not fit ms, and
+   otherwise 1, with pf set up and fp left at the first code */
+int
+read_packed_header(packed_file *pf, const model_set *ms, FILE *fp) {
+	char magic[PACK_MAGIC_LEN];
+	uint64_t dim, num_vecs, vec_bits;
+	off_t pos = ftello(fp);
+
+	memset(pf, 0, sizeof(*pf));
+	if (fread(magic, 1, PACK_MAGIC_LEN, fp) != PACK_MAGIC_LEN ||
+			memcmp(magic, PACK_MAGIC, PACK_MAGIC_LEN) != 0) {
+		fseeko(fp, pos, SEEK_SET);
+		return 0;
+	}
+	if (fread(&dim, sizeof(dim), 1, fp) != 1 ||
+			fread(&num_vecs, sizeof(num_vecs), 1, fp) != 1 ||
+			fread(&vec_bits, sizeof(vec_bits), 1, fp) != 1 ||
+			!packed_setup(pf, ms, dim, num_vecs)) {
+		return -1;
+	}
+	if (pf->vec_bits != vec_bits) {
+		packed_free(pf);
+		return -1;
+	}
+	return 1;
+}
+
+/* pack bin numbers of n vectors into out, which must be zeroed, and have
+   PACK_PAD bytes to spare */
+static void
+pack_vectors(const packed_file *pf, const uint32_t *bins, size_t n,
+		uint8_t *out) {
+	uint64_t bit, w;
+	size_t v, col;
+
+	for (v=0; v<n; v++) {
+		for (col=0; col<pf->dim; col++, bins++) {
+			bit = v*pf->vec_bits + pf->col_bit[col];
+			memcpy(&w, out + (bit>>3), sizeof(w));
+			w |= (uint64_t)*bins << (bit&7);
+			memcpy(out + (bit>>3), &w, sizeof(w));
+		}
+	}
+}
+
+/* and unpack the floats of vector v of in, one column at a time */
+static inline void
+unpack_vector_scalar(const packed_file *pf, const uint8_t *in, size_t v,
+		float *F) {
+	uint64_t bit = v*pf->vec_bits, w;
+	const uint8_t *p = in + (bit>>3);
+	uint32_t off, col;
+
+	for (col=0; col<pf->dim; col++) {
+		off = (bit&7) + pf->col_bit[col];
+		memcpy(&w, p + (off>>3), sizeof(w));
+		F[col] = pf->val[pf->col_base[col] +
+			((w >> (off&7)) & pf->col_mask[col])];
+	}
+}
+
+/* eight columns at a time, the rest as above */
+__attribute__((target("avx2")))
+static void
+unpack_vector_avx2(const packed_file *pf, const uint8_t *in, size_t v,
+		float *F) {
+	uint64_t bit = v*pf->vec_bits, w;
+	const uint8_t *p = in + (bit>>3);
+	const __m256i first = _mm256_set1_epi32(bit&7);
+	const __m256i seven = _mm256_set1_epi32(7);
+	__m256i off, code;
+	uint32_t o, col;
+
+	for (col=0; col+8<=pf->dim; col+=8) {
+		off = _mm256_add_epi32(first, _mm256_loadu_si256(
+			(const __m256i *)(pf->col_bit+col)));
+		code = _mm256_i32gather_epi32((const int *)p,
+			_mm256_srli_epi32(off, 3), 1);
+		code = _mm256_srlv_epi32(code, _mm256_and_si256(off, seven));
+		code = _mm256_and_si256(code, _mm256_loadu_si256(
+			(const __m256i *)(pf->col_mask+col)));
+		code = _mm256_add_epi32(code, _mm256_loadu_si256(
+			(const __m256i *)(pf->col_base+col)));
+		_mm256_storeu_ps(F+col, _mm256_i32gather_ps(pf->val, code, 4));
+	}
+	for (; col<pf->dim; col++) {
+		o = (bit&7) + pf->col_bit[col];
+		memcpy(&w, p + (o>>3), sizeof(w));
+		F[col] = pf->val[pf->col_base[col] +
+			((w >> (o&7)) & pf->col_mask[col])];
+	}
+}
+
+/* and sixteen */
+__attribute__((target("avx512f")))
+static void
+unpack_vector_avx512(const packed_file *pf, const uint8_t *in, size_t v,
+		float *F) {
+	uint64_t bit = v*pf->vec_bits, w;
+	const uint8_t *p = in + (bit>>3);
+	const __m512i first = _mm512_set1_epi32(bit&7);
+	const __m512i seven = _mm512_set1_epi32(7);
+	__m512i off, code;
+	uint32_t o, col;
+
+	for (col=0; col+16<=pf->dim; col+=16) {
+		off = _mm512_add_epi32(first,
+			_mm512_loadu_si512(pf->col_bit+col));
+		code = _mm512_i32gather_epi32(_mm512_srli_epi32(off, 3), p, 1);
+		code = _mm512_srlv_epi32(code, _mm512_and_si512(off, seven));
+		code = _mm512_and_si512(code,
+			_mm512_loadu_si512(pf->col_mask+col));
+		code = _mm512_add_epi32(code,
+			_mm512_loadu_si512(pf->col_base+col));
+		_mm512_storeu_ps(F+col, _mm512_i32gather_ps(code, pf->val, 4));
+	}
+	for (; col<pf->dim; col++) {
+		o = (bit&7) + pf->col_bit[col];
+		memcpy(&w, p + (o>>3), sizeof(w));
+		F[col] = pf->val[pf->col_base[col] +
+			((w >> (o&7)) & pf->col_mask[col])];
+	}
+}
+
+/* vectors v0..v0+n-1 of the codes in in, into F */
+void
+unpack_vectors(const packed_file *pf, const uint8_t *in, size_t v0,
+		size_t n, float *F) {
+	size_t v;
+
+	if (packed_isa<0) {
+		packed_isa = best_isa();
+	}
+	for (v=v0; v<v0+n; v++, F+=pf->dim) {
+		if (packed_isa == ISA_AVX512) {
+			unpack_vector_avx512(pf, in, v, F);
+		} else if (packed_isa == ISA_AVX2) {
+			unpack_vector_avx2(pf, in, v, F);
+		} else {
+			unpack_vector_scalar(pf, in, v, F);
+		}
+	}
+}
+
+/* the threads packing or unpacking share out chunks of vectors */
+typedef struct {
+	const packed_file *pf;
+	const uint8_t *in;	// floats or codes
+	uint8_t *out;		// codes or floats
+	size_t num_chunks;
+	size_t next;		// next chunk to be claimed
+} packed_job;
+
+static inline size_t
+chunk_vecs(const packed_file *pf, size_t c) {
+	size_t left = pf->num_vecs - c*PACK_CHUNK_VECS;
+	return left < PACK_CHUNK_VECS ? left : PACK_CHUNK_VECS;
+}
+
+void *
+pack_worker(void *arg) {
+	packed_job *pj = arg;
+	const packed_file *pf = pj->pf;
+	size_t c, n, dim=pf->dim, len=packed_bytes(pf, PACK_CHUNK_VECS);
+	float *F = malloc(PACK_CHUNK_VECS*dim*sizeof(*F));
+	uint32_t *bins = malloc(PACK_CHUNK_VECS*dim*sizeof(*bins));
+	uint8_t *buf = malloc(len + PACK_PAD);
+
+	assert(F && bins && buf);
+	while ((c=__atomic_fetch_add(&pj->next, 1, __ATOMIC_RELAXED))
+			< pj->num_chunks) {
+		n = chunk_vecs(pf, c);
+		/* the index floats need not be aligned */
+		memcpy(F, pj->in + c*PACK_CHUNK_VECS*dim*sizeof(*F),
+			n*dim*sizeof(*F));
+		set_floats_to_bins(pf->ms, 0, F, n*dim, bins);
+		memset(buf, 0, len + PACK_PAD);
+		pack_vectors(pf, bins, n, buf);
+		memcpy(pj->out + packed_bytes(pf, c*PACK_CHUNK_VECS), buf,
+			packed_bytes(pf, n));
+	}
+	free(F);
+	free(bins);
+	free(buf);
+	return NULL;
+}
+
+void *
+unpack_worker(void *arg) {
+	packed_job *pj = arg;
+	const packed_file *pf = pj->pf;
+	size_t c, n, dim=pf->dim;
+	float *F = malloc(PACK_CHUNK_VECS*dim*sizeof(*F));
+
+	assert(F);
+	while ((c=__atomic_fetch_add(&pj->next, 1, __ATOMIC_RELAXED))
+			< pj->num_chunks) {
+		n = chunk_vecs(pf, c);
+		unpack_vectors(pf, pj->in, c*PACK_CHUNK_VECS, n, F);
+		memcpy(pj->out + c*PACK_CHUNK_VECS*dim*sizeof(*F), F,
+			n*dim*sizeof(*F));
+	}
+	free(F);
+	return NULL;
+}
+
+/* pack the num_vecs vectors of dim floats that follow the FAISS header
+   in fi into fo, which must be readable too ("w+"), just after its copy
+   of the header, with nthreads threads; returns the bytes written after
+   the header, or zero if the model cannot be packed, fi is short, or a
+   file cannot be mapped */
+size_t
+encode_packed(const model_set *ms, FILE *fi, FILE *fo, size_t dim,
+		size_t num_vecs, int nthreads) {
+	packed_file pf;
+	packed_job pj;
+	size_t in_len, out_len, bytes;
+	uint8_t *in, *out;
+
+	if (!packed_setup(&pf, ms, dim, num_vecs)) {
+		return 0;
+	}
+	write_packed_header(&pf, fo);
+	bytes = PACK_HEADER_BYTES + packed_bytes(&pf, num_vecs) + PACK_PAD;
+	out_len = HEADER + bytes;
+	in = map_input(fi, &in_len);
+	out = map_output(fo, out_len);
+	if (in == NULL || out == NULL ||
+			in_len < HEADER + num_vecs*dim*sizeof(float)) {
+		if (in) munmap(in, in_len);
+		if (out) munmap(out, out_len);
+		packed_free(&pf);
+		return 0;
+	}
+
+	pj.pf = &pf;
+	pj.in = in + HEADER;
+	pj.out = out + HEADER + PACK_HEADER_BYTES;
+	pj.num_chunks = (num_vecs + PACK_CHUNK_VECS - 1) / PACK_CHUNK_VECS;
+	pj.next = 0;
+	run_threads(pack_worker, &pj, nthreads);
+
+	munmap(in, in_len);
+	munmap(out, out_len);
+	packed_free(&pf);
+	return bytes;
+}
+
+/* and unpack all of pf, with fi positioned at the first code and fo
+   just after the FAISS header; returns the number of floats, or zero if
+   the files cannot be mapped or fi is short */
+size_t
+decode_packed(FILE *fi, FILE *fo, const packed_file *pf, int nthreads) {
+	packed_job pj;
+	off_t in_pos = ftello(fi);
+	size_t in_len, out_len = HEADER + pf->num_vecs*pf->dim*sizeof(float);
+	uint8_t *in = map_input(fi, &in_len);
+	uint8_t *out = map_output(fo, out_len);
+
+	if (in == NULL || out == NULL || in_len < in_pos +
+			packed_bytes(pf, pf->num_vecs) + PACK_PAD) {
+		if (in) munmap(in, in_len);
+		if (out) munmap(out, out_len);
+		return 0;
+	}
+
+	pj.pf = pf;
+	pj.in = in + in_pos;
+	pj.out = out + HEADER;
+	pj.num_chunks = (pf->num_vecs + PACK_CHUNK_VECS - 1) /
+		PACK_CHUNK_VECS;
+	pj.next = 0;
+	run_threads(unpack_worker, &pj, nthreads);
+
+	munmap(in, in_len);
+	munmap(out, out_len);
+	return pf->num_vecs*pf->dim;
+}
+
+/* random access: fname is mapped, and vectors are then unpacked straight
+   from where they are; zero if fname cannot be opened or is not packed */
+int
+packed_file_open(packed_file *pf, const model_set *ms, const char *fname) {
+	char h[HEADER];
+	FILE *fp;
+
+	if ((fp=fopen(fname, "r")) == NULL) {
+		return 0;
+	}
+	if (fread(h, 1, HEADER, fp) != HEADER ||
+			read_packed_header(pf, ms, fp) != 1) {
+		fclose(fp);
+		return 0;
+	}
+	pf->map = map_input(fp, &pf->map_len);
+	fclose(fp);
+	if (pf->map == NULL || pf->map_len < HEADER + PACK_HEADER_BYTES +
+			packed_bytes(pf, pf->num_vecs) + PACK_PAD) {
+		packed_free(pf);
+		return 0;
+	}
+	pf->codes = pf->map + HEADER + PACK_HEADER_BYTES;
+	return 1;
+}
+
+/* as fetch_vectors(), but every vector is just where it is expected */
+void
+fetch_packed(const packed_file *pf, const size_t *ids, size_t n,
+		float *out) {
+	size_t i;
+
+	for (i=0; i<n; i++) {
+		assert(ids[i] < pf->num_vecs);
+		unpack_vectors(pf, pf->codes, ids[i], 1, out + i*pf->dim);
+	}
+}
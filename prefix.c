@@ -0,0 +1,281 @@
+/* Running sums of a sorted array of floats, and of their squares, so that
+   quantize can have the sum and sum of squares of any range of them, a
+   bin or a column, from a couple of lookups rather than a walk along the
+   range: a bin's mean, and its squared error about any representative,
+   then take constant time, and its average absolute error a bisection for
+   where the representative falls.
+
+   Only the sums up to each PREFIX_BLOCK'th float are kept, 16 bytes per
+   block rather than per float, so the sums take a small fraction of the
+   memory of the floats; the ends of a range are filled in from the
+   floats themselves, up to a block at each end. A range of no more than
+   two blocks is just summed, which costs no more, and is exact: taking
+   the difference of two long running sums would lose the low bits of a
+   bin of a few floats.
+
+   The sums are built in a single pass, with the floats cut into a slice
+   per thread, each thread summing the blocks of its own slice; each
+   slice's sums then have the totals of the slices before it added on.
+   The same pass gathers the counts of signs and magnitudes that quantize
+   reports, and the places where the floats go down rather than up, so
+   that nothing else need walk all of the floats.
+*/
+
+#include <pthread.h>
+
+#define PREFIX_BLOCK 64		// floats per kept running sum
+#define PREFIX_MIN_SLICE (1<<20)	// no thread gets fewer floats than this
+
+/* the counts of the floats reported before any binning, added to a
+   chunk at a time
+*/
+typedef struct {
+	float minmag;
+	float maxmag;
+	size_t num_zero;
+	size_t num_neg;
+	size_t num_pos;
+} value_stats;
+
+void
+count_values(const float *F, size_t nF, value_stats *vs) {
+	/* counted in a copy, which cannot be one of the floats */
+	value_stats c = *vs;
+
+	for (size_t i=0; i<nF; i++) {
+		if (fabs(F[i]) < c.minmag) {
+			c.minmag = fabs(F[i]);
+		}
+		if (fabs(F[i]) > c.maxmag) {
+			c.maxmag = fabs(F[i]);
+		}
+		if (F[i] < 0.0) {
+			c.num_neg++;
+		} else if (F[i]>0.0) {
+			c.num_pos++;
+		} else {
+			c.num_zero++;
+		}
+	}
+	*vs = c;
+}
+
+/* add the counts of b into a */
+void
+merge_values(value_stats *a, const value_stats *b) {
+	if (b->minmag < a->minmag) {
+		a->minmag = b->minmag;
+	}
+	if (b->maxmag > a->maxmag) {
+		a->maxmag = b->maxmag;
+	}
+	a->num_zero += b->num_zero;
+	a->num_neg += b->num_neg;
+	a->num_pos += b->num_pos;
+}
+
+typedef struct {
+	const float *F;
+	size_t n;
+	double *sum;		// sum[b], of F[0..b*PREFIX_BLOCK-1]
+	double *sumsq;		// and of their squares
+	size_t descents;	// places where F[i] > F[i+1]
+	size_t misplaced;	// of those, the ones inside a run, see below
+} prefix_sums;
+
+/* what each thread does, and finds out, for its slice */
+typedef struct {
+	prefix_sums *P;
+	size_t first, last;	// floats of the slice, first on a block
+	size_t run;		// floats that are to be in order together
+	int count;		// whether to fill in vs
+	value_stats vs;
+	double sum, sumsq;	// of the slice
+	size_t descents, misplaced;
+} prefix_slice;
+
+void *
+prefix_worker(void *arg) {
+	prefix_slice *ps = arg;
+	prefix_sums *P = ps->P;
+	const float *F = P->F;
+	double sum=0, sumsq=0;
+	size_t i, strt, end, next, descents=0, misplaced=0;
+
+	/* a block at a time, so that it is still in cache for the checks
+	   and counts; the float after the slice is checked against its
+	   last one too */
+	for (strt=ps->first; strt<ps->last; strt=end) {
+		end = strt+PREFIX_BLOCK < ps->last ? strt+PREFIX_BLOCK :
+			ps->last;
+		for (i=strt; i<end; i++) {
+			sum += F[i];
+			sumsq += (double)F[i]*F[i];
+		}
+		if (end%PREFIX_BLOCK == 0) {
+			P->sum[end/PREFIX_BLOCK] = sum;
+			P->sumsq[end/PREFIX_BLOCK] = sumsq;
+		}
+		next = end < P->n ? end+1 : P->n;
+		for (i=strt+1; i<next; i++) {
+			if (F[i-1] > F[i]) {
+				descents++;
+				misplaced += i%ps->run != 0;
+			}
+		}
+		if (ps->count) {
+			count_values(F+strt, end-strt, &ps->vs);
+		}
+	}
+	ps->sum = sum;
+	ps->sumsq = sumsq;
+	ps->descents = descents;
+	ps->misplaced = misplaced;
+	return NULL;
+}
+
+/* the running sums of the n floats of F, with nthreads threads; F must
+   be in order in each run of run floats, as sorted a column at a time,
+   with descents counting the places it goes down, and misplaced the
+   ones inside a run; and if vs is given, the floats are counted into it
+*/
+void
+prefix_build(prefix_sums *P, const float *F, size_t n, size_t run,
+		value_stats *vs, int nthreads) {
+	size_t nb=n/PREFIX_BLOCK+1, per, t, b, slices;
+	double sum=0, sumsq=0;
+	prefix_slice *ps;
+	pthread_t *tids;
+
+	P->F = F;
+	P->n = n;
+	P->sum = malloc(nb*sizeof(*P->sum));
+	P->sumsq = malloc(nb*sizeof(*P->sumsq));
+	assert(P->sum && P->sumsq);
+	P->sum[0] = P->sumsq[0] = 0;
+
+	/* slices of whole blocks, other than the last */
+	slices = n/PREFIX_MIN_SLICE;
+	if (slices > (size_t)nthreads) {
+		slices = nthreads;
+	}
+	if (slices < 1) {
+		slices = 1;
+	}
+	per = (n/slices + PREFIX_BLOCK-1)/PREFIX_BLOCK*PREFIX_BLOCK;
+	ps = calloc(slices, sizeof(*ps));
+	tids = malloc(slices*sizeof(*tids));
+	assert(ps && tids);
+	for (t=0; t<slices; t++) {
+		ps[t].P = P;
+		ps[t].first = t*per < n ? t*per : n;
+		ps[t].last = t+1<slices && (t+1)*per < n ? (t+1)*per : n;
+		ps[t].run = run;
+		ps[t].count = vs != NULL;
+		if (vs) {
+			ps[t].vs.minmag = vs->minmag;
+			ps[t].vs.maxmag = vs->maxmag;
+		}
+	}
+	for (t=1; t<slices; t++) {
+		if (pthread_create(tids+t, NULL, prefix_worker, ps+t) != 0) {
+			fprintf(stderr, "unable to create thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	prefix_worker(ps);
+	for (t=1; t<slices; t++) {
+		pthread_join(tids[t], NULL);
+	}
+
+	/* each slice's sums were its own; add those of the slices before */
+	P->descents = P->misplaced = 0;
+	for (t=0; t<slices; t++) {
+		if (t) {
+			for (b=ps[t].first/PREFIX_BLOCK+1;
+					b*PREFIX_BLOCK<=ps[t].last; b++) {
+				P->sum[b] += sum;
+				P->sumsq[b] += sumsq;
+			}
+		}
+		sum += ps[t].sum;
+		sumsq += ps[t].sumsq;
+		P->descents += ps[t].descents;
+		P->misplaced += ps[t].misplaced;
+		if (vs) {
+			merge_values(vs, &ps[t].vs);
+		}
+	}
+	free(ps);
+	free(tids);
+}
+
+void
+prefix_free(prefix_sums *P) {
+	free(P->sum);
+	free(P->sumsq);
+}
+
+/* the sum of F[a..b-1], and of their squares into *sumsq if it is given */
+double
+prefix_range(const prefix_sums *P, size_t a, size_t b, double *sumsq) {
+	size_t i, ba, bb;
+	double sum=0, sq=0;
+
+	if (b-a <= 2*PREFIX_BLOCK) {
+		for (i=a; i<b; i++) {
+			sum += P->F[i];
+			sq += (double)P->F[i]*P->F[i];
+		}
+	} else {
+		/* the whole blocks from the kept sums, the ends added on */
+		ba = (a+PREFIX_BLOCK-1)/PREFIX_BLOCK;
+		bb = b/PREFIX_BLOCK;
+		for (i=a; i<ba*PREFIX_BLOCK; i++) {
+			sum += P->F[i];
+			sq += (double)P->F[i]*P->F[i];
+		}
+		for (i=bb*PREFIX_BLOCK; i<b; i++) {
+			sum += P->F[i];
+			sq += (double)P->F[i]*P->F[i];
+		}
+		sum += P->sum[bb] - P->sum[ba];
+		sq += P->sumsq[bb] - P->sumsq[ba];
+	}
+	if (sumsq) {
+		*sumsq = sq;
+	}
+	return sum;
+}
+
+/* the first of F[a..b-1] that is not below x, or b */
+size_t
+prefix_search(const prefix_sums *P, size_t a, size_t b, double x) {
+	size_t mid;
+
+	while (a < b) {
+		mid = a + (b-a)/2;
+		if (P->F[mid] < x) {
+			a = mid+1;
+		} else {
+			b = mid;
+		}
+	}
+	return a;
+}
+
+/* the sums of the absolute and of the squared differences between the
+   floats F[a..b-1] and r
+*/
+void
+prefix_errors(const prefix_sums *P, size_t a, size_t b, double r,
+		double *abserr, double *sqerr) {
+	size_t k = prefix_search(P, a, b, r);
+	double below, above, sumsq, sum;
+
+	below = prefix_range(P, a, k, NULL);
+	above = prefix_range(P, k, b, NULL);
+	*abserr = r*(k-a) - below + above - r*(b-k);
+	sum = prefix_range(P, a, b, &sumsq);
+	*sqerr = fmax(0.0, sumsq - 2*r*sum + r*r*(b-a));
+}
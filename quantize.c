@@ -17,6 +17,33 @@
 
    	quantize 256 3 index.sidx index.bins 
 
+   With -d, each dimension (column) of the vectors gets its own set of
+   bins and frequencies, and with -k groups, the dimensions are ranked by
+   their standard deviation and cut into that many groups of neighbours,
+   each sharing one set. Either way the input must be sorted a dimension
+   at a time, see faiss2simple -d, and the output is a set of tables, one
+   per group, headed by the group of each column, see helpers.c.
+
+   The sidx file can also be runs of equal floats, from faiss2simple -r,
+   each a float and how many of it there are; the bins are the same, but
+   only the runs are ever held.
+
+   With -s, the input is the FAISS flat index itself rather than an sidx
+   file, and is read just once, each float going into a KLL sketch (see
+   kll.c) instead of being sorted; a sketch per column if there are to be
+   tables per column or group, the columns' sketches then merged into one
+   per group. The bin counts, boundaries and representatives are read off
+   the sketch, so are estimates, but to within a rank error that -e sets
+   (as a fraction of the floats, by default a 32nd of an average bin), in
+   memory that grows with the number of bins rather than the floats. The
+   num_bins smallest and largest floats are kept exactly, so that narrow
+   bins at the ends, as GD and CFR make, are exact too.
+
+   An sidx file is read into memory and then gone over just once, by -t
+   threads (default, one per core), to count and check the floats and
+   build their running sums, see prefix.c; each bin's representative and
+   errors then come from those sums, rather than from its floats again.
+
    And then use index.bin as a control file for encoder.c to use when
    reducing and representing floats. Also needs to be supplied to
    decoder.c to reconstructed a file of 32-bit binned floats.
@@ -30,8 +57,16 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 #include <assert.h>
+#include <time.h>
 
+#include "helpers.c"
+#include "binmap.c"
+#include "kll.c"
+#include "prefix.c"
 
 #define BIN1_GEOM 1		// number of items in smallest geometric bin
 
@@ -39,6 +74,11 @@
 
 #define EPS 1e-10		// doubles only, don't use this with floats
 
+#define CHUNK_VECS 4096		// vectors read at a time with -s
+#define SKETCH_BIN_ERROR 32	// default -s rank error, as a fraction of a bin
+
+#define SIDX_RUNS_MAGIC 0x4c535352	// starts a run-length sidx file, "RSSL"
+
 /* comparison function for sorting floats */
 int
 cmp(const void *x1, const void *x2) {
@@ -71,7 +111,7 @@ entropy(size_t frqs[], size_t n) {
  * "Fixed Domain" FD
 */
 void
-bins_fixed_domain(size_t C[], size_t num_bins, float *F, size_t nF) {
+bins_fixed_domain(size_t C[], size_t num_bins, const float *F, size_t nF) {
 	size_t i, step;
 	size_t sofar=0;
 	step = nF / num_bins;
@@ -92,9 +132,9 @@ bins_fixed_domain(size_t C[], size_t num_bins, float *F, size_t nF) {
  * "Fixed Range" FR
 */
 void
-bins_fixed_range(size_t C[], size_t num_bins, float *F, size_t nF) {
-	double minF, maxF;
-	size_t i, iF;
+bins_fixed_range(size_t C[], size_t num_bins, const float *F, size_t nF) {
+	double minF, maxF, top;
+	size_t i, iF, lo, hi, mid;
 	double interval;
 
 	/* establish the range of values in F, and the range interval */
@@ -102,13 +142,20 @@ bins_fixed_range(size_t C[], size_t num_bins, float *F, size_t nF) {
 	maxF = F[nF-1] + EPS;
 	interval = (maxF - minF) / num_bins;
 
-	/* now count how many values in F in each of those sub ranges */
+	/* now count how many values in F in each of those sub ranges, by
+	   bisection for the first value past each */
 	for (i=0, iF=0; i<num_bins; i++) {
-		C[i] = 0;
-		while (iF < nF && F[iF] < minF + (i+1)*interval) {
-			iF++;
-			C[i]++;
+		top = minF + (i+1)*interval;
+		for (lo=iF, hi=nF; lo<hi; ) {
+			mid = lo + (hi-lo)/2;
+			if (F[mid] < top) {
+				lo = mid+1;
+			} else {
+				hi = mid;
+			}
 		}
+		C[i] = lo - iF;
+		iF = lo;
 	}
 	return;
 }
@@ -118,7 +165,7 @@ bins_fixed_range(size_t C[], size_t num_bins, float *F, size_t nF) {
    "Geometric Domain" GR   
 */
 void
-bins_geometric_domain(size_t C[], size_t num_bins, float *F, size_t nF) {
+bins_geometric_domain(size_t C[], size_t num_bins, const float *F, size_t nF) {
 
 	/* first find the geometric parameter */
 	double lo=1.00000001;
@@ -171,7 +218,7 @@ bins_geometric_domain(size_t C[], size_t num_bins, float *F, size_t nF) {
 */
 
 void
-bins_fixed_skinny(size_t C[], size_t num_bins, float *F, size_t nF) {
+bins_fixed_skinny(size_t C[], size_t num_bins, const float *F, size_t nF) {
 
 	size_t i, singles;
 
@@ -202,30 +249,43 @@ const char *labels[] = {"",
 	"CFR",
 	""};
 
-void ((*bin_funcs[])(size_t *, size_t, float *, size_t)) =
+void ((*bin_funcs[])(size_t *, size_t, const float *, size_t)) =
 	{bins_fixed_domain,
 	 bins_fixed_range,
 	 bins_geometric_domain,
 	 bins_fixed_skinny};
 
-/* print out the bin boundaries and bin averages, text format to stdout
+/* what print_bins() finds out about the bins, added up over however many
+   sets of them there are
+*/
+typedef struct {
+	size_t empty;		// bins with no values of their own
+	double maxerror;	// worst distance of a value from its bin rep
+	double sumerror;	// and the sum of those distances
+	double sumsqerror;	// and of their squares
+	double bits;		// entropy of the bins, times the values
+	size_t nF;		// values
+} bin_stats;
+
+/* print out the bin boundaries and bin averages, text format to stdout,
+   each bin's sums coming from the running sums of the sorted floats
 */
 void
-print_bins(size_t *C, size_t num_bins, float *F, size_t nF) {
-	size_t i=0, strt=0, empty=0;
-	double binrep, error, maxerror=0.0, avgerror=0.0;
+print_bins(size_t *C, size_t num_bins, const prefix_sums *P,
+		bin_stats *st) {
+	const float *F=P->F;
+	size_t nF=P->n;
+	size_t i=0, strt=0;
+	double binrep, error, abserr, sqerr;
 
 	/* lets just do a quick bin check, how many are empty? */
 	strt = 0;
 	for (i=0; i<num_bins-1; i++) {
-		if (F[strt]==F[strt+C[i]]) {
-			empty += 1;
+		if (strt+C[i]<nF && F[strt]==F[strt+C[i]]) {
+			st->empty += 1;
 		}
 		strt += C[i];
 	}
-	if (empty) {
-		fprintf(stderr, "empty bins   = %lu\n", empty);
-	}
 	i = 0;
 	strt = 0;
 	while (strt<nF) {
@@ -235,11 +295,7 @@ print_bins(size_t *C, size_t num_bins, float *F, size_t nF) {
 				F[strt], F[strt+C[i]-1]);
 			/* compute bin representative as average of the
 			   values actually in this bin */
-			binrep = 0.0;
-			for (size_t j=strt; j<strt+C[i]; j++) {
-				binrep += F[j];
-			}
-			binrep /= C[i];
+			binrep = prefix_range(P, strt, strt+C[i], NULL)/C[i];
 #if 0
 			/* or could use bin medians rather bin means */
 			if (C[i]%2==0) {
@@ -250,14 +306,12 @@ print_bins(size_t *C, size_t num_bins, float *F, size_t nF) {
 			}
 #endif
 			printf("rep %9.6f, ", binrep);
+			prefix_errors(P, strt, strt+C[i], binrep, &abserr,
+				&sqerr);
 
 #if 0
 			/* measure average error per bin value */
-			error = 0.0;
-			for (size_t j=strt; j<strt+C[i]; j++) {
-				error += fabs(F[j] - binrep);
-			}
-			error /= C[i];
+			error = abserr/C[i];
 			printf("avgerr %9.6f", error);
 #else
 			/* measure worst error per bin */
@@ -267,12 +321,11 @@ print_bins(size_t *C, size_t num_bins, float *F, size_t nF) {
 			}
 			printf("maxerr %9.6f", error);
 #endif
-			if (error>maxerror) {
-				maxerror = error;
-			}
-			for (size_t j=strt; j<strt+C[i]; j++) {
-				avgerror += fabs(F[j] - binrep);
+			if (error>st->maxerror) {
+				st->maxerror = error;
 			}
+			st->sumerror += abserr;
+			st->sumsqerror += sqerr;
 		}
 		printf("\n");
 		strt += C[i];
@@ -280,23 +333,52 @@ print_bins(size_t *C, size_t num_bins, float *F, size_t nF) {
 	}
 	assert(strt==nF);
 
-	fprintf(stderr, "maxerror     = %8.6f\n", maxerror);
-	fprintf(stderr, "avgerror     = %8.6f\n", avgerror/nF);
+	st->bits += entropy(C, num_bins) * nF;
+	st->nF += nF;
+	return;
+}
+
+void
+report_stats(const bin_stats *st) {
+	if (st->empty) {
+		fprintf(stderr, "empty bins   = %lu\n", st->empty);
+	}
+	fprintf(stderr, "maxerror     = %8.6f\n", st->maxerror);
+	fprintf(stderr, "avgerror     = %8.6f\n", st->sumerror/st->nF);
+	fprintf(stderr, "mse          = %.4g\n", st->sumsqerror/st->nF);
 	fprintf(stderr, "entropy      = %.2f bits per bin id\n",
-		entropy(C, num_bins));
+		st->bits/st->nF);
+	fprintf(stderr, "\n");
+}
+
+void
+report_values(size_t ncols, size_t nrows, size_t num_bins,
+		const value_stats *vs) {
+	size_t nF=ncols*nrows;
+
+	fprintf(stderr, "\n");
+	fprintf(stderr, "data columns = %lu\n", ncols);
+	fprintf(stderr, "data rows    = %lu\n", nrows);
+	fprintf(stderr, "total vals   = %lu\n", nF);
+	fprintf(stderr, "bin count    = %lu\n", num_bins);
+	fprintf(stderr, "average bin  = %lu values\n", nF/num_bins);
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "smallest mag = %.7g\n", vs->minmag);
+	fprintf(stderr, "biggest mag  = %.7g\n", vs->maxmag);
+	fprintf(stderr, "number neg   = %lu\n", vs->num_neg);
+	fprintf(stderr, "number zero  = %lu\n", vs->num_zero);
+	fprintf(stderr, "number pos   = %lu\n", vs->num_pos);
 	fprintf(stderr, "\n");
-	return;
 }
 
-/* write a file of bin boundaries and representative values, followed by
-   the complete set of bin frequencies (to be used by encoder and decoder)
-   as binary output to bins.bin
+/* write a table of bin upper bounds U[] and representative values S[],
+   followed by the complete set of bin frequencies (to be used by encoder
+   and decoder) as binary output to bins.bin
 */
 void
-write_bins(size_t C[], size_t num_bins, float F[], size_t nF, FILE *fb) {
-	size_t i=0, strt=0;
-	double binrep;
-	float fbinrep;
+write_table(size_t C[], size_t num_bins, float U[], float S[], FILE *fb) {
+	size_t i;
 	size_t value=2;
 
 	assert(fb);
@@ -306,29 +388,777 @@ write_bins(size_t C[], size_t num_bins, float F[], size_t nF, FILE *fb) {
 	fwrite(&num_bins, sizeof(size_t), 1, fb);
 
 	/* and now the table */
+	for (i=0; i<num_bins; i++) {
+		fwrite(U+i, sizeof(float), 1, fb);
+		fwrite(S+i, sizeof(float), 1, fb);
+	}
+
+	/* second output component is the set of bin frequencies decided
+	   on in connection with the input data */
+	fwrite(C, sizeof(*C), num_bins, fb);
+}
+
+/* the table for the sorted floats, each bin's upper bound the last
+   value to go into it, and its representative their average
+*/
+void
+bin_table(size_t C[], size_t num_bins, const prefix_sums *P,
+		float U[], float S[]) {
+	size_t i=0, strt=0;
+	double binrep;
+
 	for (strt=0, i=0; i<num_bins; i++) {
 		if (C[i] > 0) {
-			binrep = 0.0;
-			for (size_t j=strt; j<strt+C[i]; j++) {
-				binrep += F[j];
-			}
-			binrep /= C[i];
+			binrep = prefix_range(P, strt, strt+C[i], NULL)/C[i];
 		} else {
-			binrep = F[strt+C[i]-1];
+			binrep = P->F[strt+C[i]-1];
 		}
-		fwrite(F+strt+C[i]-1, sizeof(float), 1, fb);
-		fbinrep = binrep;
-		fwrite(&fbinrep, sizeof(float), 1, fb);
+		U[i] = P->F[strt+C[i]-1];
+		S[i] = binrep;
 		strt += C[i];
 	}
 
 	/* final checks */
-	assert(strt==nF);
+	assert(strt==P->n);
+}
 
-	/* second output component is the set of bin frequencies decided
-	   on in connection with the input data */
-	fwrite(C, sizeof(*C), num_bins, fb);
-	
+/* bin, print, and write the table for the sorted floats */
+void
+sorted_bins(const prefix_sums *P, size_t *C, size_t num_bins,
+		size_t bintype, bin_stats *st, FILE *fb) {
+	float *U = malloc(num_bins*sizeof(*U));
+	float *S = malloc(num_bins*sizeof(*S));
+
+	assert(U && S);
+	bin_funcs[bintype](C, num_bins, P->F, P->n);
+	print_bins(C, num_bins, P, st);
+	bin_table(C, num_bins, P, U, S);
+	write_table(C, num_bins, U, S, fb);
+	free(U);
+	free(S);
+}
+
+/* the head of a set of tables: the number of columns, and of tables,
+   and which table each column uses; the tables themselves follow, each
+   as write_table() does them
+*/
+void
+write_set_header(size_t ncols, size_t ngroups, uint32_t group[], FILE *fb) {
+	size_t value=BINS_SET_MAGIC;
+
+	fwrite(&value, sizeof(size_t), 1, fb);
+	fwrite(&ncols, sizeof(size_t), 1, fb);
+	fwrite(&ngroups, sizeof(size_t), 1, fb);
+	fwrite(group, sizeof(*group), ncols, fb);
+}
+
+/* columns get ranked by their standard deviation */
+typedef struct {
+	double sd;
+	uint32_t col;
+} col_spread;
+
+int
+cmp_spread(const void *x1, const void *x2) {
+	const col_spread *c1=x1, *c2=x2;
+	if (c1->sd<c2->sd) return -1;
+	if (c1->sd>c2->sd) return +1;
+	return c1->col<c2->col ? -1 : +1;
+}
+
+/* put columns of similar spread in the same group, the groups as near
+   equal in size as they can be
+*/
+void
+assign_groups(col_spread *cs, size_t ncols, size_t ngroups, uint32_t group[]) {
+	size_t j;
+
+	qsort(cs, ncols, sizeof(*cs), cmp_spread);
+	for (j=0; j<ncols; j++) {
+		group[cs[j].col] = j*ngroups/ncols;
+	}
+}
+
+/* assign each of the ncols columns of nrows values, F[j*nrows..], to
+   one of ngroups groups
+*/
+void
+group_columns(const prefix_sums *P, size_t ncols, size_t nrows,
+		size_t ngroups, uint32_t group[]) {
+	col_spread *cs = malloc(ncols*sizeof(*cs));
+	double sum, sumsq;
+	size_t j;
+
+	assert(cs);
+	for (j=0; j<ncols; j++) {
+		sum = prefix_range(P, j*nrows, (j+1)*nrows, &sumsq);
+		cs[j].sd = sqrt(fmax(0.0, sumsq/nrows - (sum/nrows)*(sum/nrows)));
+		cs[j].col = j;
+	}
+	assign_groups(cs, ncols, ngroups, group);
+	free(cs);
+}
+
+/* A holds nA floats as sorted runs of run floats each, the last maybe
+   shorter; merge them, a pass of pairwise merges at a time, ping-ponging
+   with B, and return whichever of the two ends up with the sorted floats
+*/
+float *
+merge_runs(float *A, float *B, size_t nA, size_t run) {
+	size_t i, j, k, o, mid, end;
+	float *t;
+
+	for (; run<nA; run*=2) {
+		for (i=0; i<nA; i+=2*run) {
+			mid = i+run < nA ? i+run : nA;
+			end = i+2*run < nA ? i+2*run : nA;
+			for (j=i, k=mid, o=i; j<mid && k<end; ) {
+				B[o++] = A[k]<A[j] ? A[k++] : A[j++];
+			}
+			while (j<mid) B[o++] = A[j++];
+			while (k<end) B[o++] = A[k++];
+		}
+		t = A; A = B; B = t;
+	}
+	return A;
+}
+
+/* with -s, or a run-length sidx, the bin counts come from a view of the
+   floats instead, see kll.c, of a sketch or of the runs: FD and GD only
+   need the number of floats, and FR and CFR count the floats in each
+   slice of the range by rank, from first up to last
+*/
+void
+view_range(size_t C[], size_t num_bins, const kll_view *V,
+		uint64_t first, uint64_t last) {
+	double minF, maxF, interval;
+	uint64_t r, prev=first;
+	size_t i;
+
+	if (last <= first) {
+		memset(C, 0, num_bins*sizeof(*C));
+		return;
+	}
+	minF = kll_quantile(V, first)  - EPS;
+	maxF = kll_quantile(V, last-1) + EPS;
+	interval = (maxF - minF) / num_bins;
+	for (i=0; i<num_bins; i++) {
+		r = i+1<num_bins ? kll_rank(V, minF + (i+1)*interval) : last;
+		if (r < prev) r = prev;
+		if (r > last) r = last;
+		C[i] = r - prev;
+		prev = r;
+	}
+}
+
+void
+view_fixed_domain(size_t C[], size_t num_bins, const kll_view *V) {
+	bins_fixed_domain(C, num_bins, NULL, V->n);
+}
+
+void
+view_fixed_range(size_t C[], size_t num_bins, const kll_view *V) {
+	view_range(C, num_bins, V, 0, V->n);
+}
+
+void
+view_geometric_domain(size_t C[], size_t num_bins, const kll_view *V) {
+	bins_geometric_domain(C, num_bins, NULL, V->n);
+}
+
+void
+view_fixed_skinny(size_t C[], size_t num_bins, const kll_view *V) {
+	size_t i, singles;
+
+	/* the singletons come from the exact tails of a sketch */
+	singles = num_bins/4;
+	for (i=0; i<singles; i++) {
+		C[i] = 1;
+		C[num_bins-i-1] = 1;
+	}
+	view_range(C+singles, num_bins - 2*singles, V, singles,
+		V->n - singles);
+}
+
+/* in the same order as bin_funcs[] */
+void ((*view_funcs[])(size_t *, size_t, const kll_view *)) =
+	{view_fixed_domain,
+	 view_fixed_range,
+	 view_geometric_domain,
+	 view_fixed_skinny};
+
+/* the upper bounds U[] and representatives S[] of bins of C[] floats,
+   read off the view: the bound the float of the last rank in the bin,
+   and the representative the average of the floats of its ranks
+*/
+void
+view_table(size_t C[], size_t num_bins, const kll_view *V,
+		float U[], float S[]) {
+	uint64_t strt=0;
+	double binrep;
+	float first;
+	size_t i;
+
+	for (i=0; i<num_bins; i++) {
+		if (C[i] > 0) {
+			first = kll_quantile(V, strt);
+			U[i] = kll_quantile(V, strt+C[i]-1);
+			binrep = (kll_prefix_sum(V, strt+C[i]) -
+				kll_prefix_sum(V, strt)) / C[i];
+			/* estimates, so keep it inside the bin */
+			S[i] = binrep<first ? first : binrep>U[i] ? U[i] : binrep;
+		} else {
+			/* nothing maps to an empty bin */
+			U[i] = S[i] = i ? U[i-1] :
+				nextafterf(kll_quantile(V, 0), -INFINITY);
+		}
+		strt += C[i];
+	}
+	assert(strt==V->n);
+}
+
+/* print_bins(), from the view; the average and squared errors come from
+   the items, each counted as the floats it stands for
+*/
+void
+print_view_bins(size_t *C, size_t num_bins, const kll_view *V,
+		float U[], float S[], bin_stats *st) {
+	uint64_t strt=0;
+	size_t i, j, b;
+	double error;
+	float first;
+
+	for (i=0; i<num_bins; i++) {
+		if (i+1<num_bins && strt+C[i]<V->n &&
+			kll_quantile(V, strt)==kll_quantile(V, strt+C[i])) {
+			st->empty += 1;
+		}
+		printf("bin %3lu has %7lu vals: ", i, C[i]);
+		if (C[i] > 0) {
+			first = kll_quantile(V, strt);
+			printf("%9.6f to %9.6f, ", first, U[i]);
+			printf("rep %9.6f, ", S[i]);
+			error = S[i] - first;
+			if (U[i] - S[i] > error) {
+				error = U[i] - S[i];
+			}
+			printf("maxerr %9.6f", error);
+			if (error>st->maxerror) {
+				st->maxerror = error;
+			}
+		}
+		printf("\n");
+		strt += C[i];
+	}
+	for (b=0, j=0; j<V->m; j++) {
+		while (b+1<num_bins && V->v[j]>U[b]) {
+			b++;
+		}
+		error = fabs(V->v[j] - S[b]);
+		st->sumerror += (V->w[j] - (j ? V->w[j-1] : 0)) * error;
+		st->sumsqerror += (V->w[j] - (j ? V->w[j-1] : 0)) *
+			error*error;
+	}
+
+	st->bits += entropy(C, num_bins) * V->n;
+	st->nF += V->n;
+}
+
+/* bin, print, and write the table for one view */
+void
+view_bins(const kll_view *V, size_t *C, size_t num_bins, size_t bintype,
+		bin_stats *st, FILE *fb) {
+	float *U = malloc(num_bins*sizeof(*U));
+	float *S = malloc(num_bins*sizeof(*S));
+
+	assert(U && S);
+	view_funcs[bintype](C, num_bins, V);
+	view_table(C, num_bins, V, U, S);
+	print_view_bins(C, num_bins, V, U, S, st);
+	write_table(C, num_bins, U, S, fb);
+	free(U);
+	free(S);
+}
+
+/* read the header of the FAISS flat index in fi, for its dimension and
+   number of vectors, with the checks that faiss2simple makes (see
+   flat_index.hpp), leaving fi at the first float; what names the index
+   in any complaint
+*/
+void
+read_flat_header(FILE *fi, const char *what, size_t *dim,
+		size_t *num_vecs) {
+	char head[HEADER];
+	int32_t d;
+	int64_t ntotal;
+	size_t count;
+	off_t len;
+
+	if (fread(head, sizeof(*head), HEADER, fi) != HEADER) {
+		read_error();
+	}
+	memcpy(&d, head+4, sizeof(d));
+	memcpy(&ntotal, head+8, sizeof(ntotal));
+	count = header_count(head);
+	if (memcmp(head, "IxF", 3) != 0 || d <= 0 || ntotal < 0 ||
+			count != (size_t)d*(size_t)ntotal) {
+		fprintf(stderr, "%s is not a FAISS flat index\n", what);
+		exit(EXIT_FAILURE);
+	}
+	if (fseeko(fi, 0, SEEK_END) != 0 || (len=ftello(fi)) < 0 ||
+			(size_t)len < HEADER + count*sizeof(float) ||
+			fseeko(fi, HEADER, SEEK_SET) != 0) {
+		fprintf(stderr, "%s is cut short\n", what);
+		exit(EXIT_FAILURE);
+	}
+	*dim = d;
+	*num_vecs = ntotal;
+}
+
+/* and for one sketch */
+void
+sketch_bins(const kll_sketch *sk, size_t *C, size_t num_bins,
+		size_t bintype, bin_stats *st, FILE *fb) {
+	kll_view V;
+
+	kll_make_view(sk, &V);
+	view_bins(&V, C, num_bins, bintype, st, fb);
+	kll_free_view(&V);
+}
+
+/* quantize -s: one pass over the FAISS flat index in fi, into a sketch
+   for every column if there are to be groups, or one for them all
+*/
+void
+quantize_sketch(FILE *fi, FILE *fb, size_t num_bins, size_t bintype,
+		size_t ngroups, int by_column, double eps) {
+	size_t ncols, nrows, nsk, k, n, v, i, j, g, cols, items=0;
+	kll_sketch *sk, merged;
+	uint32_t *group;
+	col_spread *cs;
+	size_t *C;
+	float *F;
+
+	read_flat_header(fi, "input", &ncols, &nrows);
+	if (by_column) {
+		ngroups = ncols;
+	}
+	if (ngroups > ncols) {
+		fprintf(stderr, "cannot have more groups than columns\n");
+		exit(EXIT_FAILURE);
+	}
+	if (eps <= 0) {
+		eps = 1.0/(SKETCH_BIN_ERROR*num_bins);
+	}
+	k = kll_k_for_error(eps);
+	nsk = ngroups ? ncols : 1;
+	sk = malloc(nsk*sizeof(*sk));
+	C = malloc(num_bins*sizeof(*C));
+	F = malloc(CHUNK_VECS*ncols*sizeof(*F));
+	assert(sk && C && F);
+	for (j=0; j<nsk; j++) {
+		kll_init(sk+j, k, num_bins, j+1);
+	}
+
+	/* the only pass over the floats */
+	value_stats vs = {1e20, 1e-20, 0, 0, 0};
+	for (v=0; v<nrows; v+=n) {
+		n = nrows-v < CHUNK_VECS ? nrows-v : CHUNK_VECS;
+		if (fread(F, sizeof(*F), n*ncols, fi) != n*ncols) {
+			read_error();
+		}
+		count_values(F, n*ncols, &vs);
+		if (nsk == 1) {
+			for (i=0; i<n*ncols; i++) {
+				kll_add(sk, F[i]);
+			}
+		} else {
+			for (i=0; i<n; i++) {
+				for (j=0; j<ncols; j++) {
+					kll_add(sk+j, F[i*ncols+j]);
+				}
+			}
+		}
+	}
+	free(F);
+	for (j=0; j<nsk; j++) {
+		items += sk[j].held;
+	}
+	report_values(ncols, nrows, num_bins, &vs);
+	fprintf(stderr, "sketch k     = %lu, rank error %.3g of the "
+		"values (99%%)\n", k, kll_error(k));
+	fprintf(stderr, "sketches     = %lu, %lu items in all\n", nsk, items);
+	fprintf(stderr, "\n");
+
+	bin_stats st = {0};
+	if (!ngroups) {
+		sketch_bins(sk, C, num_bins, bintype, &st, fb);
+		report_stats(&st);
+		kll_free(sk);
+		free(sk);
+		free(C);
+		return;
+	}
+
+	/* or a table per group, the group's column sketches merged */
+	group = malloc(ncols*sizeof(*group));
+	assert(group);
+	if (by_column) {
+		for (j=0; j<ncols; j++) {
+			group[j] = j;
+		}
+	} else {
+		cs = malloc(ncols*sizeof(*cs));
+		assert(cs);
+		for (j=0; j<ncols; j++) {
+			cs[j].sd = sqrt(fmax(0.0, sk[j].sumsq/nrows -
+				(sk[j].sum/nrows)*(sk[j].sum/nrows)));
+			cs[j].col = j;
+		}
+		assign_groups(cs, ncols, ngroups, group);
+		free(cs);
+	}
+	write_set_header(ncols, ngroups, group, fb);
+	for (g=0; g<ngroups; g++) {
+		kll_init(&merged, k, num_bins, g+1);
+		for (cols=0, j=0; j<ncols; j++) {
+			if (group[j] == g) {
+				kll_merge(&merged, sk+j);
+				cols++;
+			}
+		}
+		printf("group %lu, %lu columns\n", g, cols);
+		sketch_bins(&merged, C, num_bins, bintype, &st, fb);
+		kll_free(&merged);
+	}
+	fprintf(stderr, "%lu groups of columns, each with its own bins\n",
+		ngroups);
+	report_stats(&st);
+	for (j=0; j<nsk; j++) {
+		kll_free(sk+j);
+	}
+	free(sk);
+	free(group);
+	free(C);
+}
+
+/* the number of floats in m runs, and the values stats for them */
+size_t
+count_runs(const float_run *runs, size_t m, value_stats *vs) {
+	size_t i, n=0;
+
+	for (i=0; i<m; i++) {
+		if (fabs(runs[i].v) < vs->minmag) {
+			vs->minmag = fabs(runs[i].v);
+		}
+		if (fabs(runs[i].v) > vs->maxmag) {
+			vs->maxmag = fabs(runs[i].v);
+		}
+		if (runs[i].v < 0.0) {
+			vs->num_neg += runs[i].count;
+		} else if (runs[i].v > 0.0) {
+			vs->num_pos += runs[i].count;
+		} else {
+			vs->num_zero += runs[i].count;
+		}
+		if (i && runs[i].v < runs[i-1].v) {
+			fprintf(stderr, "input is not sorted\n");
+			exit(EXIT_FAILURE);
+		}
+		n += runs[i].count;
+	}
+	return n;
+}
+
+int
+cmp_run(const void *x1, const void *x2) {
+	const float_run *r1=x1, *r2=x2;
+	if (r1->v<r2->v) return -1;
+	if (r1->v>r2->v) return +1;
+	return 0;
+}
+
+/* a run-length sidx file, from faiss2simple -r, gives the same bins as
+   the plain one, but from an exact view of its runs (see kll.c), in
+   memory that grows with the number of distinct floats rather than with
+   all of them; the magic number has already been read from fi
+*/
+void
+quantize_runs(FILE *fi, FILE *fb, size_t num_bins, size_t bintype,
+		size_t ngroups, int by_column) {
+	size_t ncols, nrows, nsets, total=0, n, j, g, cols;
+	size_t *nruns, *C;
+	float_run **runs, *G;
+	double sum, sumsq;
+	uint32_t *group;
+	col_spread *cs;
+	kll_view V;
+
+	if (fread(&ncols, sizeof(size_t), 1, fi) != 1 ||
+		fread(&nrows, sizeof(size_t), 1, fi) != 1 ||
+		fread(&nsets, sizeof(size_t), 1, fi) != 1) {
+		read_error();
+	}
+	if (by_column) {
+		ngroups = ncols;
+	}
+	if (ngroups > ncols) {
+		fprintf(stderr, "cannot have more groups than columns\n");
+		exit(EXIT_FAILURE);
+	}
+	if (ngroups && nsets != ncols) {
+		fprintf(stderr, "input is not sorted by dimension, see "
+			"faiss2simple -d\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!ngroups && nsets != 1) {
+		fprintf(stderr, "input is sorted by dimension, not as a "
+			"whole\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* the runs of each set, each set all the floats of its column */
+	nruns = malloc(nsets*sizeof(*nruns));
+	runs = malloc(nsets*sizeof(*runs));
+	C = malloc(num_bins*sizeof(*C));
+	assert(nruns && runs && C);
+	value_stats vs = {1e20, 1e-20, 0, 0, 0};
+	for (j=0; j<nsets; j++) {
+		if (fread(nruns+j, sizeof(size_t), 1, fi) != 1) {
+			read_error();
+		}
+		runs[j] = malloc((nruns[j] ? nruns[j] : 1)*sizeof(**runs));
+		assert(runs[j]);
+		if (fread(runs[j], sizeof(**runs), nruns[j], fi) != nruns[j]) {
+			read_error();
+		}
+		n = count_runs(runs[j], nruns[j], &vs);
+		if (n != ncols*nrows/nsets) {
+			fprintf(stderr, "runs of set %lu hold %lu floats, not "
+				"%lu\n", j, n, ncols*nrows/nsets);
+			exit(EXIT_FAILURE);
+		}
+		total += nruns[j];
+	}
+	report_values(ncols, nrows, num_bins, &vs);
+	fprintf(stderr, "float runs   = %lu, %.2f values each\n", total,
+		total ? (double)ncols*nrows/total : 0);
+	fprintf(stderr, "\n");
+
+	bin_stats st = {0};
+	if (!ngroups) {
+		kll_make_run_view(runs[0], nruns[0], &V);
+		view_bins(&V, C, num_bins, bintype, &st, fb);
+		kll_free_view(&V);
+		report_stats(&st);
+		free(runs[0]);
+		free(runs);
+		free(nruns);
+		free(C);
+		return;
+	}
+
+	/* or a table per group, the group's columns' runs sorted together */
+	group = malloc(ncols*sizeof(*group));
+	assert(group);
+	if (by_column) {
+		for (j=0; j<ncols; j++) {
+			group[j] = j;
+		}
+	} else {
+		cs = malloc(ncols*sizeof(*cs));
+		assert(cs);
+		for (j=0; j<ncols; j++) {
+			sum = sumsq = 0.0;
+			for (n=0; n<nruns[j]; n++) {
+				sum += (double)runs[j][n].count*runs[j][n].v;
+				sumsq += (double)runs[j][n].count*runs[j][n].v*
+					runs[j][n].v;
+			}
+			cs[j].sd = sqrt(fmax(0.0, sumsq/nrows -
+				(sum/nrows)*(sum/nrows)));
+			cs[j].col = j;
+		}
+		assign_groups(cs, ncols, ngroups, group);
+		free(cs);
+	}
+	write_set_header(ncols, ngroups, group, fb);
+	for (g=0; g<ngroups; g++) {
+		for (n=0, j=0; j<ncols; j++) {
+			n += group[j]==g ? nruns[j] : 0;
+		}
+		G = malloc((n ? n : 1)*sizeof(*G));
+		assert(G);
+		for (n=0, cols=0, j=0; j<ncols; j++) {
+			if (group[j] == g) {
+				memcpy(G+n, runs[j], nruns[j]*sizeof(*G));
+				n += nruns[j];
+				cols++;
+			}
+		}
+		if (cols > 1) {
+			qsort(G, n, sizeof(*G), cmp_run);
+		}
+		printf("group %lu, %lu columns\n", g, cols);
+		kll_make_run_view(G, n, &V);
+		view_bins(&V, C, num_bins, bintype, &st, fb);
+		kll_free_view(&V);
+		free(G);
+	}
+	fprintf(stderr, "%lu groups of columns, each with its own bins\n",
+		ngroups);
+	report_stats(&st);
+	for (j=0; j<nsets; j++) {
+		free(runs[j]);
+	}
+	free(runs);
+	free(nruns);
+	free(group);
+	free(C);
+}
+
+/* -c: the bins were built from a sample, so count the floats of the full
+   index in fi into them, a chunk of vectors at a time, and write the
+   bins file again with those counts, each bin's representative now the
+   average of its floats in the full index; and report how far off the
+   sample's counts were, as the worst gap between the fractions of the
+   floats that the sample and the full index put below a boundary, and
+   as bits per float
+*/
+void
+recount_bins(const char *bins_name, FILE *fi) {
+	model_set ms;
+	const bin_model *m;
+	size_t dim, num_vecs, n, nF, v, i, k, b, col;
+	size_t **cnt;
+	double **sum, err, worst=0, worst_bins=0, bits_s=0, bits_f=0;
+	double sample_ent=0;
+	uint64_t full=0, sample, total, below_s, below_f;
+	uint32_t *syms;
+	float *F, *S;
+	FILE *fb;
+
+	if ((fb=fopen(bins_name, "r")) == NULL || !read_model_set(&ms, fb)) {
+		fprintf(stderr, "unable to read back %s\n", bins_name);
+		exit(EXIT_FAILURE);
+	}
+	read_flat_header(fi, "full index", &dim, &num_vecs);
+	if (ms.dim && ms.dim != dim) {
+		fprintf(stderr, "full index has vectors of %lu floats, not "
+			"%lu\n", dim, ms.dim);
+		exit(EXIT_FAILURE);
+	}
+
+	cnt = malloc(ms.num_models*sizeof(*cnt));
+	sum = malloc(ms.num_models*sizeof(*sum));
+	assert(cnt && sum);
+	for (k=0; k<ms.num_models; k++) {
+		cnt[k] = calloc(ms.models[k].num_bins, sizeof(**cnt));
+		sum[k] = calloc(ms.models[k].num_bins, sizeof(**sum));
+		assert(cnt[k] && sum[k]);
+	}
+	F = malloc(CHUNK_VECS*dim*sizeof(*F));
+	syms = malloc(CHUNK_VECS*dim*sizeof(*syms));
+	assert(F && syms);
+	for (v=0; v<num_vecs; v+=n) {
+		n = num_vecs-v < CHUNK_VECS ? num_vecs-v : CHUNK_VECS;
+		nF = n*dim;
+		if (fread(F, sizeof(*F), nF, fi) != nF) {
+			read_error();
+		}
+		set_floats_to_bins(&ms, 0, F, nF, syms);
+		for (i=0, col=0; i<nF; i++) {
+			k = ms.dim ? ms.col_model[col] : 0;
+			cnt[k][syms[i]]++;
+			sum[k][syms[i]] += F[i];
+			col = col+1==dim ? 0 : col+1;
+		}
+		full += nF;
+	}
+	free(F);
+	free(syms);
+
+	/* compare, and write the tables again */
+	sample = model_set_total(&ms);
+	if ((fb=fopen(bins_name, "w")) == NULL) {
+		fprintf(stderr, "unable to open %s\n", bins_name);
+		exit(EXIT_FAILURE);
+	}
+	if (ms.dim) {
+		write_set_header(ms.dim, ms.num_models, ms.col_model, fb);
+	}
+	for (k=0; k<ms.num_models; k++) {
+		m = ms.models+k;
+		S = malloc(m->num_bins*sizeof(*S));
+		assert(S);
+		for (total=0, b=0; b<m->num_bins; b++) {
+			total += cnt[k][b];
+		}
+		for (below_s=below_f=0, b=0; b<m->num_bins; b++) {
+			n = m->c[b] - (b ? m->c[b-1] : 0);
+			below_s += n;
+			below_f += cnt[k][b];
+			err = fabs((double)below_s/m->total -
+				(total ? (double)below_f/total : 0));
+			if (err > worst) {
+				worst = err;
+				worst_bins = err*m->num_bins;
+			}
+			if (n) {
+				sample_ent -= n*log2((double)n/m->total);
+			}
+			if (cnt[k][b]) {
+				bits_s -= cnt[k][b]*log2((double)n/m->total);
+			}
+			S[b] = cnt[k][b] ? sum[k][b]/cnt[k][b] : m->S[b];
+		}
+		bits_f += entropy(cnt[k], m->num_bins)*below_f;
+		write_table(cnt[k], m->num_bins, m->U, S, fb);
+		free(S);
+		free(cnt[k]);
+		free(sum[k]);
+	}
+	if (fclose(fb) != 0) {
+		fprintf(stderr, "unable to write %s\n", bins_name);
+		exit(EXIT_FAILURE);
+	}
+	free(cnt);
+	free(sum);
+
+	fprintf(stderr, "recounted    = %lu values of the full index, "
+		"%.1f times the sample\n", full, (double)full/sample);
+	fprintf(stderr, "entropy      = %.4f bits per bin id from the sample,"
+		" %.4f over the full index\n", sample_ent/sample,
+		full ? bits_f/full : 0);
+	fprintf(stderr, "coding cost  = %.4f bits per value with the "
+		"sample's counts, %.4f recounted\n", full ? bits_s/full : 0,
+		full ? bits_f/full : 0);
+	fprintf(stderr, "boundary err = %.6f of the values, %.3f of an "
+		"average bin\n", worst, worst_bins);
+	fprintf(stderr, "\n");
+	free_model_set(&ms);
+}
+
+/* all the bins are written; close up, and recount them over the full
+   index if there is one */
+int
+finish(FILE *fi, FILE *fb, const char *bins_name, const char *full_name) {
+	FILE *ff;
+
+	fclose(fi);
+	if (fclose(fb) != 0) {
+		fprintf(stderr, "unable to write %s\n", bins_name);
+		exit(EXIT_FAILURE);
+	}
+	if (full_name) {
+		if ((ff = fopen(full_name, "r")) == NULL) {
+			fprintf(stderr, "unable to open %s\n", full_name);
+			exit(EXIT_FAILURE);
+		}
+		recount_bins(bins_name, ff);
+		fclose(ff);
+	}
+	return 0;
 }
 
 int
@@ -341,14 +1171,58 @@ main(int argc, char *argv[]) {
 	size_t bintype;
 	size_t ncols;
 	size_t nrows;
+	size_t ngroups=0;	// 0 for one set of bins for all columns
+	int by_column=0;
+	int sketch=0;
+	double eps=0;		// -s rank error, 0 for the default
+	char *full=NULL;	// -c, full index to count the bins over
+	int nthreads=0;		// -t, 0 for one per core
+	int opt, bad=0;
 
 	FILE *fi, *fb;
 
-	if (argc!=5) {
-		fprintf(stderr, "Usage: %s nbins bintype sidx-file bins-file\n",
+	while ((opt=getopt(argc, argv, "dk:se:c:t:")) != -1) {
+		switch (opt) {
+		case 'd':
+			by_column = 1;
+			break;
+		case 'k':
+			ngroups = atol(optarg);
+			bad |= ngroups<1;
+			break;
+		case 's':
+			sketch = 1;
+			break;
+		case 'e':
+			eps = atof(optarg);
+			bad |= eps<=0 || eps>=1;
+			break;
+		case 'c':
+			full = optarg;
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			bad |= nthreads<1;
+			break;
+		default:
+			bad = 1;
+		}
+	}
+	if (bad || argc-optind!=4 || (by_column && ngroups) ||
+		(eps && !sketch)) {
+		fprintf(stderr, "Usage: %s [-d | -k groups] [-c full-index] "
+			"[-t threads] nbins bintype sidx-file bins-file\n",
 			argv[0]);
+		fprintf(stderr, "       %s -s [-e error] [-d | -k groups] "
+			"[-c full-index] nbins bintype index-file "
+			"bins-file\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
+	argv += optind-1;
+	if (!nthreads) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = n>0 ? n : 1;
+	}
 
 	/* pick up and check the four parameters */
 	num_bins = atoi(argv[1]);
@@ -377,11 +1251,21 @@ main(int argc, char *argv[]) {
 		labels[bintype], bintype);
 	fprintf(stderr, "forming %lu bins\n", num_bins);
 
-	/* fetch metadata from input */
+	if (sketch) {
+		quantize_sketch(fi, fb, num_bins, bintype, ngroups, by_column,
+			eps);
+		return finish(fi, fb, argv[4], full);
+	}
+
+	/* fetch metadata from input, which might be runs of floats */
 	if (fread(&ncols, sizeof(size_t), 1, fi) != 1) {
  		fprintf(stderr, "fread() failure\n");
 		exit(EXIT_FAILURE);
   }
+	if (ncols == SIDX_RUNS_MAGIC) {
+		quantize_runs(fi, fb, num_bins, bintype, ngroups, by_column);
+		return finish(fi, fb, argv[4], full);
+	}
 	if (fread(&nrows, sizeof(size_t), 1, fi) != 1) {
  		fprintf(stderr, "fread() failure\n");
 		exit(EXIT_FAILURE);
@@ -400,51 +1284,35 @@ main(int argc, char *argv[]) {
 	}
 
 
-	float minmag=1e20;
-	float maxmag=1e-20;
-	size_t num_zero=0;
-	size_t num_neg=0;
-	size_t num_pos=0;
-
-	for (int i=0; i<nF; i++) {
-		if (fabs(F[i]) < minmag) {
-			minmag = fabs(F[i]);
-		}
-		if (fabs(F[i]) > maxmag) {
-			maxmag = fabs(F[i]);
-		}
-		if (F[i] < 0.0) {
-			num_neg++;
-		} else if (F[i]>0.0) {
-			num_pos++;
-		} else {
-			num_zero++;
-		}
-	}
-
-	/* put some stats to stderr */
-	fprintf(stderr, "\n");
-	fprintf(stderr, "data columns = %lu\n", ncols);
-	fprintf(stderr, "data rows    = %lu\n", nrows);
-	fprintf(stderr, "total vals   = %lu\n", nF);
-	fprintf(stderr, "bin count    = %lu\n", num_bins);
-	fprintf(stderr, "average bin  = %lu values\n", nF/num_bins);
-	fprintf(stderr, "\n");
-
-	fprintf(stderr, "smallest mag = %.7g\n", minmag);
-	fprintf(stderr, "biggest mag  = %.7g\n", maxmag);
-	fprintf(stderr, "number neg   = %lu\n", num_neg);
-	fprintf(stderr, "number zero  = %lu\n", num_zero);
-	fprintf(stderr, "number pos   = %lu\n", num_pos);
-	fprintf(stderr, "\n");
-
 #if 0
 	/* index floats data is now assumed to be sorted upon arrival */
 	qsort(F, nF, sizeof(float), cmp);
 #endif
-	/* but no harm done to check */
-	for (int i=0; i<nF-1; i++) {
-		assert(F[i] <= F[i+1]);
+	/* but no harm done to check, in the one pass over the floats that
+	   also counts them and builds their running sums; sorted a column
+	   at a time, if the columns are to be binned separately */
+	if (by_column) {
+		ngroups = ncols;
+	}
+	if (ngroups > ncols) {
+		fprintf(stderr, "cannot have more groups than columns\n");
+		exit(EXIT_FAILURE);
+	}
+	prefix_sums P;
+	value_stats vs = {1e20, 1e-20, 0, 0, 0};
+	prefix_build(&P, F, nF, ngroups ? nrows : nF, &vs, nthreads);
+	report_values(ncols, nrows, num_bins, &vs);
+	if (P.misplaced) {
+		fprintf(stderr, "input is not sorted%s\n", ngroups ?
+			" by dimension, see faiss2simple -d" : "");
+		exit(EXIT_FAILURE);
+	}
+	/* a fully sorted input would pass as well, but then the columns
+	   are not columns at all */
+	if (ngroups && ncols>1 && P.descents==0) {
+		fprintf(stderr, "input is sorted as a whole, not by "
+			"dimension, see faiss2simple -d\n");
+		exit(EXIT_FAILURE);
 	}
 
 #if 0
@@ -458,11 +1326,44 @@ main(int argc, char *argv[]) {
 
 	/* and now get on and do the work via the selected matching
 	   function */
-	bin_funcs[bintype](C, num_bins, F, nF);
-	print_bins(C, num_bins, F, nF);
-	write_bins(C, num_bins, F, nF, fb);
-	fclose(fi);
-	fclose(fb);
+	bin_stats st = {0};
+	if (!ngroups) {
+		sorted_bins(&P, C, num_bins, bintype, &st, fb);
+		report_stats(&st);
+		return finish(fi, fb, argv[4], full);
+	}
 
-	return 0;
+	/* or once for each group of columns, with the group's columns
+	   merged into one sorted run first */
+	uint32_t *group = malloc(ncols*sizeof(*group));
+	float *G = malloc(nF*sizeof(*G)), *H = malloc(nF*sizeof(*H)), *R;
+	prefix_sums PG;
+	size_t g, j, nG;
+	assert(group && G && H);
+	if (by_column) {
+		for (j=0; j<ncols; j++) {
+			group[j] = j;
+		}
+	} else {
+		group_columns(&P, ncols, nrows, ngroups, group);
+	}
+	write_set_header(ncols, ngroups, group, fb);
+	for (g=0; g<ngroups; g++) {
+		for (nG=0, j=0; j<ncols; j++) {
+			if (group[j] == g) {
+				memcpy(G+nG, F+j*nrows, nrows*sizeof(*G));
+				nG += nrows;
+			}
+		}
+		R = merge_runs(G, H, nG, nrows);
+		printf("group %lu, %lu columns\n", g, nG/nrows);
+		prefix_build(&PG, R, nG, nG, NULL, nthreads);
+		sorted_bins(&PG, C, num_bins, bintype, &st, fb);
+		prefix_free(&PG);
+	}
+	fprintf(stderr, "%lu groups of columns, each with its own bins\n",
+		ngroups);
+	report_stats(&st);
+
+	return finish(fi, fb, argv[4], full);
 }
@@ -0,0 +1,159 @@
+// A parallel LSD radix sort for floats, the sort behind the sidx files
+// that faiss2simple and sort write.
+//
+// Floats sort as unsigned integers once their bits are mapped to keep
+// their order: the sign bit flipped for positive floats, every bit
+// flipped for negative ones. Four stable passes then sort on a byte of
+// that key each, least significant byte first, moving the floats back
+// and forth between the data and a scratch array of the same size.
+//
+// In each pass the floats are cut into one slice per thread. Every
+// thread counts the bytes of its own slice, and the counts give each
+// thread its own place to start for each byte value, after all the
+// threads before it; each thread then moves its slice. A thread moves
+// floats through a buffer of one cache line per byte value, so memory
+// is written a whole line at a time rather than a float at a time to
+// 256 places at once. The buffers belong to their thread, which touches
+// them first, so they sit on its own NUMA node. A pass is skipped when
+// all the floats have the same byte there.
+//
+// The sort is stable on the keys, so -0.0 comes before 0.0, and NaNs
+// go to the ends, by sign; otherwise the order is that of std::sort.
+
+#ifndef RADIX_SORT_HPP
+#define RADIX_SORT_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+class radix_sorter {
+
+  public:
+    // threads of 0 means one per core
+    explicit radix_sorter(unsigned threads = 0)
+      : m_threads(threads ? threads : std::max(1u, std::thread::hardware_concurrency())) {}
+
+    // Sorts data[0..n-1], with scratch[0..n-1] as the other array
+    void sort(float *data, size_t n, float *scratch) const {
+      size_t threads = std::min<size_t>(m_threads, std::max<size_t>(n / MIN_SLICE, 1));
+      std::vector<counts> count(threads);
+      float *from = data, *to = scratch;
+
+      for (unsigned shift = 0; shift < 32; shift += 8) {
+        run(threads, [&](size_t t) {
+          count_slice(from, slice_begin(n, threads, t), slice_begin(n, threads, t + 1),
+                      shift, count[t]);
+        });
+
+        // Where each thread puts each byte value, in byte then thread order
+        size_t offset = 0;
+        bool skip = false;
+        for (size_t b = 0; b < 256; ++b) {
+          for (size_t t = 0; t < threads; ++t) {
+            size_t c = count[t][b];
+            skip |= c == n;
+            count[t][b] = offset;
+            offset += c;
+          }
+        }
+        if (skip) {
+          continue;
+        }
+
+        run(threads, [&](size_t t) {
+          scatter_slice(from, to, slice_begin(n, threads, t), slice_begin(n, threads, t + 1),
+                        shift, count[t]);
+        });
+        std::swap(from, to);
+      }
+
+      // An odd number of passes leaves the floats in the scratch array
+      if (from != data) {
+        run(threads, [&](size_t t) {
+          size_t first = slice_begin(n, threads, t);
+          std::memcpy(data + first, from + first,
+                      (slice_begin(n, threads, t + 1) - first) * sizeof(float));
+        });
+      }
+    }
+
+    // Sorts data[0..n-1], with scratch of its own
+    void sort(float *data, size_t n) const {
+      std::unique_ptr<float[]> scratch(new float[n]);
+      sort(data, n, scratch.get());
+    }
+
+    // The order-keeping key of a float
+    static uint32_t key(float f) {
+      uint32_t u;
+      std::memcpy(&u, &f, sizeof(u));
+      return u ^ (uint32_t(int32_t(u) >> 31) | 0x80000000u);
+    }
+
+  private:
+    using counts = std::array<size_t, 256>;
+
+    static size_t slice_begin(size_t n, size_t threads, size_t t) {
+      return n / threads * t + std::min(t, n % threads);
+    }
+
+    template <typename F>
+    static void run(size_t threads, F work) {
+      std::vector<std::thread> pool;
+      for (size_t t = 1; t < threads; ++t) {
+        pool.emplace_back(work, t);
+      }
+      work(0);
+      for (auto& th : pool) {
+        th.join();
+      }
+    }
+
+    static void count_slice(const float *from, size_t first, size_t last, unsigned shift,
+                            counts& count) {
+      count.fill(0);
+      for (size_t i = first; i < last; ++i) {
+        count[(key(from[i]) >> shift) & 0xff]++;
+      }
+    }
+
+    // Moves from[first..last-1] to their places in to, starting from
+    // offset, through a line of buffer for each byte value
+    static void scatter_slice(const float *from, float *to, size_t first, size_t last,
+                              unsigned shift, counts& offset) {
+      struct alignas(64) line {
+        float f[LINE_FLOATS];
+      };
+      std::unique_ptr<line[]> buf(new line[256]);
+      std::array<uint8_t, 256> fill{};
+
+      for (size_t i = first; i < last; ++i) {
+        float f = from[i];
+        unsigned b = (key(f) >> shift) & 0xff;
+        buf[b].f[fill[b]++] = f;
+        if (fill[b] == LINE_FLOATS) {
+          std::memcpy(to + offset[b], buf[b].f, sizeof(line));
+          offset[b] += LINE_FLOATS;
+          fill[b] = 0;
+        }
+      }
+      for (unsigned b = 0; b < 256; ++b) {
+        std::memcpy(to + offset[b], buf[b].f, fill[b] * sizeof(float));
+        offset[b] += fill[b];
+      }
+    }
+
+    // Floats in a cache line
+    static constexpr size_t LINE_FLOATS = 64 / sizeof(float);
+    // No thread is given fewer floats than this
+    static constexpr size_t MIN_SLICE = 1 << 16;
+
+    unsigned m_threads;
+};
+
+#endif
@@ -0,0 +1,258 @@
+/* A table-driven rANS coder, as an alternative to the arithmetic coder
+   in helpers.c. The bin frequencies are normalised so that they add up to
+   2^scale_bits, and then each symbol is decoded with a table lookup, a
+   multiply, and a shift, with no division and no search.
+
+   The state is 32 bits, and renormalisation is a byte at a time, after
+   Fabian Giesen's rans_byte.h. Because rANS is last-in first-out, each
+   block is coded backwards from its last symbol, so that the decoder can
+   run forwards.
+
+   The tables are built from a set of bin models for one scale, and are
+   kept in their own struct, so that files coded at different scales can
+   be open at the same time. With more than one table in the set, the
+   bins of all of them are numbered as one alphabet of symbols, and each
+   table gets its own 2^scale_bits slots; the column of each float then
+   says where its table's symbols and slots start. Needs helpers.c to
+   have been included first.
+*/
+
+#include <string.h>
+
+#define RANS_MIN_SCALE 12
+#define RANS_MAX_SCALE 16
+#define RANS_DEFAULT_SCALE 14
+
+#define RANS_L (1u<<23)		// lower bound of the normalised state
+#define RANS_MAX_SLOTS (1u<<30)	// over all of the tables
+
+typedef struct {
+	const model_set *ms;	// the models they were built from
+	uint32_t scale;		// log2 of the normalised total
+	uint32_t *freq;		// normalised frequency of each symbol
+	uint32_t *cum;		// and the cumulative frequency before it
+	float *val;		// and the float it decodes to
+	uint16_t *sym;		// which bin each slot of each table is
+
+	/* where the symbols and the slots of the table of each column
+	   start, repeated to fill a multiple of sixteen columns, for the
+	   interleaved coder */
+	size_t period;
+	uint32_t *col_sym;
+	uint32_t *col_slot;
+
+	/* and the slot tables of the interleaved coder, see ransx16.c */
+	uint32_t *x16_entry;	// packed freq and offset for each slot
+	float *x16_float;	// and the float that slot decodes to
+	int32_t (*x16_perm)[8];	// AVX2 word placement for each lane mask
+} rans_tables;
+
+/* whether tables can be made for ms at this scale */
+int
+rans_scale_ok(const model_set *ms, uint32_t scale_bits) {
+	size_t k;
+	if (scale_bits<RANS_MIN_SCALE || scale_bits>RANS_MAX_SCALE ||
+			ms->num_models > RANS_MAX_SLOTS>>scale_bits) {
+		return 0;
+	}
+	for (k=0; k<ms->num_models; k++) {
+		if (ms->models[k].num_bins >= (1ULL<<scale_bits)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* normalise the counts c[] of bin model m to add to M, with every bin
+   getting at least one slot, so that any float can be coded even if the
+   counts say it never happens
+*/
+static void
+rans_normalise(const bin_model *m, uint32_t M, uint32_t *freq,
+		uint32_t *cum, uint16_t *sym) {
+	uint64_t sum=0, prev=0;
+	size_t i, big=0, num_bins=m->num_bins;
+
+	for (i=0; i<num_bins; i++) {
+		freq[i] = (uint32_t)(((double)(m->c[i]-prev))*M/m->total + 0.5);
+		if (freq[i]==0) {
+			freq[i] = 1;
+		}
+		prev = m->c[i];
+		sum += freq[i];
+		if (freq[i] > freq[big]) {
+			big = i;
+		}
+	}
+
+	/* and then any rounding error is absorbed by the bins that can best
+	   afford it, the biggest first */
+	while (sum != M) {
+		if (sum > M) {
+			/* take from the biggest, but never down to zero */
+			for (big=0, i=1; i<num_bins; i++) {
+				if (freq[i] > freq[big]) big = i;
+			}
+			assert(freq[big]>1);
+			freq[big]--;
+			sum--;
+		} else {
+			freq[big]++;
+			sum++;
+		}
+	}
+
+	for (sum=0, i=0; i<num_bins; i++) {
+		cum[i] = sum;
+		for (prev=0; prev<freq[i]; prev++) {
+			sym[sum+prev] = i;
+		}
+		sum += freq[i];
+	}
+}
+
+/* build the tables for every model in ms. Returns zero, with nothing
+   allocated, if the scale is out of range or there are too many bins
+*/
+int
+rans_make_tables(rans_tables *rt, const model_set *ms, uint32_t scale_bits) {
+	uint32_t M = 1u<<scale_bits, *first;
+	size_t k, j, num_syms=0, dim = ms->dim ? ms->dim : 1;
+
+	memset(rt, 0, sizeof(*rt));
+	if (!rans_scale_ok(ms, scale_bits)) {
+		return 0;
+	}
+	rt->ms = ms;
+	rt->scale = scale_bits;
+
+	first = malloc(ms->num_models*sizeof(*first));
+	assert(first);
+	for (k=0; k<ms->num_models; k++) {
+		first[k] = num_syms;
+		num_syms += ms->models[k].num_bins;
+	}
+	rt->freq = malloc(num_syms*sizeof(*rt->freq));
+	rt->cum = malloc(num_syms*sizeof(*rt->cum));
+	rt->val = malloc(num_syms*sizeof(*rt->val));
+	rt->sym = malloc(ms->num_models*M*sizeof(*rt->sym));
+	assert(rt->freq && rt->cum && rt->val && rt->sym);
+	for (k=0; k<ms->num_models; k++) {
+		rans_normalise(ms->models+k, M, rt->freq+first[k],
+			rt->cum+first[k], rt->sym+k*M);
+		memcpy(rt->val+first[k], ms->models[k].S,
+			ms->models[k].num_bins*sizeof(*rt->val));
+	}
+
+	/* the smallest multiple of sixteen columns that is also a multiple
+	   of whole vectors */
+	for (rt->period=dim; rt->period%16 != 0; rt->period+=dim) {
+	}
+	rt->col_sym = malloc(rt->period*sizeof(*rt->col_sym));
+	rt->col_slot = malloc(rt->period*sizeof(*rt->col_slot));
+	assert(rt->col_sym && rt->col_slot);
+	for (j=0; j<rt->period; j++) {
+		k = ms->dim ? ms->col_model[j%dim] : 0;
+		rt->col_sym[j] = first[k];
+		rt->col_slot[j] = k*M;
+	}
+	free(first);
+	return 1;
+}
+
+void
+rans_free_tables(rans_tables *rt) {
+	free(rt->freq);
+	free(rt->cum);
+	free(rt->val);
+	free(rt->sym);
+	free(rt->col_sym);
+	free(rt->col_slot);
+	free(rt->x16_entry);
+	free(rt->x16_float);
+	free(rt->x16_perm);
+	memset(rt, 0, sizeof(*rt));
+}
+
+/* entropy of the normalised models, relative to the counts c[], to see
+   how much the normalisation costs; averaged over the columns */
+double
+rans_model_bits(const rans_tables *rt) {
+	const bin_model *m;
+	const uint32_t *freq;
+	double bits, sum=0.0;
+	uint64_t prev;
+	size_t i, j, dim = rt->ms->dim ? rt->ms->dim : 1;
+
+	for (j=0; j<dim; j++) {
+		m = column_model(rt->ms, j);
+		freq = rt->freq + rt->col_sym[j];
+		for (bits=0.0, prev=0, i=0; i<m->num_bins; i++) {
+			bits += (m->c[i]-prev) * (rt->scale - log2(freq[i]));
+			prev = m->c[i];
+		}
+		sum += bits/m->total;
+	}
+	return sum/dim;
+}
+
+/* code the nS bin numbers in syms[], starting at column zero, into a
+   newly allocated buffer, which is returned via *out, and its length via
+   *len
+*/
+void
+rans_encode(const rans_tables *rt, const uint32_t *syms, size_t nS,
+		uint8_t **out, size_t *len) {
+	/* at most two bytes per symbol with scale_bits<=16, plus the state */
+	size_t size = 2*nS + sizeof(uint32_t);
+	uint8_t *buf = malloc(size), *ptr = buf+size;
+	uint32_t x = RANS_L, s, freq, x_max;
+	size_t i, col = nS ? (nS-1) % rt->period : 0;
+
+	assert(buf);
+	for (i=nS; i-- > 0; col = col ? col-1 : rt->period-1) {
+		s = rt->col_sym[col] + syms[i];
+		freq = rt->freq[s];
+		x_max = ((RANS_L >> rt->scale) << 8) * freq;
+		while (x >= x_max) {
+			*--ptr = x & 0xff;
+			x >>= 8;
+		}
+		x = ((x/freq) << rt->scale) + (x%freq) + rt->cum[s];
+	}
+	ptr -= sizeof(uint32_t);
+	ptr[0] = x; ptr[1] = x>>8; ptr[2] = x>>16; ptr[3] = x>>24;
+
+	/* the coded bytes are at the end of buf, move them to the front */
+	*len = buf+size - ptr;
+	memmove(buf, ptr, *len);
+	*out = buf;
+}
+
+/* decode nF floats into F from in[0..len-1] */
+void
+rans_decode(const rans_tables *rt, const uint8_t *in, size_t len, float *F,
+		size_t nF) {
+	const uint8_t *end = in+len;
+	const uint32_t scale = rt->scale, mask = (1u<<scale) - 1;
+	const uint32_t *freq = rt->freq, *cum = rt->cum;
+	const uint16_t *sym = rt->sym;
+	const float *val = rt->val;
+	uint32_t x, s;
+	size_t i, col=0;
+
+	assert(len>=sizeof(uint32_t));
+	x = in[0] | in[1]<<8 | in[2]<<16 | (uint32_t)in[3]<<24;
+	in += sizeof(uint32_t);
+	for (i=0; i<nF; i++) {
+		s = rt->col_sym[col] + sym[rt->col_slot[col] + (x & mask)];
+		F[i] = val[s];
+		x = freq[s] * (x >> scale) + (x & mask) - cum[s];
+		while (x < RANS_L) {
+			x = (x << 8) | (in<end ? *in++ : 0);
+		}
+		if (++col == rt->period) {
+			col = 0;
+		}
+	}
+}
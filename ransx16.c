@@ -0,0 +1,261 @@
+/* rANS with sixteen interleaved coder states, so that the decoder can run
+   all of them at once in the lanes of one AVX-512 register (or two AVX2
+   registers). Symbol i of a block belongs to state i%16. The states are
+   32 bits, kept in [2^16, 2^32), and renormalise by sixteen-bit words;
+   after decoding a symbol a state needs at most one word, and the states
+   that need one take the next words of the stream in lane order.
+
+   Each slot of the normalised frequency table (see rans.c) gets a packed
+   entry, freq | (slot-cum)<<16, so a state update is a gather, a multiply
+   and an add; and a float, S[] of the slot's bin, so that the output is
+   a second gather. With a table for each column (see rans.c), the slots
+   of each lane are offset by where its column's table starts, which is
+   one more load and add per step. The scalar decoder uses the same tables
+   and decodes the same stream; the SIMD decoders hand over to it for a
+   partial last step, and, for AVX2, when close to the end of the block.
+
+   Needs helpers.c, binmap.c (for the instruction set checks) and rans.c
+   to have been included first.
+*/
+
+#include <immintrin.h>
+
+#define RANSX16_LANES 16
+#define RANSX16_L (1u<<16)	// lower bound of the normalised states
+
+int ransx16_isa=-1;		// which decoder to use, best available if -1
+
+typedef struct {
+	uint32_t x[RANSX16_LANES];
+	const uint8_t *ptr, *end;
+} ransx16_state;
+
+/* add the slot tables to the rANS tables */
+int
+ransx16_make_tables(rans_tables *rt) {
+	uint32_t M = 1u<<rt->scale, first=0, slot, s;
+	size_t k, slots = rt->ms->num_models*M;
+	int m, j;
+
+	if (rt->x16_entry) {
+		return 1;
+	}
+	rt->x16_entry = malloc(slots*sizeof(*rt->x16_entry));
+	rt->x16_float = malloc(slots*sizeof(*rt->x16_float));
+	rt->x16_perm = malloc(256*sizeof(*rt->x16_perm));
+	assert(rt->x16_entry && rt->x16_float && rt->x16_perm);
+	for (k=0; k<rt->ms->num_models; k++) {
+		for (slot=0; slot<M; slot++) {
+			s = first + rt->sym[k*M+slot];
+			assert(rt->freq[s] < (1u<<16));
+			rt->x16_entry[k*M+slot] = rt->freq[s] |
+				(slot-rt->cum[s])<<16;
+			rt->x16_float[k*M+slot] = rt->val[s];
+		}
+		first += rt->ms->models[k].num_bins;
+	}
+
+	/* lane j of mask m takes the k'th word, k the number of set lanes
+	   before it */
+	for (m=0; m<256; m++) {
+		for (k=0, j=0; j<8; j++) {
+			rt->x16_perm[m][j] = (m>>j & 1) ? k++ : 0;
+		}
+	}
+
+	if (ransx16_isa<0) {
+		ransx16_isa = best_isa();
+	}
+	return 1;
+}
+
+/* code the nS bin numbers in syms[], starting at column zero, into a
+   newly allocated buffer, which is returned via *out, and its length via
+   *len
+*/
+void
+ransx16_encode(const rans_tables *rt, const uint32_t *syms, size_t nS,
+		uint8_t **out, size_t *len) {
+	/* at most one word per symbol, plus the final states */
+	size_t size = 2*nS + 4*RANSX16_LANES;
+	uint8_t *buf = malloc(size), *ptr = buf+size;
+	uint32_t x[RANSX16_LANES], s, freq;
+	uint64_t x_max;
+	size_t i, j, col = nS ? (nS-1) % rt->period : 0;
+
+	assert(buf);
+	for (j=0; j<RANSX16_LANES; j++) {
+		x[j] = RANSX16_L;
+	}
+
+	/* last symbol first, so the decoder gets them first to last */
+	for (i=nS; i-- > 0; col = col ? col-1 : rt->period-1) {
+		j = i%RANSX16_LANES;
+		s = rt->col_sym[col] + syms[i];
+		freq = rt->freq[s];
+		x_max = ((uint64_t)(RANSX16_L >> rt->scale) << 16) * freq;
+		if (x[j] >= x_max) {
+			ptr -= 2;
+			ptr[0] = x[j]; ptr[1] = x[j]>>8;
+			x[j] >>= 16;
+		}
+		x[j] = ((x[j]/freq) << rt->scale) + (x[j]%freq) +
+			rt->cum[s];
+	}
+	for (j=RANSX16_LANES; j-- > 0; ) {
+		ptr -= 4;
+		ptr[0] = x[j]; ptr[1] = x[j]>>8;
+		ptr[2] = x[j]>>16; ptr[3] = x[j]>>24;
+	}
+
+	*len = buf+size - ptr;
+	memmove(buf, ptr, *len);
+	*out = buf;
+}
+
+/* decode floats i..nF-1 into F, one state at a time */
+static void
+ransx16_decode_scalar(const rans_tables *rt, ransx16_state *st, float *F,
+		size_t i, size_t nF) {
+	const uint32_t scale = rt->scale, mask = (1u<<scale) - 1;
+	uint32_t slot, e, *x;
+	size_t col = i % rt->period;
+
+	for (; i<nF; i++, col = col+1 == rt->period ? 0 : col+1) {
+		x = st->x + i%RANSX16_LANES;
+		slot = rt->col_slot[col] + (*x & mask);
+		e = rt->x16_entry[slot];
+		F[i] = rt->x16_float[slot];
+		*x = (e & 0xffff) * (*x >> scale) + (e >> 16);
+		if (*x < RANSX16_L) {
+			*x <<= 16;
+			if (st->ptr+2 <= st->end) {
+				*x |= st->ptr[0] | st->ptr[1]<<8;
+				st->ptr += 2;
+			}
+		}
+	}
+}
+
+/* decode whole steps of sixteen floats into F, eight lanes at a time,
+   while there are enough bytes left that the word loads cannot run off
+   the end; returns how many floats were decoded
+*/
+__attribute__((target("avx2")))
+static size_t
+ransx16_decode_avx2(const rans_tables *rt, ransx16_state *st, float *F,
+		size_t nF) {
+	const __m256i mask = _mm256_set1_epi32((1u<<rt->scale) - 1);
+	const __m256i lo16 = _mm256_set1_epi32(0xffff);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m128i shift = _mm_cvtsi32_si128(rt->scale);
+	__m256i x[2], slot, e, need, w;
+	size_t i, col=0;
+	int h, m;
+
+	x[0] = _mm256_loadu_si256((__m256i *)st->x);
+	x[1] = _mm256_loadu_si256((__m256i *)(st->x+8));
+	for (i=0; i+RANSX16_LANES<=nF && st->ptr+32<=st->end;
+			i+=RANSX16_LANES) {
+		for (h=0; h<2; h++) {
+			slot = _mm256_add_epi32(_mm256_and_si256(x[h], mask),
+				_mm256_loadu_si256((const __m256i *)
+				(rt->col_slot+col+8*h)));
+			e = _mm256_i32gather_epi32((const int *)rt->x16_entry,
+				slot, 4);
+			_mm256_storeu_ps(F+i+8*h,
+				_mm256_i32gather_ps(rt->x16_float, slot, 4));
+			x[h] = _mm256_add_epi32(
+				_mm256_mullo_epi32(_mm256_and_si256(e, lo16),
+					_mm256_srl_epi32(x[h], shift)),
+				_mm256_srli_epi32(e, 16));
+
+			/* lanes whose top half is now empty take a word */
+			need = _mm256_cmpeq_epi32(_mm256_srli_epi32(x[h], 16),
+				zero);
+			m = _mm256_movemask_ps(_mm256_castsi256_ps(need));
+			w = _mm256_cvtepu16_epi32(
+				_mm_loadu_si128((const __m128i *)st->ptr));
+			w = _mm256_permutevar8x32_epi32(w,
+				_mm256_loadu_si256((__m256i *)rt->x16_perm[m]));
+			x[h] = _mm256_blendv_epi8(x[h],
+				_mm256_or_si256(_mm256_slli_epi32(x[h], 16), w),
+				need);
+			st->ptr += 2*__builtin_popcount(m);
+		}
+		col = col+RANSX16_LANES == rt->period ? 0 :
+			col+RANSX16_LANES;
+	}
+	_mm256_storeu_si256((__m256i *)st->x, x[0]);
+	_mm256_storeu_si256((__m256i *)(st->x+8), x[1]);
+	return i;
+}
+
+/* and all sixteen lanes at once; the masked load only touches the words
+   that are needed, so this can run right to the end of the block
+*/
+__attribute__((target("avx512f,avx512bw,avx512vl")))
+static size_t
+ransx16_decode_avx512(const rans_tables *rt, ransx16_state *st, float *F,
+		size_t nF) {
+	const __m512i mask = _mm512_set1_epi32((1u<<rt->scale) - 1);
+	const __m512i lo16 = _mm512_set1_epi32(0xffff);
+	const __m512i L = _mm512_set1_epi32(RANSX16_L);
+	const __m128i shift = _mm_cvtsi32_si128(rt->scale);
+	__m512i x, slot, e, w;
+	__mmask16 need;
+	size_t i, col=0;
+	int n;
+
+	x = _mm512_loadu_si512(st->x);
+	for (i=0; i+RANSX16_LANES<=nF; i+=RANSX16_LANES) {
+		slot = _mm512_add_epi32(_mm512_and_si512(x, mask),
+			_mm512_loadu_si512(rt->col_slot+col));
+		e = _mm512_i32gather_epi32(slot, rt->x16_entry, 4);
+		_mm512_storeu_ps(F+i, _mm512_i32gather_ps(slot,
+			rt->x16_float, 4));
+		x = _mm512_add_epi32(
+			_mm512_mullo_epi32(_mm512_and_si512(e, lo16),
+				_mm512_srl_epi32(x, shift)),
+			_mm512_srli_epi32(e, 16));
+
+		need = _mm512_cmplt_epu32_mask(x, L);
+		n = __builtin_popcount(need);
+		if (st->ptr + 2*n > st->end) {
+			/* corrupt or truncated, zeros from here on, just
+			   as for the scalar decoder */
+			n = (st->end - st->ptr)/2;
+		}
+		w = _mm512_cvtepu16_epi32(_mm256_maskz_loadu_epi16(
+			(1u<<n) - 1, st->ptr));
+		x = _mm512_mask_or_epi32(x, need, _mm512_slli_epi32(x, 16),
+			_mm512_maskz_expand_epi32(need, w));
+		st->ptr += 2*n;
+		col = col+RANSX16_LANES == rt->period ? 0 :
+			col+RANSX16_LANES;
+	}
+	_mm512_storeu_si512(st->x, x);
+	return i;
+}
+
+/* decode nF floats into F from in[0..len-1] */
+void
+ransx16_decode(const rans_tables *rt, const uint8_t *in, size_t len,
+		float *F, size_t nF) {
+	ransx16_state st;
+	size_t i=0, j;
+
+	assert(len >= 4*RANSX16_LANES);
+	for (j=0; j<RANSX16_LANES; j++, in+=4) {
+		st.x[j] = in[0] | in[1]<<8 | in[2]<<16 | (uint32_t)in[3]<<24;
+	}
+	st.ptr = in;
+	st.end = in + len - 4*RANSX16_LANES;
+
+	if (ransx16_isa == ISA_AVX512) {
+		i = ransx16_decode_avx512(rt, &st, F, nF);
+	} else if (ransx16_isa == ISA_AVX2) {
+		i = ransx16_decode_avx2(rt, &st, F, nF);
+	}
+	ransx16_decode_scalar(rt, &st, F, i, nF);
+}
@@ -0,0 +1,979 @@
+// Inner product search straight over the bin numbers of a quantized
+// index, without turning them back into floats. The index is held in
+// memory as one byte per dimension (two, if some table has more than 256
+// bins), and for each query a table of q[d] * S[b] is built for every
+// dimension d and bin b, so that scoring a vector is just dim lookups and
+// adds. Results go out in the same TREC run format as run-faiss.py.
+//
+// The index can be a compressed one that allows random access (encoder
+// -b, or -c packed), or a plain FAISS flat index, which is quantized as
+// it is read; either way it needs the bins file it goes with. Queries are
+// a text file with a line per query, its id and then its dim floats, as
+// written by export-queries.py.
+//
+// With -e, there is no bins file, and the floats of a FAISS flat index
+// are searched exactly, as run-faiss.py does, but without FAISS. Each
+// thread claims a tile of vectors at a time, small enough to stay in
+// cache while every query of a batch is scored against it, four queries
+// by four vectors at a time with AVX-512 or AVX2 where the machine has
+// them; the threads keep heaps of their own, merged at the end.
+//
+// With -f, and no more than 16 bins in a table, the bin numbers are held
+// four bits a dimension, and each query is first scored approximately,
+// 32 vectors at a time, with byte shuffles into a table quantized to
+// eight bits; the best 2k (or -r) are then rescored as above.
+//
+// With -s, the index must be block-coded (or packed), and stays that way
+// in memory; it is searched as with -e, but each tile is a few blocks,
+// decoded just before it is scored. The floats of the whole index are
+// never in memory at once, but the index is decoded again for every
+// batch of -q queries.
+//
+// Usage: search [-f [-r rescore]] [-k depth] [-t threads] bins-file
+//                index-file queries-file run-file
+//        search -s [-q batch] [-k depth] [-t threads] bins-file index-file
+//                queries-file run-file
+//        search -e [-q batch] [-k depth] [-t threads] index-file
+//                queries-file run-file
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <immintrin.h>
+
+#include "flat_index.hpp"
+#include "lssy.hpp"
+
+constexpr size_t CHUNK_VECS = 4096;  // decoded and mapped to bins at a time
+constexpr size_t TILE_VECS = 256;    // claimed by a thread at a time, -e and -s
+constexpr size_t QUERY_BATCH = 256;  // queries scored against each tile (-q)
+constexpr size_t BLOCK_VECS = 32;    // vectors scored together, with -f
+constexpr size_t FLUSH_DIMS = 256;   // so that 16-bit sums cannot overflow
+
+struct result {
+  float score;
+  uint64_t docid;
+};
+
+// higher scores first, then lower ids, as a sort order; as a heap order,
+// the worst result so far is at the top
+static bool better(const result &a, const result &b) {
+  return a.score > b.score || (a.score == b.score && a.docid < b.docid);
+}
+
+// keeps the k best results offered to top, as a heap
+static inline void offer(std::vector<result> &top, size_t k,
+    const result &r) {
+  if (top.size() < k) {
+    top.push_back(r);
+    std::push_heap(top.begin(), top.end(), better);
+  } else if (better(r, top.front())) {
+    std::pop_heap(top.begin(), top.end(), better);
+    top.back() = r;
+    std::push_heap(top.begin(), top.end(), better);
+  }
+}
+
+// one line per query: id, then dim floats
+struct query_set {
+  size_t dim = 0;
+  std::vector<std::string> qids;
+  std::vector<float> vecs;
+
+  void load(const std::string &path, size_t want_dim) {
+    std::ifstream in(path);
+    if (!in) {
+      std::cerr << "Error: unable to open " << path << "\n";
+      std::exit(EXIT_FAILURE);
+    }
+    dim = want_dim;
+    std::string line, qid;
+    float f;
+    while (std::getline(in, line)) {
+      std::istringstream fields(line);
+      if (!(fields >> qid)) continue;
+      size_t got = 0;
+      while (fields >> f) {
+        vecs.push_back(f);
+        got++;
+      }
+      if (got != dim) {
+        std::cerr << "Error: query " << qid << " has " << got
+                  << " floats, index has " << dim << "\n";
+        std::exit(EXIT_FAILURE);
+      }
+      qids.push_back(qid);
+    }
+  }
+
+  size_t size() const { return qids.size(); }
+  const float *vec(size_t i) const { return vecs.data() + i*dim; }
+};
+
+// the bin numbers of every vector, and the values they stand for
+template <typename code_t>
+class code_index {
+
+  public:
+    using scratch = std::vector<float>;
+    static constexpr size_t group = 1;   // queries searched together
+
+    code_index(const lssy::model &m, size_t dim, size_t num_vecs)
+      : m_dim(dim), m_num_vecs(num_vecs), m_codes(dim*num_vecs) {
+      m_stride = 0;
+      for (size_t d = 0; d < dim; d++) {
+        m_stride = std::max(m_stride, m.bins(m.dim() ? d : 0));
+      }
+      m_values.assign(dim*m_stride, 0.0f);
+      for (size_t d = 0; d < dim; d++) {
+        size_t col = m.dim() ? d : 0;
+        for (size_t b = 0; b < m.bins(col); b++) {
+          m_values[d*m_stride + b] = m.value(col, b);
+        }
+      }
+    }
+
+    // the bins of vectors first..first+n-1
+    void set(size_t first, const std::vector<uint32_t> &bins) {
+      std::copy(bins.begin(), bins.end(), m_codes.begin() + first*m_dim);
+    }
+
+    size_t bytes() const { return m_codes.size()*sizeof(code_t); }
+
+    // the top k vectors for each of the nq queries at q, best first, into
+    // top[]; lut is scratch space
+    void search(const float *q, size_t nq, size_t k, scratch &lut,
+        std::vector<result> *top) const {
+      lut.resize(m_values.size());
+      for (size_t i = 0; i < nq; i++, q += m_dim) {
+        for (size_t d = 0; d < m_dim; d++) {
+          for (size_t b = 0; b < m_stride; b++) {
+            lut[d*m_stride + b] = q[d]*m_values[d*m_stride + b];
+          }
+        }
+
+        top[i].clear();
+        const code_t *c = m_codes.data();
+        for (uint64_t v = 0; v < m_num_vecs; v++, c += m_dim) {
+          const float *t = lut.data();
+          float score = 0.0f;
+          for (size_t d = 0; d < m_dim; d++, t += m_stride) {
+            score += t[c[d]];
+          }
+          offer(top[i], k, result{score, v});
+        }
+        std::sort_heap(top[i].begin(), top[i].end(), better);
+      }
+    }
+
+  private:
+    size_t m_dim;
+    size_t m_num_vecs;
+    size_t m_stride;               // bins per dimension in the tables
+    std::vector<code_t> m_codes;
+    std::vector<float> m_values;   // S[] of each dimension's table
+};
+
+// fills in ci from a compressed index, or failing that, a FAISS flat index
+template <typename index_t>
+void load_codes(index_t &ci, const lssy::model &m,
+    lssy_index *ix, const mapped_flat_index *flat, size_t dim,
+    size_t num_vecs) {
+  std::vector<float> F(CHUNK_VECS*dim);
+  std::vector<size_t> ids;
+  for (size_t first = 0; first < num_vecs; first += CHUNK_VECS) {
+    size_t n = std::min(CHUNK_VECS, num_vecs - first);
+    if (ix) {
+      ids.resize(n);
+      for (size_t i = 0; i < n; i++) ids[i] = first + i;
+      lssy_index_fetch(ix, ids.data(), n, F.data());
+    } else {
+      flat->floats().copy(first*dim, n*dim, F.data());
+    }
+    ci.set(first, m.bins(F.data(), n*dim));
+  }
+}
+
+// four queries q, four vectors x, both dim floats apart; out[i*4+j] gets
+// the inner product of query i with vector j
+using dot4x4_fn = void (*)(const float *, const float *, size_t, float *);
+
+static void dot4x4_scalar(const float *q, const float *x, size_t dim,
+    float *out) {
+  for (size_t i = 0; i < 4; i++) {
+    for (size_t j = 0; j < 4; j++) {
+      float s = 0.0f;
+      for (size_t d = 0; d < dim; d++) s += q[i*dim + d]*x[j*dim + d];
+      out[i*4 + j] = s;
+    }
+  }
+}
+
+// sums of the lanes
+__attribute__((target("avx")))
+static inline float hsum256(__m256 a) {
+  __m128 h = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+  h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+  h = _mm_add_ss(h, _mm_movehdup_ps(h));
+  return _mm_cvtss_f32(h);
+}
+
+// (by way of memory, as GCC's 512-bit shuffles trip -Wuninitialized in C++)
+__attribute__((target("avx512f")))
+static inline float hsum512(__m512 a) {
+  alignas(64) float t[16];
+  _mm512_store_ps(t, a);
+  return hsum256(_mm256_add_ps(_mm256_load_ps(t), _mm256_load_ps(t + 8)));
+}
+
+__attribute__((target("avx2,fma")))
+static void dot4x4_avx2(const float *q, const float *x, size_t dim,
+    float *out) {
+  __m256 acc[16], xv[4], qv;
+  size_t d = 0;
+  for (size_t a = 0; a < 16; a++) acc[a] = _mm256_setzero_ps();
+  for (; d + 8 <= dim; d += 8) {
+    for (size_t j = 0; j < 4; j++) xv[j] = _mm256_loadu_ps(x + j*dim + d);
+    for (size_t i = 0; i < 4; i++) {
+      qv = _mm256_loadu_ps(q + i*dim + d);
+      for (size_t j = 0; j < 4; j++) {
+        acc[i*4 + j] = _mm256_fmadd_ps(qv, xv[j], acc[i*4 + j]);
+      }
+    }
+  }
+  for (size_t a = 0; a < 16; a++) out[a] = hsum256(acc[a]);
+  for (; d < dim; d++) {
+    for (size_t i = 0; i < 4; i++) {
+      for (size_t j = 0; j < 4; j++) out[i*4 + j] += q[i*dim + d]*x[j*dim + d];
+    }
+  }
+}
+
+__attribute__((target("avx512f")))
+static void dot4x4_avx512(const float *q, const float *x, size_t dim,
+    float *out) {
+  __m512 acc[16], xv[4], qv;
+  size_t d = 0;
+  for (size_t a = 0; a < 16; a++) acc[a] = _mm512_setzero_ps();
+  for (; d + 16 <= dim; d += 16) {
+    for (size_t j = 0; j < 4; j++) xv[j] = _mm512_loadu_ps(x + j*dim + d);
+    for (size_t i = 0; i < 4; i++) {
+      qv = _mm512_loadu_ps(q + i*dim + d);
+      for (size_t j = 0; j < 4; j++) {
+        acc[i*4 + j] = _mm512_fmadd_ps(qv, xv[j], acc[i*4 + j]);
+      }
+    }
+  }
+  if (d < dim) {
+    __mmask16 m = (1u << (dim - d)) - 1;
+    for (size_t j = 0; j < 4; j++) {
+      xv[j] = _mm512_maskz_loadu_ps(m, x + j*dim + d);
+    }
+    for (size_t i = 0; i < 4; i++) {
+      qv = _mm512_maskz_loadu_ps(m, q + i*dim + d);
+      for (size_t j = 0; j < 4; j++) {
+        acc[i*4 + j] = _mm512_fmadd_ps(qv, xv[j], acc[i*4 + j]);
+      }
+    }
+  }
+  for (size_t a = 0; a < 16; a++) out[a] = hsum512(acc[a]);
+}
+
+static dot4x4_fn best_dot4x4() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return dot4x4_avx512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return dot4x4_avx2;
+  }
+  return dot4x4_scalar;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+  return secs.count();
+}
+
+// every query of the batch against vectors first..first+n-1, at x, into
+// the heaps of one thread
+static void score_tile(dot4x4_fn dot, const float *batch, size_t nq,
+    const float *x, uint64_t first, size_t n, size_t dim, size_t k,
+    std::vector<std::vector<result>> &heaps) {
+  std::vector<float> pad;
+  float out[16];
+  for (size_t i = 0; i < nq; i += 4) {
+    for (size_t v = 0; v < n; v += 4) {
+      const float *y = x + v*dim;
+      if (v + 4 > n) {
+        // the last few, with zero vectors to make up four
+        pad.assign(4*dim, 0.0f);
+        std::copy(y, y + (n - v)*dim, pad.begin());
+        y = pad.data();
+      }
+      dot(batch + i*dim, y, dim, out);
+      for (size_t a = 0; a < 4 && i + a < nq; a++) {
+        for (size_t b = 0; b < 4 && v + b < n; b++) {
+          offer(heaps[i + a], k, result{out[a*4 + b], first + v + b});
+        }
+      }
+    }
+  }
+}
+
+// the top k vectors for each query of qs, best first, into results. The
+// queries are taken batch_size at a time, and for each batch the threads
+// claim tiles of the index, which ix.tile() gets ready to be scored,
+// keeping heaps of their own that are merged once the batch is done. The
+// time the threads spend in ix.tile() goes in tile_secs.
+template <typename index_t>
+void search_tiles(const index_t &ix, const query_set &qs, size_t k,
+    size_t batch_size, int threads,
+    std::vector<std::vector<result>> &results, double &tile_secs) {
+  size_t dim = ix.dim(), tile_vecs = ix.tile_vecs();
+  dot4x4_fn dot = best_dot4x4();
+  std::vector<float> batch;
+  std::vector<double> secs(threads, 0.0);
+  results.assign(qs.size(), {});
+  for (size_t first = 0; first < qs.size(); first += batch_size) {
+    size_t nq = std::min(batch_size, qs.size() - first);
+
+    // a multiple of four queries, the extra ones all zero
+    batch.assign((nq + 3)/4*4*dim, 0.0f);
+    std::copy(qs.vec(first), qs.vec(first) + nq*dim, batch.begin());
+
+    std::vector<std::vector<std::vector<result>>> heaps(threads,
+      std::vector<std::vector<result>>(nq));
+    std::atomic<size_t> next{0};
+    auto worker = [&](int t) {
+      std::vector<float> buf;
+      size_t tile;
+      while ((tile = next.fetch_add(1, std::memory_order_relaxed))*
+          tile_vecs < ix.size()) {
+        uint64_t v0 = tile*tile_vecs;
+        size_t n = std::min(tile_vecs, ix.size() - v0);
+        auto start = std::chrono::steady_clock::now();
+        const float *x = ix.tile(v0, n, buf);
+        secs[t] += seconds_since(start);
+        score_tile(dot, batch.data(), nq, x, v0, n, dim, k, heaps[t]);
+      }
+    };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++) pool.emplace_back(worker, t);
+    worker(0);
+    for (auto &t : pool) t.join();
+
+    // and then the threads' heaps are merged
+    for (size_t i = 0; i < nq; i++) {
+      std::vector<result> &top = results[first + i];
+      for (int t = 0; t < threads; t++) {
+        top.insert(top.end(), heaps[t][i].begin(), heaps[t][i].end());
+      }
+      size_t keep = std::min(k, top.size());
+      std::partial_sort(top.begin(), top.begin() + keep, top.end(), better);
+      top.resize(keep);
+    }
+  }
+  tile_secs = 0.0;
+  for (double t : secs) tile_secs += t;
+}
+
+// the floats of a mapped flat index, for exact search; each tile is copied
+// out of the mapping, aligned, to a buffer small enough to stay in cache
+// while a batch is scored against it
+class float_index {
+
+  public:
+    explicit float_index(const mapped_flat_index &flat)
+      : m_dim(flat.dim()), m_num_vecs(flat.size()), m_floats(flat.floats()) {}
+
+    size_t dim() const { return m_dim; }
+    size_t size() const { return m_num_vecs; }
+    size_t bytes() const { return m_floats.size()*sizeof(float); }
+    size_t tile_vecs() const { return TILE_VECS; }
+
+    const float *tile(uint64_t first, size_t n, std::vector<float> &buf) const {
+      buf.resize(n*m_dim);
+      m_floats.copy(first*m_dim, n*m_dim, buf.data());
+      return buf.data();
+    }
+
+  private:
+    size_t m_dim;
+    size_t m_num_vecs;
+    float_span m_floats;
+};
+
+// with -s, a block-coded (or packed) index, which stays coded in memory.
+// A tile is as many whole blocks as make up TILE_VECS vectors (or just
+// one, if it is bigger), decoded to a buffer of the thread's own just
+// before it is scored, so that the floats of the whole index never are
+// in memory at once.
+class coded_index {
+
+  public:
+    explicit coded_index(const lssy::index &ix) : m_ix(ix) {
+      size_t vpb = ix.vecs_per_block();
+      m_tile_vecs = std::max<size_t>(1, TILE_VECS/vpb)*vpb;
+    }
+
+    size_t dim() const { return m_ix.dim(); }
+    size_t size() const { return m_ix.size(); }
+    size_t bytes() const { return m_ix.bytes(); }
+    size_t tile_vecs() const { return m_tile_vecs; }
+
+    const float *tile(uint64_t first, size_t n, std::vector<float> &buf) const {
+      buf.resize(n*dim());
+      m_ix.fetch_range(first, n, buf.data());
+      return buf.data();
+    }
+
+  private:
+    const lssy::index &m_ix;
+    size_t m_tile_vecs;
+};
+
+// one block of 32 vectors at four bits a dimension (see fastscan_index)
+// scored against a quantized table; sums[j] gets the score of vector j
+using scan_fn = void (*)(const uint8_t *, const uint8_t *, size_t,
+  uint32_t *);
+
+static void scan_block_scalar(const uint8_t *codes, const uint8_t *qlut,
+    size_t dim4, uint32_t *sums) {
+  for (size_t j = 0; j < BLOCK_VECS; j++) {
+    const uint8_t *c = codes + j%16;
+    int shift = j < 16 ? 0 : 4;
+    uint32_t sum = 0;
+    for (size_t d = 0; d < dim4; d++) sum += qlut[d*16 + (c[d*16] >> shift & 15)];
+    sums[j] = sum;
+  }
+}
+
+// acc[a*8 + i] holds the sum of vector i*2 + a%2 of half a/2 of the block
+static inline void unscramble(const uint32_t *acc, uint32_t *sums) {
+  for (size_t a = 0; a < 4; a++) {
+    for (size_t i = 0; i < 8; i++) sums[(a >> 1)*16 + i*2 + (a & 1)] = acc[a*8 + i];
+  }
+}
+
+// a pair of dimensions at a time, one in each 128-bit lane. The bytes of
+// each shuffle are added to 16-bit sums of the even and odd vectors: the
+// odd ones shifted down, and the even ones as they are, less the odd sums
+// shifted up afterwards. These are widened and added into 32-bit sums
+// before they can overflow, the two lanes (which are for different
+// dimensions of the same vectors) together.
+__attribute__((target("avx2")))
+static void scan_block_avx2(const uint8_t *codes, const uint8_t *qlut,
+    size_t dim4, uint32_t *sums) {
+  const __m256i low4 = _mm256_set1_epi8(0x0f);
+  alignas(32) uint32_t acc32[4*8];
+  __m256i acc[4], wide[4];
+  for (size_t a = 0; a < 4; a++) wide[a] = _mm256_setzero_si256();
+  for (size_t d0 = 0; d0 < dim4; d0 += FLUSH_DIMS) {
+    size_t d1 = std::min(d0 + FLUSH_DIMS, dim4);
+    for (size_t a = 0; a < 4; a++) acc[a] = _mm256_setzero_si256();
+    for (size_t d = d0; d < d1; d += 2) {
+      __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(codes + d*16));
+      __m256i t = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(qlut + d*16));
+      __m256i lo = _mm256_shuffle_epi8(t, _mm256_and_si256(c, low4));
+      __m256i hi = _mm256_shuffle_epi8(t,
+        _mm256_and_si256(_mm256_srli_epi16(c, 4), low4));
+      acc[0] = _mm256_add_epi16(acc[0], lo);
+      acc[1] = _mm256_add_epi16(acc[1], _mm256_srli_epi16(lo, 8));
+      acc[2] = _mm256_add_epi16(acc[2], hi);
+      acc[3] = _mm256_add_epi16(acc[3], _mm256_srli_epi16(hi, 8));
+    }
+    acc[0] = _mm256_sub_epi16(acc[0], _mm256_slli_epi16(acc[1], 8));
+    acc[2] = _mm256_sub_epi16(acc[2], _mm256_slli_epi16(acc[3], 8));
+    for (size_t a = 0; a < 4; a++) {
+      wide[a] = _mm256_add_epi32(wide[a], _mm256_add_epi32(
+        _mm256_cvtepu16_epi32(_mm256_extracti128_si256(acc[a], 0)),
+        _mm256_cvtepu16_epi32(_mm256_extracti128_si256(acc[a], 1))));
+    }
+  }
+  for (size_t a = 0; a < 4; a++) {
+    _mm256_store_si256(reinterpret_cast<__m256i *>(acc32 + a*8), wide[a]);
+  }
+  unscramble(acc32, sums);
+}
+
+// and four dimensions at a time, two lanes of the sums widened together
+__attribute__((target("avx512f,avx512bw")))
+static void scan_block_avx512(const uint8_t *codes, const uint8_t *qlut,
+    size_t dim4, uint32_t *sums) {
+  const __m512i low4 = _mm512_set1_epi8(0x0f);
+  alignas(64) uint32_t wide32[16], acc32[4*8];
+  __m512i acc[4], wide[4];
+  for (size_t a = 0; a < 4; a++) wide[a] = _mm512_setzero_si512();
+  for (size_t d0 = 0; d0 < dim4; d0 += FLUSH_DIMS) {
+    size_t d1 = std::min(d0 + FLUSH_DIMS, dim4);
+    for (size_t a = 0; a < 4; a++) acc[a] = _mm512_setzero_si512();
+    for (size_t d = d0; d < d1; d += 4) {
+      __m512i c = _mm512_loadu_si512(codes + d*16);
+      __m512i t = _mm512_loadu_si512(qlut + d*16);
+      __m512i lo = _mm512_shuffle_epi8(t, _mm512_and_si512(c, low4));
+      __m512i hi = _mm512_shuffle_epi8(t,
+        _mm512_and_si512(_mm512_srli_epi16(c, 4), low4));
+      acc[0] = _mm512_add_epi16(acc[0], lo);
+      acc[1] = _mm512_add_epi16(acc[1], _mm512_srli_epi16(lo, 8));
+      acc[2] = _mm512_add_epi16(acc[2], hi);
+      acc[3] = _mm512_add_epi16(acc[3], _mm512_srli_epi16(hi, 8));
+    }
+    acc[0] = _mm512_sub_epi16(acc[0], _mm512_slli_epi16(acc[1], 8));
+    acc[2] = _mm512_sub_epi16(acc[2], _mm512_slli_epi16(acc[3], 8));
+    for (size_t a = 0; a < 4; a++) {
+      // (the masked forms, as the others trip -Wuninitialized, see hsum512)
+      wide[a] = _mm512_add_epi32(wide[a], _mm512_add_epi32(
+        _mm512_maskz_cvtepu16_epi32(0xffff,
+          _mm512_maskz_extracti64x4_epi64(0xff, acc[a], 0)),
+        _mm512_maskz_cvtepu16_epi32(0xffff,
+          _mm512_maskz_extracti64x4_epi64(0xff, acc[a], 1))));
+    }
+  }
+  // and the last two lanes, by way of memory, as with hsum512
+  for (size_t a = 0; a < 4; a++) {
+    _mm512_store_si512(wide32, wide[a]);
+    for (size_t i = 0; i < 8; i++) acc32[a*8 + i] = wide32[i] + wide32[8 + i];
+  }
+  unscramble(acc32, sums);
+}
+
+static scan_fn best_scan() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512bw")) return scan_block_avx512;
+  if (__builtin_cpu_supports("avx2")) return scan_block_avx2;
+  return scan_block_scalar;
+}
+
+// with -f, for tables of at most 16 bins, the bin numbers at four bits a
+// dimension, in blocks of 32 vectors: for each dimension of a block, 16
+// bytes, vector j in the low half of byte j, and vector j+16 in the high
+// half. For each query, the table of q[d] * S[b] is quantized to eight
+// bits (each dimension less its least entry, on a scale shared by all of
+// them), so that a block can be scored a few dimensions at a time with
+// byte shuffles that look up 32 vectors at once. The best few of these
+// approximate scores are then rescored with the float table, to give the
+// same scores as the search over code_index.
+class fastscan_index {
+
+  public:
+    struct scratch {
+      std::vector<float> lut;
+      std::vector<uint8_t> qlut;
+      std::vector<std::vector<result>> cand;
+      std::vector<float> bar;    // least score that could be a candidate
+    };
+    static constexpr size_t group = 16;
+
+    fastscan_index(const lssy::model &m, size_t dim, size_t num_vecs,
+        size_t depth)
+      : m_dim(dim), m_dim4((dim + 3)/4*4), m_num_vecs(num_vecs),
+        m_depth(depth), m_scan(best_scan()),
+        m_codes((num_vecs + BLOCK_VECS - 1)/BLOCK_VECS*m_dim4*16, 0),
+        m_values(m_dim4*16, 0.0f) {
+      // bins past the last are given its value, so that they do not
+      // stretch the range of the quantized table
+      for (size_t d = 0; d < dim; d++) {
+        size_t col = m.dim() ? d : 0;
+        for (size_t b = 0; b < 16; b++) {
+          m_values[d*16 + b] = m.value(col, std::min(b, m.bins(col) - 1));
+        }
+      }
+    }
+
+    void set(size_t first, const std::vector<uint32_t> &bins) {
+      for (size_t i = 0; i < bins.size()/m_dim; i++) {
+        size_t v = first + i;
+        uint8_t *c = block(v/BLOCK_VECS) + v%16;
+        int shift = v%BLOCK_VECS < 16 ? 0 : 4;
+        for (size_t d = 0; d < m_dim; d++) {
+          c[d*16] |= bins[i*m_dim + d] << shift;
+        }
+      }
+    }
+
+    size_t bytes() const { return m_codes.size(); }
+
+    // the top k vectors for each of the nq queries at q, best first, into
+    // top[]
+    void search(const float *q, size_t nq, size_t k, scratch &s,
+        std::vector<result> *top) const {
+      s.lut.resize(nq*m_values.size());
+      s.qlut.resize(nq*m_values.size());
+      s.cand.resize(nq);
+      s.bar.assign(nq, -1.0f);
+      for (size_t i = 0; i < nq; i++) {
+        make_tables(q + i*m_dim, s.lut.data() + i*m_values.size(),
+          s.qlut.data() + i*m_values.size());
+        s.cand[i].clear();
+      }
+
+      // the candidates, every query of the group against a block while it
+      // is in cache; ids only go up, so a vector that just ties with the
+      // worst of them would not be kept
+      uint32_t sums[BLOCK_VECS];
+      for (size_t blk = 0; blk*BLOCK_VECS < m_num_vecs; blk++) {
+        uint64_t v0 = blk*BLOCK_VECS;
+        size_t n = std::min(BLOCK_VECS, m_num_vecs - v0);
+        for (size_t i = 0; i < nq; i++) {
+          m_scan(block(blk), s.qlut.data() + i*m_values.size(), m_dim4, sums);
+          for (size_t j = 0; j < n; j++) {
+            if (sums[j] > s.bar[i]) {
+              offer(s.cand[i], m_depth,
+                result{static_cast<float>(sums[j]), v0 + j});
+              if (s.cand[i].size() == m_depth) {
+                s.bar[i] = s.cand[i].front().score;
+              }
+            }
+          }
+        }
+      }
+
+      for (size_t i = 0; i < nq; i++) {
+        rescore(s.lut.data() + i*m_values.size(), s.cand[i], k, top[i]);
+      }
+    }
+
+  private:
+    const uint8_t *block(size_t blk) const {
+      return m_codes.data() + blk*m_dim4*16;
+    }
+    uint8_t *block(size_t blk) { return m_codes.data() + blk*m_dim4*16; }
+
+    // the float table for query q, and the same quantized to eight bits:
+    // each dimension less its least entry, on a scale shared by all
+    void make_tables(const float *q, float *lut, uint8_t *qlut) const {
+      float span = 0.0f;
+      for (size_t d = 0; d < m_dim4; d++) {
+        float *t = lut + d*16;
+        float qd = d < m_dim ? q[d] : 0.0f;
+        for (size_t b = 0; b < 16; b++) t[b] = qd*m_values[d*16 + b];
+        span = std::max(span, *std::max_element(t, t + 16) -
+          *std::min_element(t, t + 16));
+      }
+      float scale = span > 0.0f ? 255.0f/span : 0.0f;
+      for (size_t d = 0; d < m_dim4; d++) {
+        const float *t = lut + d*16;
+        float low = *std::min_element(t, t + 16);
+        for (size_t b = 0; b < 16; b++) {
+          long c = std::lrint((t[b] - low)*scale);
+          qlut[d*16 + b] = static_cast<uint8_t>(std::min(c, 255L));
+        }
+      }
+    }
+
+    // the candidates as code_index would score them, but eight at a time,
+    // so that each one's sum need not wait on the one before
+    void rescore(const float *lut, const std::vector<result> &cand,
+        size_t k, std::vector<result> &top) const {
+      constexpr size_t G = 8;
+      const uint8_t *c[G];
+      int shift[G];
+      float score[G];
+      top.clear();
+      for (size_t i = 0; i < cand.size(); i += G) {
+        size_t n = std::min(G, cand.size() - i);
+        for (size_t g = 0; g < G; g++) {
+          uint64_t v = cand[i + std::min(g, n - 1)].docid;
+          c[g] = block(v/BLOCK_VECS) + v%16;
+          shift[g] = v%BLOCK_VECS < 16 ? 0 : 4;
+          score[g] = 0.0f;
+        }
+        for (size_t d = 0; d < m_dim; d++) {
+          const float *t = lut + d*16;
+          for (size_t g = 0; g < G; g++) {
+            score[g] += t[c[g][d*16] >> shift[g] & 15];
+          }
+        }
+        for (size_t g = 0; g < n; g++) {
+          offer(top, k, result{score[g], cand[i + g].docid});
+        }
+      }
+      std::sort_heap(top.begin(), top.end(), better);
+    }
+
+    size_t m_dim;
+    size_t m_dim4;                 // dim, padded out with zeros to four
+    size_t m_num_vecs;
+    size_t m_depth;                // candidates rescored
+    scan_fn m_scan;
+    std::vector<uint8_t> m_codes;
+    std::vector<float> m_values;   // S[] of each dimension's table
+};
+
+// the score as numpy prints a float32, which is what run-faiss.py writes:
+// the shortest digits that give back the float, as 1e-05 or 1.5e+16, but
+// written out in full for zero and for 1e-4 <= |x| < 1e16, with zeros to
+// fill the places past the digits, and a ".0" if there is no point
+static std::string format_score(float score) {
+  char buf[64];
+  auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), score,
+      std::chars_format::scientific);
+  std::string s(buf, end);
+  float mag = std::fabs(score);
+  if (!std::isfinite(score) || (mag != 0 && (mag < 1e-4f || mag >= 1e16f))) {
+    return s;
+  }
+
+  // the digits and the exponent of the first, then the point put in
+  size_t e = s.find('e');
+  int exp = std::atoi(s.c_str() + e + 1);
+  bool neg = std::signbit(score);
+  std::string digits;
+  for (size_t i = neg; i < e; i++) {
+    if (s[i] != '.') digits += s[i];
+  }
+  std::string out = neg ? "-" : "";
+  if (exp < 0) {
+    out += "0." + std::string(-exp - 1, '0') + digits;
+  } else {
+    if (digits.size() < size_t(exp) + 1) digits.resize(exp + 1, '0');
+    out += digits.substr(0, exp + 1) + ".";
+    out += digits.size() > size_t(exp) + 1 ? digits.substr(exp + 1) : "0";
+  }
+  return out;
+}
+
+static void write_run(const query_set &qs,
+    const std::vector<std::vector<result>> &results, std::ostream &out) {
+  for (size_t i = 0; i < qs.size(); i++) {
+    for (size_t r = 0; r < results[i].size(); r++) {
+      out << qs.qids[i] << " Q0 " << results[i][r].docid << " " << r+1
+          << " " << format_score(results[i][r].score) << " FAISS\n";
+    }
+  }
+}
+
+static void report(const query_set &qs, size_t k, int threads,
+    double secs) {
+  std::cerr << "searched " << qs.size() << " queries to depth " << k
+            << " on " << threads << " threads in " << secs
+            << " seconds, " << qs.size()/secs << " queries/s\n";
+}
+
+template <typename index_t>
+void run(index_t &ci, const lssy::model &m, lssy_index *ix,
+    const mapped_flat_index *flat, size_t dim, size_t num_vecs,
+    const query_set &qs,
+    size_t k, int threads, std::ostream &out) {
+  load_codes(ci, m, ix, flat, dim, num_vecs);
+  std::cerr << "holding " << num_vecs << " vectors of " << dim
+            << " bin numbers, " << 8.0*ci.bytes()/(num_vecs*dim)
+            << " bits/dim\n";
+
+  // queries are shared out between the threads, a group at a time
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::vector<result>> results(qs.size());
+  std::atomic<size_t> next{0};
+  auto worker = [&]() {
+    typename index_t::scratch scratch;
+    size_t i;
+    while ((i = next.fetch_add(index_t::group, std::memory_order_relaxed)) <
+        qs.size()) {
+      ci.search(qs.vec(i), std::min(index_t::group, qs.size() - i), k,
+        scratch, results.data() + i);
+    }
+  };
+  std::vector<std::thread> pool;
+  for (int t = 1; t < threads; t++) pool.emplace_back(worker);
+  worker();
+  for (auto &t : pool) t.join();
+  report(qs, k, threads, seconds_since(start));
+  write_run(qs, results, out);
+}
+
+// with -e, just the floats
+static int run_exact(const char *index_file, const char *queries_file,
+    const char *run_file, size_t k, size_t batch, int threads) {
+  mapped_flat_index flat(index_file);
+  float_index fi(flat);
+  std::cerr << "holding " << fi.size() << " vectors of " << fi.dim()
+            << " floats, " << fi.bytes() << " bytes\n";
+
+  query_set qs;
+  qs.load(queries_file, fi.dim());
+  std::ofstream out(run_file);
+  if (!out) {
+    std::cerr << "Error: unable to write " << run_file << "\n";
+    return EXIT_FAILURE;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::vector<result>> results;
+  double tile_secs;
+  search_tiles(fi, qs, k, batch, threads, results, tile_secs);
+  report(qs, k, threads, seconds_since(start));
+  write_run(qs, results, out);
+  return 0;
+}
+
+// with -s, the floats of a coded index, a few blocks at a time
+static int run_stream(const char *bins_file, const char *index_file,
+    const char *queries_file, const char *run_file, size_t k, size_t batch,
+    int threads) {
+  lssy::model m(bins_file);
+  lssy::index ix(m, index_file);
+  coded_index ci(ix);
+  std::cerr << "holding " << ci.size() << " vectors of " << ci.dim()
+            << " floats coded in " << ci.bytes() << " bytes, "
+            << 8.0*ci.bytes()/(ci.size()*ci.dim()) << " bits/float, "
+            << "decoded " << ci.tile_vecs() << " vectors at a time\n";
+
+  query_set qs;
+  qs.load(queries_file, ci.dim());
+  std::ofstream out(run_file);
+  if (!out) {
+    std::cerr << "Error: unable to write " << run_file << "\n";
+    return EXIT_FAILURE;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::vector<result>> results;
+  double tile_secs;
+  search_tiles(ci, qs, k, batch, threads, results, tile_secs);
+  double secs = seconds_since(start);
+  report(qs, k, threads, secs);
+  std::cerr << "decoded the index " << (qs.size() + batch - 1)/batch
+            << " times, once for every " << batch << " queries, "
+            << 100.0*tile_secs/(threads*secs) << "% of the time\n";
+  write_run(qs, results, out);
+  return 0;
+}
+
+static void usage(const char *prog) {
+  std::cerr << "Usage: " << prog << " [-f [-r rescore]] [-k depth] "
+            << "[-t threads] bins-file index-file queries-file run-file\n"
+            << "       " << prog << " -s [-q batch] [-k depth] [-t threads] "
+            << "bins-file index-file queries-file run-file\n"
+            << "       " << prog << " -e [-q batch] [-k depth] [-t threads] "
+            << "index-file queries-file run-file\n";
+  std::exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  size_t k = 1000, depth = 0, batch = 0;
+  int threads = std::thread::hardware_concurrency();
+  bool exact = false, fast = false, stream = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "efk:q:r:st:")) != -1) {
+    switch (opt) {
+    case 'e':
+      exact = true;
+      break;
+    case 'f':
+      fast = true;
+      break;
+    case 'q':
+      batch = std::atol(optarg);
+      if (batch < 1) usage(argv[0]);
+      break;
+    case 'r':
+      depth = std::atol(optarg);
+      if (depth < 1) usage(argv[0]);
+      break;
+    case 's':
+      stream = true;
+      break;
+    case 'k':
+      k = std::atol(optarg);
+      if (k < 1) usage(argv[0]);
+      break;
+    case 't':
+      threads = std::atoi(optarg);
+      if (threads < 1) usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind != (exact ? 3 : 4) || exact + fast + stream > 1 ||
+      (depth && !fast) || (batch && !exact && !stream)) {
+    usage(argv[0]);
+  }
+  if (threads < 1) threads = 1;
+  if (!batch) batch = QUERY_BATCH;
+  if (exact) {
+    return run_exact(argv[optind], argv[optind+1], argv[optind+2], k,
+      batch, threads);
+  }
+  if (stream) {
+    try {
+      return run_stream(argv[optind], argv[optind+1], argv[optind+2],
+        argv[optind+3], k, batch, threads);
+    } catch (const lssy::error &e) {
+      std::cerr << "Error: " << e.what() << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  try {
+    lssy::model m(argv[optind]);
+
+    // a compressed index if possible, otherwise a flat one
+    size_t dim, num_vecs;
+    std::unique_ptr<mapped_flat_index> flat;
+    lssy_index *ix = lssy_index_open(m.get(), argv[optind+1]);
+    if (ix) {
+      dim = lssy_index_dim(ix);
+      num_vecs = lssy_index_vectors(ix);
+    } else {
+      flat = std::make_unique<mapped_flat_index>(argv[optind+1]);
+      flat->sequential();
+      dim = flat->dim();
+      num_vecs = flat->size();
+    }
+    if (m.dim() && m.dim() != dim) {
+      std::cerr << "Error: bins file is for vectors of " << m.dim()
+                << " floats, index has " << dim << "\n";
+      return EXIT_FAILURE;
+    }
+
+    query_set qs;
+    qs.load(argv[optind+2], dim);
+    std::ofstream out(argv[optind+3]);
+    if (!out) {
+      std::cerr << "Error: unable to write " << argv[optind+3] << "\n";
+      return EXIT_FAILURE;
+    }
+
+    size_t max_bins = 0;
+    for (size_t d = 0; d < (m.dim() ? m.dim() : 1); d++) {
+      max_bins = std::max(max_bins, m.bins(d));
+    }
+    if (fast) {
+      if (max_bins > 16) {
+        std::cerr << "Error: -f needs at most 16 bins in each table\n";
+        return EXIT_FAILURE;
+      }
+      fastscan_index fs(m, dim, num_vecs, depth ? depth : 2*k);
+      run(fs, m, ix, flat.get(), dim, num_vecs, qs, k, threads, out);
+    } else if (max_bins <= 256) {
+      code_index<uint8_t> ci(m, dim, num_vecs);
+      run(ci, m, ix, flat.get(), dim, num_vecs, qs, k, threads, out);
+    } else if (max_bins > 65536) {
+      std::cerr << "Error: too many bins, at most 65536 are allowed\n";
+      return EXIT_FAILURE;
+    } else {
+      code_index<uint16_t> ci(m, dim, num_vecs);
+      run(ci, m, ix, flat.get(), dim, num_vecs, qs, k, threads, out);
+    }
+    lssy_index_close(ix);
+  } catch (const lssy::error &e) {
+    std::cerr << "Error: " << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
+  return 0;
+}
@@ -4,7 +4,9 @@
 #include <ios>
 #include <cstring>
 #include <cstdlib>
-#include <execution>
+
+#include "flat_index.hpp"
+#include "radix_sort.hpp"
 
 /* The fourcc code for indexes.
 // Flat gets "IFxI"
@@ -34,61 +36,15 @@ uint32_t prune_lsb(uint32_t value, uint32_t b) {
 }
 
 
-// 37 bytes before the data begins
-struct flat_header {
-  uint32_t fourcc;  // 'IFxI'
-  int32_t  dim;     // Vector dimensionality
-  int64_t  ntotal;  // Number of vectors stored
-  int64_t  dummy_a; // A dummy value, 1 << 20
-  int64_t  dummy_b; // A dummy value, 1 << 20
-  bool     trained; // Is the model trained? Meaningless here.
-  uint32_t   metric;  // Metric type; actually an enum in FAISS, meaningless here.
-
-  // Loads into self from an istream
-  void load(std::istream& in) {
-    in.read(reinterpret_cast<char *>(&fourcc), sizeof(uint32_t));
-    in.read(reinterpret_cast<char *>(&dim), sizeof(int32_t));
-    in.read(reinterpret_cast<char *>(&ntotal), sizeof(int64_t));
-    in.read(reinterpret_cast<char *>(&dummy_a), sizeof(int64_t));
-    in.read(reinterpret_cast<char *>(&dummy_b), sizeof(int64_t));
-    in.read(reinterpret_cast<char *>(&trained), sizeof(bool));
-    in.read(reinterpret_cast<char *>(&metric), sizeof(uint32_t));
-  }
-
-  // Back to disk
-  void write(std::ostream& out) {
-    out.write(reinterpret_cast<const char *>(&fourcc), sizeof(uint32_t));
-    out.write(reinterpret_cast<char *>(&dim), sizeof(int32_t));
-    out.write(reinterpret_cast<char *>(&ntotal), sizeof(int64_t));
-    out.write(reinterpret_cast<char *>(&dummy_a), sizeof(int64_t));
-    out.write(reinterpret_cast<char *>(&dummy_b), sizeof(int64_t));
-    out.write(reinterpret_cast<char *>(&trained), sizeof(bool));
-    out.write(reinterpret_cast<char *>(&metric), sizeof(uint32_t));
-  }
-
-  void info() const {
-    std::cout << "Dim    = " << dim << "\n"
-              << "Ntotal = " << ntotal << "\n";
-  }
-
-};
-
 // Everything we need to store/recover vectors
 class vector_data_32 {
 
   public:
     vector_data_32(size_t dim, size_t ntotal) : m_dimensions(dim), m_num_vectors(ntotal) {}
 
-    // Loads into self from an istream and checks vector length
-    void load(std::istream& in) {
-      size_t vals_to_read;
-      in.read(reinterpret_cast<char *>(&vals_to_read), sizeof(size_t));
-      m_codes.resize(vals_to_read); // This is in terms of bytes
-      in.read(reinterpret_cast<char *>(&m_codes[0]), vals_to_read * sizeof(float));
-      if (!in) {
-        std::cout << "Error: only " << in.gcount() << " bytes could be read\n";
-        std::exit(-1);
-      }
+    // Copies the floats of a mapped index, as sorting changes them
+    void load(const float_span& floats) {
+      m_codes = floats.to_vector();
     }
 
     void truncate_bits(uint32_t bits) {
@@ -104,7 +60,7 @@ class vector_data_32 {
     }
 
     void sort() {
-      std::sort(std::execution::par_unseq, m_codes.begin(), m_codes.end());
+      radix_sorter().sort(m_codes.data(), m_codes.size());
     }
 
     // New format
@@ -169,12 +125,11 @@ int main(int argc, char **argv) {
     return -1;
   }
 
-  // Load the FAISS flat index
-  std::ifstream ifs(argv[1], std::ios::binary);
-  flat_header fh;
-  fh.load(ifs);
-  vector_data_32 idx(fh.dim, fh.ntotal);
-  idx.load(ifs);
+  // Map the FAISS flat index
+  mapped_flat_index flat(argv[1]);
+  flat.sequential();
+  vector_data_32 idx(flat.dim(), flat.size());
+  idx.load(flat.floats());
 
   idx.sort();
   std::ofstream ofs(argv[2], std::ios::binary);
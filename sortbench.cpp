@@ -0,0 +1,121 @@
+// Times the radix sort of radix_sort.hpp against std::sort with the
+// parallel execution policy (TBB underneath), which faiss2simple used to
+// sort with, on the same floats, and checks that the two agree.
+//
+// The floats are those of a FAISS flat index if one is given, and
+// otherwise -n million normally distributed ones, much like the values
+// of an embedding. Each sort is run -r times on a fresh copy of the
+// floats, and the best time kept. The radix sort uses -t threads
+// (default: all cores), and std::sort as many as TBB gives it.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <execution>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "flat_index.hpp"
+#include "radix_sort.hpp"
+
+static void usage(const char *prog) {
+  std::cerr << "Usage " << prog << " [-t threads] [-n millions] [-r repeats] [path_to_flat_FAISS_index]\n";
+  std::exit(-1);
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Best time of repeats runs of sort on a fresh copy of floats, leaving
+// the last run's result in out
+template <typename F>
+static double best_time(const std::vector<float>& floats, std::vector<float>& out, int repeats, F sort) {
+  double best = 0;
+  for (int r = 0; r < repeats; ++r) {
+    out = floats;
+    auto start = std::chrono::steady_clock::now();
+    sort(out);
+    double secs = seconds_since(start);
+    if (r == 0 || secs < best) {
+      best = secs;
+    }
+  }
+  return best;
+}
+
+static void report(const char *label, size_t n, double secs) {
+  std::printf("%-28s %8.3f s %9.1f Mfloats/s %7.2f GB/s\n", label, secs,
+              n / secs / 1e6, n * sizeof(float) / secs / 1e9);
+}
+
+int main(int argc, char **argv) {
+
+  unsigned threads = 0;
+  size_t millions = 100;
+  int repeats = 3;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:n:r:")) != -1) {
+    switch (opt) {
+    case 't':
+      threads = std::atoi(optarg);
+      break;
+    case 'n':
+      millions = std::atol(optarg);
+      if (millions == 0) usage(argv[0]);
+      break;
+    case 'r':
+      repeats = std::atoi(optarg);
+      if (repeats < 1) usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind > 1) {
+    usage(argv[0]);
+  }
+
+  std::vector<float> floats;
+  if (optind < argc) {
+    mapped_flat_index flat(argv[optind]);
+    flat.sequential();
+    floats = flat.floats().to_vector();
+  } else {
+    std::mt19937 gen(42);
+    std::normal_distribution<float> normal(0.0f, 0.05f);
+    floats.resize(millions * 1000000);
+    for (auto& f : floats) {
+      f = normal(gen);
+    }
+  }
+  size_t n = floats.size();
+  radix_sorter radix(threads);
+  std::vector<float> expect, got;
+  std::unique_ptr<float[]> scratch(new float[n]);
+
+  std::printf("sorting %zu floats, best of %d\n", n, repeats);
+  double t_std = best_time(floats, expect, repeats, [](std::vector<float>& v) {
+    std::sort(std::execution::par_unseq, v.begin(), v.end());
+  });
+  report("std::sort par_unseq", n, t_std);
+
+  double t_radix = best_time(floats, got, repeats, [&](std::vector<float>& v) {
+    radix.sort(v.data(), v.size(), scratch.get());
+  });
+  std::string label = "radix_sort, " + std::to_string(threads ? threads : std::thread::hardware_concurrency()) + " threads";
+  report(label.c_str(), n, t_radix);
+  std::printf("radix sort %.2f times as fast\n", t_std / t_radix);
+
+  // -0.0 and 0.0 compare equal, so may come out of std::sort either way
+  if (!std::equal(expect.begin(), expect.end(), got.begin())) {
+    std::cerr << "Error: the two sorts disagree\n";
+    return -1;
+  }
+  return 0;
+}